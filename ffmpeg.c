@@ -79,6 +79,10 @@
 #endif
 #include <time.h>
 
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #include "cmdutils.h"
 
 #include "libavutil/avassert.h"
@@ -172,7 +176,6 @@ static int loop_output = AVFMT_NOOUTPUTLOOP;
 static int qp_hist = 0;
 #if CONFIG_AVFILTER
 static char *vfilters = NULL;
-static AVFilterGraph *graph = NULL;
 #endif
 
 static int intra_only = 0;
@@ -236,8 +239,6 @@ static int q_pressed = 0;
 static int64_t video_size = 0;
 static int64_t audio_size = 0;
 static int64_t extra_size = 0;
-static int nb_frames_dup = 0;
-static int nb_frames_drop = 0;
 static int input_sync;
 static uint64_t limit_filesize = 0;
 static int force_fps = 0;
@@ -303,6 +304,31 @@ typedef struct AVOutputStream {
     AVAudioConvert *reformat_ctx;
     AVFifoBuffer *fifo;     /* for compression: one audio fifo per codec */
     FILE *logfile;
+
+    int nb_frames_dup;
+    int nb_frames_drop;
+
+#if CONFIG_AVFILTER
+    AVFilterGraph *graph;
+    AVFilterContext *output_video_filter;
+    AVFilterContext *input_video_filter;
+    AVFilterBufferRef *picref;
+    char *avfilter;          /* filter chain given with -vf for this stream */
+#endif
+
+#if HAVE_PTHREADS
+    /* video encoding in a thread of its own, see encode_thread() */
+    int encode_thread_started;
+    pthread_t encode_thread;
+    pthread_mutex_t encode_lock;
+    pthread_cond_t encode_cond;
+    int encode_request;      /* 1 while a picture is being encoded, -1 to stop the thread */
+    AVFormatContext *encode_os;
+    struct AVInputStream *encode_ist;
+    AVFrame *encode_picture;
+    uint8_t *bit_buffer;     /* output buffer of the encoder */
+    AVPacketList *encoded_packets, *encoded_packets_end; /* packets the main thread writes */
+#endif
 } AVOutputStream;
 
 static AVOutputStream **output_streams_for_file[MAX_FILES] = { NULL };
@@ -312,6 +338,8 @@ typedef struct AVInputStream {
     int file_index;
     int index;
     AVStream *st;
+    AVCodecContext *dec;     /* decoding context, st->codec unless a demuxing
+                                thread parses with a copy of it there */
     int discard;             /* true if stream data should be discarded */
     int decoding_needed;     /* true if the packets must be decoded in 'raw_fifo' */
     int64_t sample_index;      /* current sample */
@@ -320,16 +348,19 @@ typedef struct AVInputStream {
     int64_t       next_pts;  /* synthetic pts for cases where pkt.pts
                                 is not defined */
     int64_t       pts;       /* current pts */
+    int64_t       next_dts;  /* synthetic dts given to frame-threaded
+                                decoders, advanced for every packet */
     PtsCorrectionContext pts_ctx;
     int is_start;            /* is 1 at the start and after a discontinuity */
     int showed_multi_packet_warning;
     int is_past_recording_time;
+    int repeat_pict;         /* repeat_pict of the parser for the last packet read,
+                                -1 without parser */
+    AVCodecParserContext *parser; /* parser of the stream when the last packet
+                                     was read, for stream copy */
 #if CONFIG_AVFILTER
-    AVFilterContext *output_video_filter;
-    AVFilterContext *input_video_filter;
     AVFrame *filter_frame;
     int has_filter_frame;
-    AVFilterBufferRef *picref;
 #endif
 } AVInputStream;
 
@@ -338,8 +369,28 @@ typedef struct AVInputFile {
     int ist_index;        /* index of first stream in ist_table */
     int buffer_size;      /* current total buffer size */
     int nb_streams;       /* nb streams we are aware of */
+#if HAVE_PTHREADS
+    /* demuxing in a thread of its own, see input_thread() */
+    AVFormatContext *ctx;
+    int thread_started;
+    pthread_t thread;
+    pthread_mutex_t fifo_lock;
+    pthread_cond_t fifo_cond;
+    AVFifoBuffer *fifo;   /* AVInputPacket queue */
+    int thread_ret;       /* error which stopped the thread */
+    int thread_abort;
+#endif
 } AVInputFile;
 
+/* a packet read by a demuxing thread */
+typedef struct AVInputPacket {
+    AVPacket pkt;
+    int repeat_pict;
+    AVCodecParserContext *parser;
+} AVInputPacket;
+
+#define INPUT_QUEUE_SIZE 8
+
 #if HAVE_TERMIOS_H
 
 /* init terminal so that we can grab keys */
@@ -353,24 +404,27 @@ static int configure_filters(AVInputStream *ist, AVOutputStream *ost)
     AVFilterContext *last_filter, *filter;
     /** filter graph containing all filters including input & output */
     AVCodecContext *codec = ost->st->codec;
-    AVCodecContext *icodec = ist->st->codec;
+    AVCodecContext *icodec = ist->dec;
     FFSinkContext ffsink_ctx = { .pix_fmt = codec->pix_fmt };
     char args[255];
     int ret;
 
-    graph = avfilter_graph_alloc();
+    ost->graph = avfilter_graph_alloc();
+    if (!ost->graph)
+        return AVERROR(ENOMEM);
+    ost->graph->thread_count = thread_count;
 
-    snprintf(args, 255, "%d:%d:%d:%d:%d", ist->st->codec->width,
-             ist->st->codec->height, ist->st->codec->pix_fmt, 1, AV_TIME_BASE);
-    ret = avfilter_graph_create_filter(&ist->input_video_filter, avfilter_get_by_name("buffer"),
-                                       "src", args, NULL, graph);
+    snprintf(args, 255, "%d:%d:%d:%d:%d", ist->dec->width,
+             ist->dec->height, ist->dec->pix_fmt, 1, AV_TIME_BASE);
+    ret = avfilter_graph_create_filter(&ost->input_video_filter, avfilter_get_by_name("buffer"),
+                                       "src", args, NULL, ost->graph);
     if (ret < 0)
         return ret;
-    ret = avfilter_graph_create_filter(&ist->output_video_filter, &ffsink,
-                                       "out", NULL, &ffsink_ctx, graph);
+    ret = avfilter_graph_create_filter(&ost->output_video_filter, &ffsink,
+                                       "out", NULL, &ffsink_ctx, ost->graph);
     if (ret < 0)
         return ret;
-    last_filter = ist->input_video_filter;
+    last_filter = ost->input_video_filter;
 
     if (codec->width  != icodec->width || codec->height != icodec->height) {
         snprintf(args, 255, "%d:%d:flags=0x%X",
@@ -378,7 +432,7 @@ static int configure_filters(AVInputStream *ist, AVOutputStream *ost)
                  codec->height,
                  (int)av_get_int(sws_opts, "sws_flags", NULL));
         if ((ret = avfilter_graph_create_filter(&filter, avfilter_get_by_name("scale"),
-                                                NULL, args, NULL, graph)) < 0)
+                                                NULL, args, NULL, ost->graph)) < 0)
             return ret;
         if ((ret = avfilter_link(last_filter, 0, filter, 0)) < 0)
             return ret;
@@ -386,9 +440,9 @@ static int configure_filters(AVInputStream *ist, AVOutputStream *ost)
     }
 
     snprintf(args, sizeof(args), "flags=0x%X", (int)av_get_int(sws_opts, "sws_flags", NULL));
-    graph->scale_sws_opts = av_strdup(args);
+    ost->graph->scale_sws_opts = av_strdup(args);
 
-    if (vfilters) {
+    if (ost->avfilter) {
         AVFilterInOut *outputs = av_malloc(sizeof(AVFilterInOut));
         AVFilterInOut *inputs  = av_malloc(sizeof(AVFilterInOut));
 
@@ -398,23 +452,23 @@ static int configure_filters(AVInputStream *ist, AVOutputStream *ost)
         outputs->next    = NULL;
 
         inputs->name    = av_strdup("out");
-        inputs->filter_ctx = ist->output_video_filter;
+        inputs->filter_ctx = ost->output_video_filter;
         inputs->pad_idx = 0;
         inputs->next    = NULL;
 
-        if ((ret = avfilter_graph_parse(graph, vfilters, inputs, outputs, NULL)) < 0)
+        if ((ret = avfilter_graph_parse(ost->graph, ost->avfilter, inputs, outputs, NULL)) < 0)
             return ret;
-        av_freep(&vfilters);
+        av_freep(&ost->avfilter);
     } else {
-        if ((ret = avfilter_link(last_filter, 0, ist->output_video_filter, 0)) < 0)
+        if ((ret = avfilter_link(last_filter, 0, ost->output_video_filter, 0)) < 0)
             return ret;
     }
 
-    if ((ret = avfilter_graph_config(graph, NULL)) < 0)
+    if ((ret = avfilter_graph_config(ost->graph, NULL)) < 0)
         return ret;
 
-    codec->width  = ist->output_video_filter->inputs[0]->w;
-    codec->height = ist->output_video_filter->inputs[0]->h;
+    codec->width  = ost->output_video_filter->inputs[0]->w;
+    codec->height = ost->output_video_filter->inputs[0]->h;
 
     return 0;
 }
@@ -763,7 +817,7 @@ static void do_audio_out(AVFormatContext *s,
 
     int size_out, frame_bytes, ret, resample_changed;
     AVCodecContext *enc= ost->st->codec;
-    AVCodecContext *dec= ist->st->codec;
+    AVCodecContext *dec= ist->dec;
     int osize= av_get_bits_per_sample_fmt(enc->sample_fmt)/8;
     int isize= av_get_bits_per_sample_fmt(dec->sample_fmt)/8;
     const int coded_bps = av_get_bits_per_sample(enc->codec->id);
@@ -1003,7 +1057,7 @@ static void pre_process_video_frame(AVInputStream *ist, AVPicture *picture, void
     AVPicture picture_tmp;
     uint8_t *buf = 0;
 
-    dec = ist->st->codec;
+    dec = ist->dec;
 
     /* deinterlace : must be done before any resize */
     if (do_deinterlace) {
@@ -1104,6 +1158,30 @@ static void do_subtitle_out(AVFormatContext *s,
 static int bit_buffer_size= 1024*256;
 static uint8_t *bit_buffer= NULL;
 
+/* write a packet from a video encoder, or keep it for the main thread if
+   the encoder runs in a thread of its own */
+static void write_video_frame(AVFormatContext *s, AVOutputStream *ost, AVPacket *pkt)
+{
+#if HAVE_PTHREADS
+    if (ost->encode_thread_started) {
+        AVPacketList *pktl = av_mallocz(sizeof(AVPacketList));
+        if (!pktl || av_dup_packet(pkt) < 0) {
+            fprintf(stderr, "Out of memory in write_video_frame\n");
+            ffmpeg_exit(1);
+        }
+        pktl->pkt = *pkt;
+        if (ost->encoded_packets_end)
+            ost->encoded_packets_end->next = pktl;
+        else
+            ost->encoded_packets = pktl;
+        ost->encoded_packets_end = pktl;
+        return;
+    }
+#endif
+    video_size += pkt->size;
+    write_frame(s, pkt, ost->st->codec, ost->bitstream_filters);
+}
+
 static void do_video_out(AVFormatContext *s,
                          AVOutputStream *ost,
                          AVInputStream *ist,
@@ -1114,11 +1192,22 @@ static void do_video_out(AVFormatContext *s,
     AVFrame *final_picture, *formatted_picture, *resampling_dst, *padding_src;
     AVCodecContext *enc, *dec;
     double sync_ipts;
+    uint8_t *buf = bit_buffer;
 
+#if HAVE_PTHREADS
+    if (ost->bit_buffer)
+        buf = ost->bit_buffer;
+#endif
     enc = ost->st->codec;
-    dec = ist->st->codec;
+    dec = ist->dec;
 
-    sync_ipts = get_sync_ipts(ost) / av_q2d(enc->time_base);
+    /* the picture has the pts of its own source stream, which an encoder
+       thread cannot read from ist */
+    if (ost->sync_ist == ist)
+        sync_ipts = (double)(in_picture->pts - start_time) / AV_TIME_BASE;
+    else
+        sync_ipts = get_sync_ipts(ost);
+    sync_ipts /= av_q2d(enc->time_base);
 
     /* by default, we output a single frame */
     nb_frames = 1;
@@ -1139,11 +1228,11 @@ static void do_video_out(AVFormatContext *s,
             nb_frames = lrintf(vdelta);
 //fprintf(stderr, "vdelta:%f, ost->sync_opts:%"PRId64", ost->sync_ipts:%f nb_frames:%d\n", vdelta, ost->sync_opts, get_sync_ipts(ost), nb_frames);
         if (nb_frames == 0){
-            ++nb_frames_drop;
+            ++ost->nb_frames_drop;
             if (verbose>2)
                 fprintf(stderr, "*** drop!\n");
         }else if (nb_frames > 1) {
-            nb_frames_dup += nb_frames - 1;
+            ost->nb_frames_dup += nb_frames - 1;
             if (verbose>2)
                 fprintf(stderr, "*** %d dup!\n", nb_frames-1);
         }
@@ -1159,11 +1248,11 @@ static void do_video_out(AVFormatContext *s,
     padding_src = formatted_picture;
     resampling_dst = &ost->pict_tmp;
 
-    if (   ost->resample_height != ist->st->codec->height
-        || ost->resample_width  != ist->st->codec->width
-        || (ost->resample_pix_fmt!= ist->st->codec->pix_fmt) ) {
+    if (   ost->resample_height != ist->dec->height
+        || ost->resample_width  != ist->dec->width
+        || (ost->resample_pix_fmt!= ist->dec->pix_fmt) ) {
 
-        fprintf(stderr,"Input Stream #%d.%d frame size changed to %dx%d, %s\n", ist->file_index, ist->index, ist->st->codec->width,     ist->st->codec->height,avcodec_get_pix_fmt_name(ist->st->codec->pix_fmt));
+        fprintf(stderr,"Input Stream #%d.%d frame size changed to %dx%d, %s\n", ist->file_index, ist->index, ist->dec->width,     ist->dec->height,avcodec_get_pix_fmt_name(ist->dec->pix_fmt));
         if(!ost->video_resample)
             ffmpeg_exit(1);
     }
@@ -1172,17 +1261,17 @@ static void do_video_out(AVFormatContext *s,
     if (ost->video_resample) {
         padding_src = NULL;
         final_picture = &ost->pict_tmp;
-        if(  ost->resample_height != ist->st->codec->height
-          || ost->resample_width  != ist->st->codec->width
-          || (ost->resample_pix_fmt!= ist->st->codec->pix_fmt) ) {
+        if(  ost->resample_height != ist->dec->height
+          || ost->resample_width  != ist->dec->width
+          || (ost->resample_pix_fmt!= ist->dec->pix_fmt) ) {
 
             /* initialize a new scaler context */
             sws_freeContext(ost->img_resample_ctx);
             sws_flags = av_get_int(sws_opts, "sws_flags", NULL);
             ost->img_resample_ctx = sws_getContext(
-                ist->st->codec->width,
-                ist->st->codec->height,
-                ist->st->codec->pix_fmt,
+                ist->dec->width,
+                ist->dec->height,
+                ist->dec->pix_fmt,
                 ost->st->codec->width,
                 ost->st->codec->height,
                 ost->st->codec->pix_fmt,
@@ -1245,7 +1334,7 @@ static void do_video_out(AVFormatContext *s,
                 ost->forced_kf_index++;
             }
             ret = avcodec_encode_video(enc,
-                                       bit_buffer, bit_buffer_size,
+                                       buf, bit_buffer_size,
                                        &big_picture);
             if (ret < 0) {
                 fprintf(stderr, "Video encoding failed\n");
@@ -1253,7 +1342,7 @@ static void do_video_out(AVFormatContext *s,
             }
 
             if(ret>0){
-                pkt.data= bit_buffer;
+                pkt.data= buf;
                 pkt.size= ret;
                 if(enc->coded_frame->pts != AV_NOPTS_VALUE)
                     pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
@@ -1263,9 +1352,8 @@ static void do_video_out(AVFormatContext *s,
 
                 if(enc->coded_frame->key_frame)
                     pkt.flags |= AV_PKT_FLAG_KEY;
-                write_frame(s, &pkt, ost->st->codec, ost->bitstream_filters);
+                write_video_frame(s, ost, &pkt);
                 *frame_size = ret;
-                video_size += ret;
                 //fprintf(stderr,"\nFrame: %3d size: %5d type: %d",
                 //        enc->frame_number-1, ret, enc->pict_type);
                 /* if two pass, output log */
@@ -1320,6 +1408,130 @@ static void do_video_stats(AVFormatContext *os, AVOutputStream *ost,
     }
 }
 
+#if HAVE_PTHREADS
+/* filter and encode the picture handed to the thread of ost */
+static void encode_thread_job(AVOutputStream *ost)
+{
+    int frame_size;
+#if CONFIG_AVFILTER
+    while (avfilter_poll_frame(ost->output_video_filter->inputs[0])) {
+        AVFrame picture = *ost->encode_picture;
+        AVRational tb;
+
+        if (get_filtered_video_frame(ost->output_video_filter, &picture, &ost->picref, &tb) < 0)
+            break;
+        picture.pts = av_rescale_q(ost->picref->pts, tb, AV_TIME_BASE_Q);
+        if (ost->picref->video)
+            ost->st->codec->sample_aspect_ratio = ost->picref->video->pixel_aspect;
+        do_video_out(ost->encode_os, ost, ost->encode_ist, &picture, &frame_size);
+        avfilter_unref_buffer(ost->picref);
+        ost->picref = NULL;
+    }
+#else
+    do_video_out(ost->encode_os, ost, ost->encode_ist, ost->encode_picture, &frame_size);
+#endif
+}
+
+static void *encode_thread(void *arg)
+{
+    AVOutputStream *ost = arg;
+
+    pthread_mutex_lock(&ost->encode_lock);
+    for (;;) {
+        while (ost->encode_request != 1 && ost->encode_request != -1)
+            pthread_cond_wait(&ost->encode_cond, &ost->encode_lock);
+        if (ost->encode_request < 0)
+            break;
+        pthread_mutex_unlock(&ost->encode_lock);
+
+        encode_thread_job(ost);
+
+        pthread_mutex_lock(&ost->encode_lock);
+        ost->encode_request = 2;
+        pthread_cond_signal(&ost->encode_cond);
+    }
+    pthread_mutex_unlock(&ost->encode_lock);
+    return NULL;
+}
+
+/* hand in_picture to the threads of all the video encoders of ist_index */
+static void start_encode_threads(AVInputStream *ist, int ist_index,
+                                 AVOutputStream **ost_table, int nb_ostreams,
+                                 AVFrame *in_picture)
+{
+    int i;
+
+    in_picture->pts = ist->pts;
+    for (i = 0; i < nb_ostreams; i++) {
+        AVOutputStream *ost = ost_table[i];
+        if (ost->source_index != ist_index || !ost->encode_thread_started)
+            continue;
+        pthread_mutex_lock(&ost->encode_lock);
+        ost->encode_os      = output_files[ost->file_index];
+        ost->encode_ist     = ist;
+        ost->encode_picture = in_picture;
+        ost->encode_request = 1;
+        pthread_cond_signal(&ost->encode_cond);
+        pthread_mutex_unlock(&ost->encode_lock);
+    }
+}
+
+/* wait for the thread of ost to be done with its picture and write the
+   packets it encoded, in the order do_video_out() would have */
+static void finish_encode_thread(AVOutputStream *ost)
+{
+    AVPacketList *pktl;
+
+    pthread_mutex_lock(&ost->encode_lock);
+    while (ost->encode_request == 1)
+        pthread_cond_wait(&ost->encode_cond, &ost->encode_lock);
+    ost->encode_request = 0;
+    pthread_mutex_unlock(&ost->encode_lock);
+
+    while ((pktl = ost->encoded_packets)) {
+        ost->encoded_packets = pktl->next;
+        video_size += pktl->pkt.size;
+        write_frame(ost->encode_os, &pktl->pkt, ost->st->codec, ost->bitstream_filters);
+        av_free_packet(&pktl->pkt);
+        av_free(pktl);
+    }
+    ost->encoded_packets_end = NULL;
+}
+
+static int init_encode_thread(AVOutputStream *ost)
+{
+    ost->bit_buffer = av_malloc(bit_buffer_size);
+    if (!ost->bit_buffer)
+        return AVERROR(ENOMEM);
+    pthread_mutex_init(&ost->encode_lock, NULL);
+    pthread_cond_init(&ost->encode_cond, NULL);
+    if (pthread_create(&ost->encode_thread, NULL, encode_thread, ost)) {
+        pthread_mutex_destroy(&ost->encode_lock);
+        pthread_cond_destroy(&ost->encode_cond);
+        av_freep(&ost->bit_buffer);
+        return AVERROR(ENOMEM);
+    }
+    ost->encode_thread_started = 1;
+    return 0;
+}
+
+static void free_encode_thread(AVOutputStream *ost)
+{
+    if (!ost->encode_thread_started)
+        return;
+    pthread_mutex_lock(&ost->encode_lock);
+    ost->encode_request = -1;
+    pthread_cond_signal(&ost->encode_cond);
+    pthread_mutex_unlock(&ost->encode_lock);
+    pthread_join(ost->encode_thread, NULL);
+
+    pthread_mutex_destroy(&ost->encode_lock);
+    pthread_cond_destroy(&ost->encode_cond);
+    av_freep(&ost->bit_buffer);
+    ost->encode_thread_started = 0;
+}
+#endif
+
 static void print_report(AVFormatContext **output_files,
                          AVOutputStream **ost_table, int nb_ostreams,
                          int is_last_report)
@@ -1330,6 +1542,7 @@ static void print_report(AVFormatContext **output_files,
     int64_t total_size;
     AVCodecContext *enc;
     int frame_number, vid, i;
+    int nb_frames_dup = 0, nb_frames_drop = 0;
     double bitrate, ti1, pts;
     static int64_t last_time = -1;
     static int qp_histogram[52];
@@ -1406,6 +1619,8 @@ static void print_report(AVFormatContext **output_files,
             }
             vid = 1;
         }
+        nb_frames_dup  += ost->nb_frames_dup;
+        nb_frames_drop += ost->nb_frames_drop;
         /* compute min output value */
         pts = (double)ost->st->pts.val * av_q2d(ost->st->time_base);
         if ((pts < ti1) && (pts > 0))
@@ -1462,7 +1677,7 @@ static int output_packet(AVInputStream *ist, int ist_index,
 #endif
 
     AVPacket avpkt;
-    int bps = av_get_bits_per_sample_fmt(ist->st->codec->sample_fmt)>>3;
+    int bps = av_get_bits_per_sample_fmt(ist->dec->sample_fmt)>>3;
 
     if(ist->next_pts == AV_NOPTS_VALUE)
         ist->next_pts= ist->pts;
@@ -1478,7 +1693,7 @@ static int output_packet(AVInputStream *ist, int ist_index,
     }
 
     if(pkt->dts != AV_NOPTS_VALUE)
-        ist->next_pts = ist->pts = av_rescale_q(pkt->dts, ist->st->time_base, AV_TIME_BASE_Q);
+        ist->next_dts = ist->next_pts = ist->pts = av_rescale_q(pkt->dts, ist->st->time_base, AV_TIME_BASE_Q);
     if(pkt->pts != AV_NOPTS_VALUE)
         pkt_pts = av_rescale_q(pkt->pts, ist->st->time_base, AV_TIME_BASE_Q);
 
@@ -1502,7 +1717,7 @@ static int output_packet(AVInputStream *ist, int ist_index,
         data_size = avpkt.size;
         subtitle_to_free = NULL;
         if (ist->decoding_needed) {
-            switch(ist->st->codec->codec_type) {
+            switch(ist->dec->codec_type) {
             case AVMEDIA_TYPE_AUDIO:{
                 if(pkt && samples_size < FFMAX(pkt->size*sizeof(*samples), AVCODEC_MAX_AUDIO_FRAME_SIZE)) {
                     samples_size = FFMAX(pkt->size*sizeof(*samples), AVCODEC_MAX_AUDIO_FRAME_SIZE);
@@ -1512,7 +1727,7 @@ static int output_packet(AVInputStream *ist, int ist_index,
                 decoded_data_size= samples_size;
                     /* XXX: could avoid copy if PCM 16 bits with same
                        endianness as CPU */
-                ret = avcodec_decode_audio3(ist->st->codec, samples, &decoded_data_size,
+                ret = avcodec_decode_audio3(ist->dec, samples, &decoded_data_size,
                                             &avpkt);
                 if (ret < 0)
                     goto fail_decode;
@@ -1527,17 +1742,29 @@ static int output_packet(AVInputStream *ist, int ist_index,
                 }
                 decoded_data_buf = (uint8_t *)samples;
                 ist->next_pts += ((int64_t)AV_TIME_BASE/bps * decoded_data_size) /
-                    (ist->st->codec->sample_rate * ist->st->codec->channels);
+                    (ist->dec->sample_rate * ist->dec->channels);
                 break;}
             case AVMEDIA_TYPE_VIDEO:
-                    decoded_data_size = (ist->st->codec->width * ist->st->codec->height * 3) / 2;
+                    decoded_data_size = (ist->dec->width * ist->dec->height * 3) / 2;
                     /* XXX: allocate picture correctly */
                     avcodec_get_frame_defaults(&picture);
                     avpkt.pts = pkt_pts;
-                    avpkt.dts = ist->pts;
                     pkt_pts = AV_NOPTS_VALUE;
+                    /* frame threads return the picture of a packet several
+                       packets later, so the synthetic dts cannot be derived
+                       from the pts of the last picture output */
+                    if (ist->dec->active_thread_type & FF_THREAD_FRAME) {
+                        avpkt.dts = ist->next_dts;
+                        if (avpkt.size && ist->dec->time_base.num != 0) {
+                            int ticks= ist->repeat_pict >= 0 ? ist->repeat_pict+1 : ist->dec->ticks_per_frame;
+                            ist->next_dts += ((int64_t)AV_TIME_BASE *
+                                              ist->dec->time_base.num * ticks) /
+                                ist->dec->time_base.den;
+                        }
+                    } else
+                        avpkt.dts = ist->pts;
 
-                    ret = avcodec_decode_video2(ist->st->codec,
+                    ret = avcodec_decode_video2(ist->dec,
                                                 &picture, &got_picture, &avpkt);
                     ist->st->quality= picture.quality;
                     if (ret < 0)
@@ -1547,16 +1774,16 @@ static int output_packet(AVInputStream *ist, int ist_index,
                         goto discard_packet;
                     }
                     ist->next_pts = ist->pts = guess_correct_pts(&ist->pts_ctx, picture.pkt_pts, picture.pkt_dts);
-                    if (ist->st->codec->time_base.num != 0) {
-                        int ticks= ist->st->parser ? ist->st->parser->repeat_pict+1 : ist->st->codec->ticks_per_frame;
+                    if (ist->dec->time_base.num != 0) {
+                        int ticks= ist->repeat_pict >= 0 ? ist->repeat_pict+1 : ist->dec->ticks_per_frame;
                         ist->next_pts += ((int64_t)AV_TIME_BASE *
-                                          ist->st->codec->time_base.num * ticks) /
-                            ist->st->codec->time_base.den;
+                                          ist->dec->time_base.num * ticks) /
+                            ist->dec->time_base.den;
                     }
                     avpkt.size = 0;
                     break;
             case AVMEDIA_TYPE_SUBTITLE:
-                ret = avcodec_decode_subtitle2(ist->st->codec,
+                ret = avcodec_decode_subtitle2(ist->dec,
                                                &subtitle, &got_picture, &avpkt);
                 if (ret < 0)
                     goto fail_decode;
@@ -1570,17 +1797,17 @@ static int output_packet(AVInputStream *ist, int ist_index,
                 goto fail_decode;
             }
         } else {
-            switch(ist->st->codec->codec_type) {
+            switch(ist->dec->codec_type) {
             case AVMEDIA_TYPE_AUDIO:
-                ist->next_pts += ((int64_t)AV_TIME_BASE * ist->st->codec->frame_size) /
-                    ist->st->codec->sample_rate;
+                ist->next_pts += ((int64_t)AV_TIME_BASE * ist->dec->frame_size) /
+                    ist->dec->sample_rate;
                 break;
             case AVMEDIA_TYPE_VIDEO:
-                if (ist->st->codec->time_base.num != 0) {
-                    int ticks= ist->st->parser ? ist->st->parser->repeat_pict+1 : ist->st->codec->ticks_per_frame;
+                if (ist->dec->time_base.num != 0) {
+                    int ticks= ist->repeat_pict >= 0 ? ist->repeat_pict+1 : ist->dec->ticks_per_frame;
                     ist->next_pts += ((int64_t)AV_TIME_BASE *
-                                      ist->st->codec->time_base.num * ticks) /
-                        ist->st->codec->time_base.den;
+                                      ist->dec->time_base.num * ticks) /
+                        ist->dec->time_base.den;
                 }
                 break;
             }
@@ -1589,25 +1816,29 @@ static int output_packet(AVInputStream *ist, int ist_index,
         }
 
         buffer_to_free = NULL;
-        if (ist->st->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+        if (ist->dec->codec_type == AVMEDIA_TYPE_VIDEO) {
             pre_process_video_frame(ist, (AVPicture *)&picture,
                                     &buffer_to_free);
         }
 
 #if CONFIG_AVFILTER
-        if (ist->st->codec->codec_type == AVMEDIA_TYPE_VIDEO && ist->input_video_filter) {
+        if (ist->dec->codec_type == AVMEDIA_TYPE_VIDEO) {
             AVRational sar;
             if (ist->st->sample_aspect_ratio.num) sar = ist->st->sample_aspect_ratio;
-            else                                  sar = ist->st->codec->sample_aspect_ratio;
-            // add it to be filtered
-            av_vsrc_buffer_add_frame(ist->input_video_filter, &picture,
-                                     ist->pts,
-                                     sar);
+            else                                  sar = ist->dec->sample_aspect_ratio;
+            for (i = 0; i < nb_ostreams; i++) {
+                ost = ost_table[i];
+                if (ost->source_index == ist_index && ost->input_video_filter)
+                    // add it to be filtered
+                    av_vsrc_buffer_add_frame(ost->input_video_filter, &picture,
+                                             ist->pts,
+                                             sar);
+            }
         }
 #endif
 
         // preprocess audio (volume)
-        if (ist->st->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+        if (ist->dec->codec_type == AVMEDIA_TYPE_AUDIO) {
             if (audio_volume != 256) {
                 short *volp;
                 volp = samples;
@@ -1627,26 +1858,33 @@ static int output_packet(AVInputStream *ist, int ist_index,
             if (pts > now)
                 usleep(pts - now);
         }
-#if CONFIG_AVFILTER
-        frame_available = ist->st->codec->codec_type != AVMEDIA_TYPE_VIDEO ||
-            !ist->output_video_filter || avfilter_poll_frame(ist->output_video_filter->inputs[0]);
-#endif
         /* if output time reached then transcode raw format,
            encode packets and output them */
         if (start_time == 0 || ist->pts >= start_time)
-#if CONFIG_AVFILTER
-        while (frame_available) {
-            AVRational ist_pts_tb;
-            if (ist->st->codec->codec_type == AVMEDIA_TYPE_VIDEO && ist->output_video_filter)
-                get_filtered_video_frame(ist->output_video_filter, &picture, &ist->picref, &ist_pts_tb);
-            if (ist->picref)
-                ist->pts = av_rescale_q(ist->picref->pts, ist_pts_tb, AV_TIME_BASE_Q);
-#endif
             for(i=0;i<nb_ostreams;i++) {
                 int frame_size;
 
                 ost = ost_table[i];
                 if (ost->source_index == ist_index) {
+#if HAVE_PTHREADS
+                    if (ost->encode_thread_started) {
+                        /* the first of the encoder threads starts them all */
+                        if (!ost->encode_request)
+                            start_encode_threads(ist, ist_index, ost_table, nb_ostreams, &picture);
+                        finish_encode_thread(ost);
+                        continue;
+                    }
+#endif
+#if CONFIG_AVFILTER
+                frame_available = ist->dec->codec_type != AVMEDIA_TYPE_VIDEO ||
+                    !ost->output_video_filter || avfilter_poll_frame(ost->output_video_filter->inputs[0]);
+                while (frame_available) {
+                    AVRational ist_pts_tb;
+                    if (ist->dec->codec_type == AVMEDIA_TYPE_VIDEO && ost->output_video_filter)
+                        get_filtered_video_frame(ost->output_video_filter, &picture, &ost->picref, &ist_pts_tb);
+                    if (ost->picref)
+                        ist->pts = av_rescale_q(ost->picref->pts, ist_pts_tb, AV_TIME_BASE_Q);
+#endif
                     os = output_files[ost->file_index];
 
                     /* set the input output pts pairs */
@@ -1660,9 +1898,10 @@ static int output_packet(AVInputStream *ist, int ist_index,
                             break;
                         case AVMEDIA_TYPE_VIDEO:
 #if CONFIG_AVFILTER
-                            if (ist->picref->video)
-                                ost->st->codec->sample_aspect_ratio = ist->picref->video->pixel_aspect;
+                            if (ost->picref->video)
+                                ost->st->codec->sample_aspect_ratio = ost->picref->video->pixel_aspect;
 #endif
+                            picture.pts = ist->pts;
                             do_video_out(os, ost, ist, &picture, &frame_size);
                             if (vstats_filename && frame_size)
                                 do_video_stats(os, ost, frame_size);
@@ -1682,7 +1921,11 @@ static int output_packet(AVInputStream *ist, int ist_index,
                         av_init_packet(&opkt);
 
                         if ((!ost->frame_number && !(pkt->flags & AV_PKT_FLAG_KEY)) && !copy_initial_nonkeyframes)
+#if !CONFIG_AVFILTER
                             continue;
+#else
+                            goto cont;
+#endif
 
                         /* no reencoding needed : output the packet directly */
                         /* force the input stream PTS */
@@ -1718,28 +1961,42 @@ static int output_packet(AVInputStream *ist, int ist_index,
                            && ost->st->codec->codec_id != CODEC_ID_MPEG1VIDEO
                            && ost->st->codec->codec_id != CODEC_ID_MPEG2VIDEO
                            ) {
-                            if(av_parser_change(ist->st->parser, ost->st->codec, &opkt.data, &opkt.size, data_buf, data_size, pkt->flags & AV_PKT_FLAG_KEY))
+                            if(av_parser_change(ist->parser, ost->st->codec, &opkt.data, &opkt.size, data_buf, data_size, pkt->flags & AV_PKT_FLAG_KEY))
                                 opkt.destruct= av_destruct_packet;
                         } else {
                             opkt.data = data_buf;
                             opkt.size = data_size;
                         }
 
+                        /* hand the muxer a reference to the input payload
+                           instead of letting it copy the payload */
+                        if (!opkt.destruct && opkt.data == pkt->data && opkt.size == pkt->size) {
+                            AVPacket ref;
+                            if (av_ref_packet(&ref, pkt) >= 0) {
+                                opkt.data     = ref.data;
+                                opkt.destruct = ref.destruct;
+                                opkt.priv     = ref.priv;
+                            }
+                        }
+
                         write_frame(os, &opkt, ost->st->codec, ost->bitstream_filters);
                         ost->st->codec->frame_number++;
                         ost->frame_number++;
                         av_free_packet(&opkt);
                     }
+#if CONFIG_AVFILTER
+                    cont:
+                    frame_available = (ist->dec->codec_type == AVMEDIA_TYPE_VIDEO) &&
+                                      ost->output_video_filter && avfilter_poll_frame(ost->output_video_filter->inputs[0]);
+                    if (ost->picref) {
+                        avfilter_unref_buffer(ost->picref);
+                        ost->picref = NULL;
+                    }
+                }
+#endif
                 }
             }
 
-#if CONFIG_AVFILTER
-            frame_available = (ist->st->codec->codec_type == AVMEDIA_TYPE_VIDEO) &&
-                              ist->output_video_filter && avfilter_poll_frame(ist->output_video_filter->inputs[0]);
-            if(ist->picref)
-                avfilter_unref_buffer(ist->picref);
-        }
-#endif
         av_free(buffer_to_free);
         /* XXX: allocate the subtitles in the codec ? */
         if (subtitle_to_free) {
@@ -1913,6 +2170,198 @@ static void parse_forced_key_frames(char *kf, AVOutputStream *ost,
 /*
  * The following code is the main loop of the file converter
  */
+#if HAVE_PTHREADS
+static void *input_thread(void *arg)
+{
+    AVInputFile *f = arg;
+    int ret = 0;
+
+    while (ret >= 0) {
+        AVInputPacket ipkt;
+
+        pthread_mutex_lock(&f->fifo_lock);
+        ret = f->thread_abort ? AVERROR(EINTR) : 0;
+        pthread_mutex_unlock(&f->fifo_lock);
+        if (ret < 0)
+            break;
+
+        ret = av_read_frame(f->ctx, &ipkt.pkt);
+        if (ret == AVERROR(EAGAIN)) {
+            usleep(10000);
+            ret = 0;
+            continue;
+        }
+        if (ret >= 0 && (ret = av_dup_packet(&ipkt.pkt)) < 0)
+            av_free_packet(&ipkt.pkt);
+
+        pthread_mutex_lock(&f->fifo_lock);
+        if (ret >= 0) {
+            AVStream *st = f->ctx->streams[ipkt.pkt.stream_index];
+            /* the parser is ahead of the main thread, keep its state for this packet */
+            ipkt.repeat_pict = st->parser ? st->parser->repeat_pict : -1;
+            ipkt.parser      = st->parser;
+            while (!av_fifo_space(f->fifo) && !f->thread_abort)
+                pthread_cond_wait(&f->fifo_cond, &f->fifo_lock);
+            if (f->thread_abort) {
+                av_free_packet(&ipkt.pkt);
+                ret = AVERROR(EINTR);
+            } else
+                av_fifo_generic_write(f->fifo, &ipkt, sizeof(ipkt), NULL);
+        }
+        if (ret < 0)
+            f->thread_ret = ret;
+        pthread_cond_signal(&f->fifo_cond);
+        pthread_mutex_unlock(&f->fifo_lock);
+    }
+    return NULL;
+}
+
+/* give the streams of a demuxing thread a context of their own, the parser
+   and the timestamp computation of av_read_frame() write to st->codec */
+static int alloc_demux_contexts(AVInputFile *f, AVInputStream **ist_table)
+{
+    int i;
+
+    for (i = 0; i < f->nb_streams; i++) {
+        AVInputStream *ist = ist_table[f->ist_index + i];
+        AVCodecContext *avctx = avcodec_alloc_context();
+
+        if (!avctx || avcodec_copy_context(avctx, ist->dec) < 0) {
+            av_free(avctx);
+            return AVERROR(ENOMEM);
+        }
+        ist->st->codec = avctx;
+    }
+    return 0;
+}
+
+static void free_demux_contexts(AVInputFile *f, AVInputStream **ist_table)
+{
+    int i;
+
+    for (i = 0; i < f->nb_streams; i++) {
+        AVInputStream *ist = ist_table[f->ist_index + i];
+        AVCodecContext *avctx = ist->st->codec;
+
+        if (avctx == ist->dec)
+            continue;
+        av_freep(&avctx->extradata);
+        av_freep(&avctx->intra_matrix);
+        av_freep(&avctx->inter_matrix);
+        av_freep(&avctx->rc_override);
+        av_freep(&avctx->rc_eq);
+        av_free(avctx);
+        ist->st->codec = ist->dec;
+    }
+}
+
+static void free_input_threads(AVInputFile *file_table, int nb_input_files,
+                               AVInputStream **ist_table)
+{
+    int i;
+
+    for (i = 0; i < nb_input_files; i++) {
+        AVInputFile *f = &file_table[i];
+        AVInputPacket ipkt;
+
+        if (f->thread_started) {
+            pthread_mutex_lock(&f->fifo_lock);
+            f->thread_abort = 1;
+            pthread_cond_signal(&f->fifo_cond);
+            pthread_mutex_unlock(&f->fifo_lock);
+            pthread_join(f->thread, NULL);
+            f->thread_started = 0;
+
+            while (av_fifo_size(f->fifo)) {
+                av_fifo_generic_read(f->fifo, &ipkt, sizeof(ipkt), NULL);
+                av_free_packet(&ipkt.pkt);
+            }
+            av_fifo_free(f->fifo);
+            pthread_mutex_destroy(&f->fifo_lock);
+            pthread_cond_destroy(&f->fifo_cond);
+        }
+        free_demux_contexts(f, ist_table);
+    }
+}
+
+static int init_input_threads(AVInputFile *file_table, int nb_input_files,
+                              AVInputStream **ist_table)
+{
+    int i, ret;
+
+    /* a single input is read as fast from the main thread */
+    if (nb_input_files == 1)
+        return 0;
+
+    for (i = 0; i < nb_input_files; i++) {
+        AVInputFile *f = &file_table[i];
+
+        if ((ret = alloc_demux_contexts(f, ist_table)) < 0)
+            return ret;
+        f->ctx  = input_files[i];
+        f->fifo = av_fifo_alloc(INPUT_QUEUE_SIZE * sizeof(AVInputPacket));
+        if (!f->fifo)
+            return AVERROR(ENOMEM);
+        pthread_mutex_init(&f->fifo_lock, NULL);
+        pthread_cond_init(&f->fifo_cond, NULL);
+        if (pthread_create(&f->thread, NULL, input_thread, f)) {
+            pthread_mutex_destroy(&f->fifo_lock);
+            pthread_cond_destroy(&f->fifo_cond);
+            av_fifo_free(f->fifo);
+            return AVERROR(ENOMEM);
+        }
+        f->thread_started = 1;
+    }
+    return 0;
+}
+#endif
+
+static int get_input_packet(AVInputFile *f, AVFormatContext *is,
+                            AVPacket *pkt, int *repeat_pict,
+                            AVCodecParserContext **parser)
+{
+    AVStream *st;
+    int ret;
+
+#if HAVE_PTHREADS
+    if (f->thread_started) {
+        AVInputPacket ipkt;
+
+        pthread_mutex_lock(&f->fifo_lock);
+        while (!av_fifo_size(f->fifo) && !f->thread_ret)
+            pthread_cond_wait(&f->fifo_cond, &f->fifo_lock);
+        if (av_fifo_size(f->fifo)) {
+            av_fifo_generic_read(f->fifo, &ipkt, sizeof(ipkt), NULL);
+            *pkt         = ipkt.pkt;
+            *repeat_pict = ipkt.repeat_pict;
+            *parser      = ipkt.parser;
+            ret = 0;
+            pthread_cond_signal(&f->fifo_cond);
+        } else
+            ret = f->thread_ret;
+        pthread_mutex_unlock(&f->fifo_lock);
+        return ret;
+    }
+#endif
+    ret = av_read_frame(is, pkt);
+    if (ret >= 0) {
+        st = is->streams[pkt->stream_index];
+        *repeat_pict = st->parser ? st->parser->repeat_pict : -1;
+        *parser      = st->parser;
+    }
+    return ret;
+}
+
+#if HAVE_PTHREADS
+static int can_encode_in_thread(AVOutputStream *ost)
+{
+    /* the statistics are written as the frames are encoded */
+    return ost->encoding_needed && !vstats_filename &&
+           ost->st->codec->codec_type == AVMEDIA_TYPE_VIDEO &&
+           !(output_files[ost->file_index]->oformat->flags & AVFMT_RAWPICTURE);
+}
+#endif
+
 static int transcode(AVFormatContext **output_files,
                      int nb_output_files,
                      AVFormatContext **input_files,
@@ -1930,6 +2379,8 @@ static int transcode(AVFormatContext **output_files,
     int want_sdp = 1;
     uint8_t no_packet[MAX_FILES]={0};
     int no_packet_count=0;
+    int repeat_pict = 0;
+    AVCodecParserContext *parser = NULL;
 
     file_table= av_mallocz(nb_input_files * sizeof(AVInputFile));
     if (!file_table)
@@ -1961,6 +2412,7 @@ static int transcode(AVFormatContext **output_files,
         for(k=0;k<is->nb_streams;k++) {
             ist = ist_table[j++];
             ist->st = is->streams[k];
+            ist->dec = ist->st->codec;
             ist->file_index = i;
             ist->index = k;
             ist->discard = 1; /* the stream is discarded by default
@@ -2026,7 +2478,7 @@ static int transcode(AVFormatContext **output_files,
                     stream_maps[n].stream_index;
 
                 /* Sanity check that the stream types match */
-                if (ist_table[ost->source_index]->st->codec->codec_type != ost->st->codec->codec_type) {
+                if (ist_table[ost->source_index]->dec->codec_type != ost->st->codec->codec_type) {
                     int i= ost->file_index;
                     av_dump_format(output_files[i], i, output_files[i]->filename, 1);
                     fprintf(stderr, "Codec type mismatch for mapping #%d.%d -> #%d.%d\n",
@@ -2056,7 +2508,7 @@ static int transcode(AVFormatContext **output_files,
                         }
                     }
                     if (ist->discard && ist->st->discard != AVDISCARD_ALL && !skip &&
-                        ist->st->codec->codec_type == ost->st->codec->codec_type) {
+                        ist->dec->codec_type == ost->st->codec->codec_type) {
                         if(best_nb_frames < ist->st->codec_info_nb_frames){
                             best_nb_frames= ist->st->codec_info_nb_frames;
                             ost->source_index = j;
@@ -2070,7 +2522,7 @@ static int transcode(AVFormatContext **output_files,
                         /* try again and reuse existing stream */
                         for(j=0;j<nb_istreams;j++) {
                             ist = ist_table[j];
-                            if (   ist->st->codec->codec_type == ost->st->codec->codec_type
+                            if (   ist->dec->codec_type == ost->st->codec->codec_type
                                 && ist->st->discard != AVDISCARD_ALL) {
                                 ost->source_index = j;
                                 found = 1;
@@ -2101,7 +2553,7 @@ static int transcode(AVFormatContext **output_files,
         ist = ist_table[ost->source_index];
 
         codec = ost->st->codec;
-        icodec = ist->st->codec;
+        icodec = ist->dec;
 
         if (metadata_streams_autocopy)
             av_metadata_copy(&ost->st->metadata, ist->st->metadata,
@@ -2290,7 +2742,7 @@ static int transcode(AVFormatContext **output_files,
         ost = ost_table[i];
         if (ost->encoding_needed) {
             AVCodec *codec = i < nb_output_codecs ? output_codecs[i] : NULL;
-            AVCodecContext *dec = ist_table[ost->source_index]->st->codec;
+            AVCodecContext *dec = ist_table[ost->source_index]->dec;
             if (!codec)
                 codec = avcodec_find_encoder(ost->st->codec->codec_id);
             if (!codec) {
@@ -2324,21 +2776,21 @@ static int transcode(AVFormatContext **output_files,
         if (ist->decoding_needed) {
             AVCodec *codec = i < nb_input_codecs ? input_codecs[i] : NULL;
             if (!codec)
-                codec = avcodec_find_decoder(ist->st->codec->codec_id);
+                codec = avcodec_find_decoder(ist->dec->codec_id);
             if (!codec) {
                 snprintf(error, sizeof(error), "Decoder (codec id %d) not found for input stream #%d.%d",
-                        ist->st->codec->codec_id, ist->file_index, ist->index);
+                        ist->dec->codec_id, ist->file_index, ist->index);
                 ret = AVERROR(EINVAL);
                 goto dump_format;
             }
-            if (avcodec_open(ist->st->codec, codec) < 0) {
+            if (avcodec_open(ist->dec, codec) < 0) {
                 snprintf(error, sizeof(error), "Error while opening decoder for input stream #%d.%d",
                         ist->file_index, ist->index);
                 ret = AVERROR(EINVAL);
                 goto dump_format;
             }
-            //if (ist->st->codec->codec_type == AVMEDIA_TYPE_VIDEO)
-            //    ist->st->codec->flags |= CODEC_FLAG_REPEAT_FIELD;
+            //if (ist->dec->codec_type == AVMEDIA_TYPE_VIDEO)
+            //    ist->dec->flags |= CODEC_FLAG_REPEAT_FIELD;
         }
     }
 
@@ -2349,6 +2801,11 @@ static int transcode(AVFormatContext **output_files,
         st= ist->st;
         ist->pts = st->avg_frame_rate.num ? - st->codec->has_b_frames*AV_TIME_BASE / av_q2d(st->avg_frame_rate) : 0;
         ist->next_pts = AV_NOPTS_VALUE;
+        /* has_b_frames includes the frame thread delay, which the dts
+           given to frame-threaded decoders already accounts for */
+        ist->next_dts = ist->pts;
+        if (st->codec->active_thread_type & FF_THREAD_FRAME && st->avg_frame_rate.num)
+            ist->next_dts += (st->codec->thread_count - 1)*AV_TIME_BASE / av_q2d(st->avg_frame_rate);
         init_pts_correction(&ist->pts_ctx);
         ist->is_start = 1;
     }
@@ -2495,6 +2952,27 @@ static int transcode(AVFormatContext **output_files,
     }
     term_init();
 
+#if HAVE_PTHREADS
+    /* encode the video streams coming from the same input stream in parallel */
+    for (i = 0; i < nb_ostreams; i++) {
+        ost = ost_table[i];
+        if (!can_encode_in_thread(ost))
+            continue;
+        for (j = 0; j < nb_ostreams; j++)
+            if (j != i && can_encode_in_thread(ost_table[j]) &&
+                ost_table[j]->source_index == ost->source_index)
+                break;
+        if (j < nb_ostreams && init_encode_thread(ost) < 0 && verbose >= 0)
+            fprintf(stderr, "Could not start the encoding thread of output stream #%d.%d\n",
+                    ost->file_index, ost->index);
+    }
+    if ((ret = init_input_threads(file_table, nb_input_files, ist_table)) < 0) {
+        fprintf(stderr, "Could not start the demuxing threads\n");
+        free_input_threads(file_table, nb_input_files, ist_table);
+        goto fail;
+    }
+#endif
+
     timer_start = av_gettime();
 
     for(; received_sigterm == 0;) {
@@ -2560,7 +3038,7 @@ static int transcode(AVFormatContext **output_files,
 
         /* read a frame from it and output it in the fifo */
         is = input_files[file_index];
-        ret= av_read_frame(is, &pkt);
+        ret= get_input_packet(&file_table[file_index], is, &pkt, &repeat_pict, &parser);
         if(ret == AVERROR(EAGAIN)){
             no_packet[file_index]=1;
             no_packet_count++;
@@ -2587,6 +3065,8 @@ static int transcode(AVFormatContext **output_files,
             goto discard_packet;
         ist_index = file_table[file_index].ist_index + pkt.stream_index;
         ist = ist_table[ist_index];
+        ist->repeat_pict = repeat_pict;
+        ist->parser      = parser;
         if (ist->discard)
             goto discard_packet;
 
@@ -2603,7 +3083,7 @@ static int transcode(AVFormatContext **output_files,
                 pkt.dts *= input_files_ts_scale[file_index][pkt.stream_index];
         }
 
-//        fprintf(stderr, "next:%"PRId64" dts:%"PRId64" off:%"PRId64" %d\n", ist->next_pts, pkt.dts, input_files_ts_offset[ist->file_index], ist->st->codec->codec_type);
+//        fprintf(stderr, "next:%"PRId64" dts:%"PRId64" off:%"PRId64" %d\n", ist->next_pts, pkt.dts, input_files_ts_offset[ist->file_index], ist->dec->codec_type);
         if (pkt.dts != AV_NOPTS_VALUE && ist->next_pts != AV_NOPTS_VALUE
             && (is->iformat->flags & AVFMT_TS_DISCONT)) {
             int64_t pkt_dts= av_rescale_q(pkt.dts, ist->st->time_base, AV_TIME_BASE_Q);
@@ -2625,6 +3105,10 @@ static int transcode(AVFormatContext **output_files,
             goto discard_packet;
         }
 
+        /* let the stream copies share the payload of the packet */
+        if (!ist->decoding_needed)
+            av_ref_packet(&pkt, &pkt);
+
         //fprintf(stderr,"read #%d.%d size=%d\n", ist->file_index, ist->index, pkt.size);
         if (output_packet(ist, ist_index, ost_table, nb_ostreams, &pkt) < 0) {
 
@@ -2644,6 +3128,10 @@ static int transcode(AVFormatContext **output_files,
         print_report(output_files, ost_table, nb_ostreams, 0);
     }
 
+#if HAVE_PTHREADS
+    free_input_threads(file_table, nb_input_files, ist_table);
+#endif
+
     /* at the end of stream, we must flush the decoder buffers */
     for(i=0;i<nb_istreams;i++) {
         ist = ist_table[i];
@@ -2666,6 +3154,9 @@ static int transcode(AVFormatContext **output_files,
     /* close each encoder */
     for(i=0;i<nb_ostreams;i++) {
         ost = ost_table[i];
+#if HAVE_PTHREADS
+        free_encode_thread(ost);
+#endif
         if (ost->encoding_needed) {
             av_freep(&ost->st->codec->stats_in);
             avcodec_close(ost->st->codec);
@@ -2676,12 +3167,9 @@ static int transcode(AVFormatContext **output_files,
     for(i=0;i<nb_istreams;i++) {
         ist = ist_table[i];
         if (ist->decoding_needed) {
-            avcodec_close(ist->st->codec);
+            avcodec_close(ist->dec);
         }
     }
-#if CONFIG_AVFILTER
-    avfilter_graph_free(&graph);
-#endif
 
     /* finished ! */
     ret = 0;
@@ -2701,6 +3189,13 @@ static int transcode(AVFormatContext **output_files,
         for(i=0;i<nb_ostreams;i++) {
             ost = ost_table[i];
             if (ost) {
+#if HAVE_PTHREADS
+                free_encode_thread(ost);
+#endif
+#if CONFIG_AVFILTER
+                avfilter_graph_free(&ost->graph);
+                av_freep(&ost->avfilter);
+#endif
                 if (ost->st->stream_copy)
                     av_freep(&ost->st->codec->extradata);
                 if (ost->logfile) {
@@ -3389,6 +3884,10 @@ static void new_video_stream(AVFormatContext *oc, int file_idx)
     avcodec_get_context_defaults3(st->codec, codec);
     ost->bitstream_filters = video_bitstream_filters;
     video_bitstream_filters= NULL;
+#if CONFIG_AVFILTER
+    ost->avfilter = vfilters;
+    vfilters = NULL;
+#endif
 
     st->codec->thread_count= thread_count;
 
@@ -1810,6 +1810,7 @@ static int video_thread(void *arg)
     AVFilterContext *filt_out = NULL;
     int64_t pos;
 
+    graph->thread_count = thread_count;
     if ((ret = configure_video_filters(graph, is, vfilters)) < 0)
         goto the_end;
     filt_out = is->out_video_filter;
@@ -45,6 +45,18 @@
 #if HAVE_POLL_H
 #include <poll.h>
 #endif
+#if HAVE_SYS_EPOLL_H && HAVE_PTHREADS
+#include <sys/epoll.h>
+#include <pthread.h>
+/* the connections can be spread over several threads, each one running
+   its own epoll event loop */
+#define USE_WORKERS 1
+#else
+#define USE_WORKERS 0
+#endif
+#if HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include <errno.h>
 #include <sys/time.h>
 #include <time.h>
@@ -98,6 +110,9 @@ static const char *http_state[] = {
 
 #define IOBUFFER_INIT_SIZE 8192
 
+/* largest part of a passthrough file sent at once */
+#define FILE_CHUNK_SIZE (1024 * 1024)
+
 /* timeouts are in ms */
 #define HTTP_REQUEST_TIMEOUT (15 * 1000)
 #define RTSP_REQUEST_TIMEOUT (3600 * 24 * 1000)
@@ -114,12 +129,59 @@ typedef struct {
     int64_t time1, time2;
 } DataRateData;
 
+/* maximum number of muxed chunks, key frames and bytes kept for a
+   stream shared by several clients */
+#define SHARED_MUX_CHUNKS   8192
+#define SHARED_MUX_KEYS     256
+#define SHARED_MUX_MAX_SIZE (32 * 1024 * 1024)
+
+/* output of the muxer for one packet, sent as is to each client */
+typedef struct MuxChunk {
+    int refcount;
+    int key;            /* true if the chunk starts with a key frame */
+    int64_t pts;        /* feed time of the packet, in us */
+    int size;
+    uint8_t data[1];
+} MuxChunk;
+
+/* live stream muxed once for all its HTTP clients: each client sends the
+   header, then the chunks from the oldest key frame still kept */
+typedef struct SharedMux {
+    AVFormatContext *fmt_in;
+    AVFormatContext fmt_ctx;
+    MuxChunk *header;
+    MuxChunk *chunks[SHARED_MUX_CHUNKS]; /* chunk n is at n % SHARED_MUX_CHUNKS */
+    int64_t first_seq, next_seq;         /* chunks kept are first_seq..next_seq-1 */
+    int64_t keys[SHARED_MUX_KEYS];       /* key chunks, starting at first_key */
+    int first_key, nb_keys;
+    int64_t size;                        /* bytes in the kept chunks */
+    int pending_key;                     /* a key frame gave no output yet */
+    int has_video;                       /* only video key frames start a GOP */
+    int64_t last_pts;
+    int nb_clients;
+} SharedMux;
+
+#if USE_WORKERS
+/* thread serving a share of the connections */
+typedef struct Worker {
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd[2];                 /* pipe the feeders wake us up through */
+    int nb_packetized;              /* connections whose output is timed by us */
+    struct HTTPContext *first_ctx;  /* connections owned by this worker */
+} Worker;
+#endif
+
 /* context associated with one connection */
 typedef struct HTTPContext {
     enum HTTPState state;
     int fd; /* socket file descriptor */
     struct sockaddr_in from_addr; /* origin */
     struct pollfd *poll_entry; /* used when polling */
+    int revents; /* events found by the last poll */
+    struct Worker *worker; /* owner of the connection */
+    struct HTTPContext *worker_next;
+    int events; /* events the worker waits for */
     int64_t timeout;
     uint8_t *buffer_ptr, *buffer_end;
     int http_error;
@@ -131,6 +193,10 @@ typedef struct HTTPContext {
     int64_t data_count;
     /* feed input */
     int feed_fd;
+    /* feed output, the feeder wakes us up through these, under server_lock */
+    int64_t feed_write_index; /* end of the feed data we were given */
+    int feed_waiting; /* true while in HTTPSTATE_WAIT_FEED */
+    int feed_event;   /* 1 when the feed got data, -1 when its feeder left */
     /* input format handling */
     AVFormatContext *fmt_in;
     int64_t start_time;            /* In milliseconds - this wraps fairly often */
@@ -149,6 +215,13 @@ typedef struct HTTPContext {
     int switch_feed_streams[MAX_STREAMS]; /* index of streams in the feed */
     int switch_pending;
     AVFormatContext fmt_ctx; /* instance of FFStream for one user */
+    int use_shared_mux; /* if true, the output comes from stream->shared_mux */
+    SharedMux *mux;
+    int64_t mux_seq; /* next chunk to send, -1 to wait for a key frame */
+    MuxChunk *mux_chunk; /* chunk being sent */
+    int use_passthrough; /* if true, the output is a part of the file of the stream */
+    int file_fd;
+    int64_t file_pos, file_end; /* part of the file still to send */
     int last_packet_sent; /* true if last data packet was sent */
     int suppress_log;
     DataRateData datarate;
@@ -235,6 +308,10 @@ typedef struct FFStream {
     int multicast_port; /* first port used for multicast */
     int multicast_ttl;
     int loop; /* if true, send the stream in loops (only meaningful if file) */
+    int no_shared_mux; /* if true, mux the stream separately for each client */
+    SharedMux *shared_mux;
+    int no_passthrough; /* if true, always remux the file of the stream */
+    int passthrough; /* if true, send the file of the stream as is */
 
     /* feed specific */
     int feed_opened;     /* true if someone is writing to the feed */
@@ -271,6 +348,8 @@ static int http_parse_request(HTTPContext *c);
 static int http_send_data(HTTPContext *c);
 static void compute_status(HTTPContext *c);
 static int open_input_stream(HTTPContext *c, const char *info);
+static void mux_chunk_unref(MuxChunk **chunk);
+static void shared_mux_close(FFStream *stream);
 static int http_start_receive_data(HTTPContext *c);
 static int http_receive_data(HTTPContext *c);
 
@@ -313,10 +392,25 @@ static unsigned int nb_connections;
 static uint64_t max_bandwidth = 1000;
 static uint64_t current_bandwidth;
 
+#if USE_WORKERS
+/* each worker reads the clock when it wakes up */
+static __thread int64_t cur_time;
+#else
 static int64_t cur_time;           // Making this global saves on passing it around everywhere
+#endif
 
 static AVLFG random_state;
 
+static int nb_workers = 1;
+#if USE_WORKERS
+/* protects the connection lists and counters, the feeds and the streams:
+   the workers serve their connections without it */
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static Worker *workers;
+static int next_worker;
+#endif
+
 static FILE *logfile = NULL;
 
 /* FIXME: make ffserver work with IPv6 */
@@ -372,6 +466,9 @@ static char *ctime1(char *buf2)
 static void http_vlog(const char *fmt, va_list vargs)
 {
     static int print_prefix = 1;
+#if USE_WORKERS
+    pthread_mutex_lock(&log_lock);
+#endif
     if (logfile) {
         if (print_prefix) {
             char buf[32];
@@ -382,6 +479,9 @@ static void http_vlog(const char *fmt, va_list vargs)
         vfprintf(logfile, fmt, vargs);
         fflush(logfile);
     }
+#if USE_WORKERS
+    pthread_mutex_unlock(&log_lock);
+#endif
 }
 
 #ifdef __GNUC__
@@ -589,42 +689,275 @@ static void start_multicast(void)
     }
 }
 
-/* main loop of the http server */
-static int http_server(void)
+/* events to wait for on the socket of a connection, 0 if none */
+static int connection_events(HTTPContext *c)
 {
-    int server_fd = 0, rtsp_server_fd = 0;
-    int ret, delay, delay1;
-    struct pollfd *poll_table, *poll_entry;
+    switch(c->state) {
+    case HTTPSTATE_SEND_HEADER:
+    case RTSPSTATE_SEND_REPLY:
+    case RTSPSTATE_SEND_PACKET:
+        return POLLOUT;
+    case HTTPSTATE_SEND_DATA_HEADER:
+    case HTTPSTATE_SEND_DATA:
+    case HTTPSTATE_SEND_DATA_TRAILER:
+        /* for TCP, we output as much as we can (may need to put a limit),
+           packetized output is timed by us */
+        return c->is_packetized ? 0 : POLLOUT;
+    case HTTPSTATE_WAIT_REQUEST:
+    case HTTPSTATE_RECEIVE_DATA:
+    case HTTPSTATE_WAIT_FEED:
+    case RTSPSTATE_WAIT_REQUEST:
+        /* need to catch errors */
+        return POLLIN;/* Maybe this will work */
+    default:
+        return 0;
+    }
+}
+
+static void lock_server(void)
+{
+#if USE_WORKERS
+    pthread_mutex_lock(&server_lock);
+#endif
+}
+
+static void unlock_server(void)
+{
+#if USE_WORKERS
+    pthread_mutex_unlock(&server_lock);
+#endif
+}
+
+#if USE_WORKERS
+static void set_events(HTTPContext *c, int events)
+{
+    struct epoll_event ev;
+    int old_events;
+
+    if (events == c->events)
+        return;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (events & POLLIN  ? EPOLLIN  : 0) |
+                (events & POLLOUT ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    /* a socket without events is removed, so that errors on it do not
+       wake us up; c->events is set first as the owner may handle c as
+       soon as it is added */
+    old_events = c->events;
+    c->events = events;
+    epoll_ctl(c->worker->epoll_fd,
+              !old_events ? EPOLL_CTL_ADD : events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL,
+              c->fd, &ev);
+}
+#endif
+
+/* tell the worker owning c what to wait for, after a change of state */
+static void update_events(HTTPContext *c)
+{
+#if USE_WORKERS
+    set_events(c, c->fd >= 0 ? connection_events(c) : 0);
+#endif
+}
+
+/* add c to the connections, under server_lock; only plain HTTP ones are
+   spread over the workers, RTSP sessions and their RTP streams all stay on
+   the first one */
+static void add_connection(HTTPContext *c, int spread)
+{
+    c->next = first_http_ctx;
+    first_http_ctx = c;
+#if USE_WORKERS
+    c->worker = &workers[spread ? next_worker++ % nb_workers : 0];
+    c->worker_next = c->worker->first_ctx;
+    c->worker->first_ctx = c;
+    c->worker->nb_packetized += c->is_packetized;
+    update_events(c);
+#endif
+}
+
+/* tell the worker owning c to look at its connections waiting for a feed */
+static void wake_worker(HTTPContext *c)
+{
+#if USE_WORKERS
+    char b = 0;
+
+    write(c->worker->wake_fd[1], &b, 1);
+#endif
+}
+
+/* count the bytes sent to the clients of a stream */
+static void add_bytes_served(FFStream *stream, int len)
+{
+    lock_server();
+    stream->bytes_served += len;
+    unlock_server();
+}
+
+static void handle_events(HTTPContext *c, int revents)
+{
+    c->revents = revents;
+    if (handle_connection(c) < 0) {
+        /* close and free the connection */
+        log_connection(c);
+        close_connection(c);
+    } else
+        update_events(c);
+}
+
+#if USE_WORKERS
+#define MAX_EVENTS 256
+
+/* listening sockets, the other events are tagged with their connection */
+enum {
+    EVENT_HTTP_SERVER = 1,
+    EVENT_RTSP_SERVER,
+    EVENT_WAKE,
+};
+
+static int listen_fd, rtsp_listen_fd;
+
+/* the other workers only add connections at the head of our list and we
+   are the only one to remove them, so the rest can be walked unlocked */
+static HTTPContext *first_worker_ctx(Worker *w)
+{
+    HTTPContext *c;
+
+    lock_server();
+    c = w->first_ctx;
+    unlock_server();
+    return c;
+}
+
+static void *worker_thread(void *arg)
+{
+    Worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
     HTTPContext *c, *c_next;
+    int64_t next_tick = 0;
+    int i, n, revents, nb_packetized;
+    char buf[64];
 
-    if(!(poll_table = av_mallocz((nb_max_http_connections + 2)*sizeof(*poll_table)))) {
-        http_log("Impossible to allocate a poll table handling %d connections.\n", nb_max_http_connections);
-        return -1;
+    for(;;) {
+        /* when ffserver is doing the timing, we look at which packet
+           need to be sent every 10 ms, otherwise at least every second
+           to handle timeouts */
+        n = FFMAX(next_tick - av_gettime() / 1000, 0);
+        n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, n);
+        if (n < 0 && errno != EINTR) {
+            http_log("epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        cur_time = av_gettime() / 1000;
+
+        if (w == workers && need_to_start_children) {
+            need_to_start_children = 0;
+            lock_server();
+            start_children(first_feed);
+            unlock_server();
+        }
+
+        for (i = 0; i < n; i++) {
+            if (events[i].data.u64 == EVENT_HTTP_SERVER) {
+                new_connection(listen_fd, 0);
+            } else if (events[i].data.u64 == EVENT_RTSP_SERVER) {
+                new_connection(rtsp_listen_fd, 1);
+            } else if (events[i].data.u64 == EVENT_WAKE) {
+                while (read(w->wake_fd[0], buf, sizeof(buf)) > 0)
+                    ;
+                for(c = first_worker_ctx(w); c != NULL; c = c_next) {
+                    c_next = c->worker_next;
+                    if (c->state == HTTPSTATE_WAIT_FEED)
+                        handle_events(c, 0);
+                }
+            } else {
+                revents = (events[i].events & EPOLLIN  ? POLLIN  : 0) |
+                          (events[i].events & EPOLLOUT ? POLLOUT : 0) |
+                          (events[i].events & EPOLLERR ? POLLERR : 0) |
+                          (events[i].events & EPOLLHUP ? POLLHUP : 0);
+                handle_events(events[i].data.ptr, revents);
+            }
+        }
+
+        if (cur_time >= next_tick) {
+            for(c = first_worker_ctx(w); c != NULL; c = c_next) {
+                c_next = c->worker_next;
+                handle_events(c, 0);
+            }
+            lock_server();
+            nb_packetized = w->nb_packetized;
+            unlock_server();
+            next_tick = cur_time + (nb_packetized ? 10 : 1000);
+        }
     }
+    return NULL;
+}
 
-    if (my_http_addr.sin_port) {
-        server_fd = socket_open_listen(&my_http_addr);
-        if (server_fd < 0)
+static int add_listen_fd(Worker *w, int fd, uint64_t tag)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = tag;
+    return epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int init_workers(int server_fd, int rtsp_server_fd)
+{
+    int i;
+
+    if (!(workers = av_mallocz(nb_workers * sizeof(*workers))))
+        return -1;
+    for (i = 0; i < nb_workers; i++) {
+        workers[i].epoll_fd = epoll_create(nb_max_http_connections / nb_workers + 1);
+        if (workers[i].epoll_fd < 0) {
+            http_log("epoll_create failed: %s\n", strerror(errno));
+            return -1;
+        }
+        if (pipe(workers[i].wake_fd) < 0) {
+            http_log("pipe failed: %s\n", strerror(errno));
+            return -1;
+        }
+        ff_socket_nonblock(workers[i].wake_fd[0], 1);
+        ff_socket_nonblock(workers[i].wake_fd[1], 1);
+        if (add_listen_fd(&workers[i], workers[i].wake_fd[0], EVENT_WAKE) < 0)
             return -1;
     }
+    listen_fd      = server_fd;
+    rtsp_listen_fd = rtsp_server_fd;
+    if ((server_fd      && add_listen_fd(workers, server_fd,      EVENT_HTTP_SERVER) < 0) ||
+        (rtsp_server_fd && add_listen_fd(workers, rtsp_server_fd, EVENT_RTSP_SERVER) < 0))
+        return -1;
+    return 0;
+}
 
-    if (my_rtsp_addr.sin_port) {
-        rtsp_server_fd = socket_open_listen(&my_rtsp_addr);
-        if (rtsp_server_fd < 0)
+/* the first worker runs in the main thread */
+static int run_workers(void)
+{
+    int i;
+
+    for (i = 1; i < nb_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i])) {
+            http_log("pthread_create failed\n");
             return -1;
+        }
     }
+    worker_thread(workers);
+    return -1;
+}
+#else
+static int poll_loop(int server_fd, int rtsp_server_fd)
+{
+    int ret, delay, events;
+    struct pollfd *poll_table, *poll_entry;
+    HTTPContext *c, *c_next;
 
-    if (!rtsp_server_fd && !server_fd) {
-        http_log("HTTP and RTSP disabled.\n");
+    if(!(poll_table = av_mallocz((nb_max_http_connections + 2)*sizeof(*poll_table)))) {
+        http_log("Impossible to allocate a poll table handling %d connections.\n", nb_max_http_connections);
         return -1;
     }
 
-    http_log("FFserver started.\n");
-
-    start_children(first_feed);
-
-    start_multicast();
-
     for(;;) {
         poll_entry = poll_table;
         if (server_fd) {
@@ -642,48 +975,22 @@ static int http_server(void)
         c = first_http_ctx;
         delay = 1000;
         while (c != NULL) {
-            int fd;
-            fd = c->fd;
-            switch(c->state) {
-            case HTTPSTATE_SEND_HEADER:
-            case RTSPSTATE_SEND_REPLY:
-            case RTSPSTATE_SEND_PACKET:
-                c->poll_entry = poll_entry;
-                poll_entry->fd = fd;
-                poll_entry->events = POLLOUT;
-                poll_entry++;
-                break;
-            case HTTPSTATE_SEND_DATA_HEADER:
-            case HTTPSTATE_SEND_DATA:
-            case HTTPSTATE_SEND_DATA_TRAILER:
-                if (!c->is_packetized) {
-                    /* for TCP, we output as much as we can (may need to put a limit) */
-                    c->poll_entry = poll_entry;
-                    poll_entry->fd = fd;
-                    poll_entry->events = POLLOUT;
-                    poll_entry++;
-                } else {
-                    /* when ffserver is doing the timing, we work by
-                       looking at which packet need to be sent every
-                       10 ms */
-                    delay1 = 10; /* one tick wait XXX: 10 ms assumed */
-                    if (delay1 < delay)
-                        delay = delay1;
-                }
-                break;
-            case HTTPSTATE_WAIT_REQUEST:
-            case HTTPSTATE_RECEIVE_DATA:
-            case HTTPSTATE_WAIT_FEED:
-            case RTSPSTATE_WAIT_REQUEST:
-                /* need to catch errors */
+            c->poll_entry = NULL;
+            if (c->feed_event)
+                /* woken up by its feeder */
+                delay = 0;
+            if ((events = connection_events(c))) {
                 c->poll_entry = poll_entry;
-                poll_entry->fd = fd;
-                poll_entry->events = POLLIN;/* Maybe this will work */
+                poll_entry->fd = c->fd;
+                poll_entry->events = events;
                 poll_entry++;
-                break;
-            default:
-                c->poll_entry = NULL;
-                break;
+            } else if (c->state == HTTPSTATE_SEND_DATA_HEADER ||
+                       c->state == HTTPSTATE_SEND_DATA ||
+                       c->state == HTTPSTATE_SEND_DATA_TRAILER) {
+                /* when ffserver is doing the timing, we work by
+                   looking at which packet need to be sent every
+                   10 ms */
+                delay = FFMIN(delay, 10); /* one tick wait XXX: 10 ms assumed */
             }
             c = c->next;
         }
@@ -707,11 +1014,7 @@ static int http_server(void)
         /* now handle the events */
         for(c = first_http_ctx; c != NULL; c = c_next) {
             c_next = c->next;
-            if (handle_connection(c) < 0) {
-                /* close and free the connection */
-                log_connection(c);
-                close_connection(c);
-            }
+            handle_events(c, c->poll_entry ? c->poll_entry->revents : 0);
         }
 
         poll_entry = poll_table;
@@ -728,6 +1031,47 @@ static int http_server(void)
         }
     }
 }
+#endif
+
+/* main loop of the http server */
+static int http_server(void)
+{
+    int server_fd = 0, rtsp_server_fd = 0;
+
+    if (my_http_addr.sin_port) {
+        server_fd = socket_open_listen(&my_http_addr);
+        if (server_fd < 0)
+            return -1;
+    }
+
+    if (my_rtsp_addr.sin_port) {
+        rtsp_server_fd = socket_open_listen(&my_rtsp_addr);
+        if (rtsp_server_fd < 0)
+            return -1;
+    }
+
+    if (!rtsp_server_fd && !server_fd) {
+        http_log("HTTP and RTSP disabled.\n");
+        return -1;
+    }
+
+#if USE_WORKERS
+    if (init_workers(server_fd, rtsp_server_fd) < 0)
+        return -1;
+#endif
+
+    http_log("FFserver started.\n");
+
+    start_children(first_feed);
+
+    start_multicast();
+
+#if USE_WORKERS
+    return run_workers();
+#else
+    return poll_loop(server_fd, rtsp_server_fd);
+#endif
+}
 
 /* start waiting for a new HTTP/RTSP request */
 static void start_wait_request(HTTPContext *c, int is_rtsp)
@@ -775,11 +1119,6 @@ static void new_connection(int server_fd, int is_rtsp)
     }
     ff_socket_nonblock(fd, 1);
 
-    if (nb_connections >= nb_max_connections) {
-        http_send_too_busy_reply(fd);
-        goto fail;
-    }
-
     /* add a new connection */
     c = av_mallocz(sizeof(HTTPContext));
     if (!c)
@@ -793,12 +1132,18 @@ static void new_connection(int server_fd, int is_rtsp)
     if (!c->buffer)
         goto fail;
 
-    c->next = first_http_ctx;
-    first_http_ctx = c;
-    nb_connections++;
-
     start_wait_request(c, is_rtsp);
 
+    lock_server();
+    if (nb_connections >= nb_max_connections) {
+        http_send_too_busy_reply(fd);
+        unlock_server();
+        goto fail;
+    }
+    nb_connections++;
+    add_connection(c, !is_rtsp);
+    unlock_server();
+
     return;
 
  fail:
@@ -817,6 +1162,7 @@ static void close_connection(HTTPContext *c)
     URLContext *h;
     AVStream *st;
 
+    lock_server();
     /* remove connection from list */
     cp = &first_http_ctx;
     while ((*cp) != NULL) {
@@ -833,6 +1179,17 @@ static void close_connection(HTTPContext *c)
             c1->rtsp_c = NULL;
     }
 
+#if USE_WORKERS
+    for(cp = &c->worker->first_ctx; *cp != c; cp = &(*cp)->worker_next)
+        ;
+    *cp = c->worker_next;
+    c->worker->nb_packetized -= c->is_packetized;
+#endif
+    unlock_server();
+#if USE_WORKERS
+    set_events(c, 0);
+#endif
+
     /* remove connection associated resources */
     if (c->fd >= 0)
         closesocket(c->fd);
@@ -880,6 +1237,11 @@ static void close_connection(HTTPContext *c)
     for(i=0; i<ctx->nb_streams; i++)
         av_free(ctx->streams[i]);
 
+    lock_server();
+    mux_chunk_unref(&c->mux_chunk);
+    if (c->mux && !--c->mux->nb_clients)
+        shared_mux_close(c->stream);
+
     if (c->stream && !c->post && c->stream->stream_type == STREAM_TYPE_LIVE)
         current_bandwidth -= c->stream->bandwidth;
 
@@ -888,12 +1250,16 @@ static void close_connection(HTTPContext *c)
         c->stream->feed_opened = 0;
         close(c->feed_fd);
     }
+    nb_connections--;
+    unlock_server();
+
+    if (c->use_passthrough)
+        close(c->file_fd);
 
     av_freep(&c->pb_buffer);
     av_freep(&c->packet_buffer);
     av_free(c->buffer);
     av_free(c);
-    nb_connections--;
 }
 
 static int handle_connection(HTTPContext *c)
@@ -906,11 +1272,11 @@ static int handle_connection(HTTPContext *c)
         /* timeout ? */
         if ((c->timeout - cur_time) < 0)
             return -1;
-        if (c->poll_entry->revents & (POLLERR | POLLHUP))
+        if (c->revents & (POLLERR | POLLHUP))
             return -1;
 
         /* no need to read if no events */
-        if (!(c->poll_entry->revents & POLLIN))
+        if (!(c->revents & POLLIN))
             return 0;
         /* read the data */
     read_loop:
@@ -930,7 +1296,9 @@ static int handle_connection(HTTPContext *c)
                 (ptr >= c->buffer + 4 && !memcmp(ptr-4, "\r\n\r\n", 4))) {
                 /* request found : parse it and reply */
                 if (c->state == HTTPSTATE_WAIT_REQUEST) {
+                    lock_server();
                     ret = http_parse_request(c);
+                    unlock_server();
                 } else {
                     ret = rtsp_parse_request(c);
                 }
@@ -944,11 +1312,11 @@ static int handle_connection(HTTPContext *c)
         break;
 
     case HTTPSTATE_SEND_HEADER:
-        if (c->poll_entry->revents & (POLLERR | POLLHUP))
+        if (c->revents & (POLLERR | POLLHUP))
             return -1;
 
         /* no need to write if no events */
-        if (!(c->poll_entry->revents & POLLOUT))
+        if (!(c->revents & POLLOUT))
             return 0;
         len = send(c->fd, c->buffer_ptr, c->buffer_end - c->buffer_ptr, 0);
         if (len < 0) {
@@ -961,7 +1329,7 @@ static int handle_connection(HTTPContext *c)
         } else {
             c->buffer_ptr += len;
             if (c->stream)
-                c->stream->bytes_served += len;
+                add_bytes_served(c->stream, len);
             c->data_count += len;
             if (c->buffer_ptr >= c->buffer_end) {
                 av_freep(&c->pb_buffer);
@@ -982,11 +1350,11 @@ static int handle_connection(HTTPContext *c)
            input streams sets the speed). It may be better to verify
            that we do not rely too much on the kernel queues */
         if (!c->is_packetized) {
-            if (c->poll_entry->revents & (POLLERR | POLLHUP))
+            if (c->revents & (POLLERR | POLLHUP))
                 return -1;
 
             /* no need to read if no events */
-            if (!(c->poll_entry->revents & POLLOUT))
+            if (!(c->revents & POLLOUT))
                 return 0;
         }
         if (http_send_data(c) < 0)
@@ -997,28 +1365,35 @@ static int handle_connection(HTTPContext *c)
         break;
     case HTTPSTATE_RECEIVE_DATA:
         /* no need to read if no events */
-        if (c->poll_entry->revents & (POLLERR | POLLHUP))
+        if (c->revents & (POLLERR | POLLHUP))
             return -1;
-        if (!(c->poll_entry->revents & POLLIN))
+        if (!(c->revents & POLLIN))
             return 0;
         if (http_receive_data(c) < 0)
             return -1;
         break;
     case HTTPSTATE_WAIT_FEED:
         /* no need to read if no events */
-        if (c->poll_entry->revents & (POLLIN | POLLERR | POLLHUP))
+        if (c->revents & (POLLIN | POLLERR | POLLHUP))
             return -1;
 
-        /* nothing to do, we'll be waken up by incoming feed packets */
+        /* nothing to do until the feeder wakes us up */
+        lock_server();
+        if (c->feed_event > 0)
+            c->state = HTTPSTATE_SEND_DATA;
+        else if (c->feed_event < 0)
+            c->state = HTTPSTATE_SEND_DATA_TRAILER;
+        c->feed_event = 0;
+        unlock_server();
         break;
 
     case RTSPSTATE_SEND_REPLY:
-        if (c->poll_entry->revents & (POLLERR | POLLHUP)) {
+        if (c->revents & (POLLERR | POLLHUP)) {
             av_freep(&c->pb_buffer);
             return -1;
         }
         /* no need to write if no events */
-        if (!(c->poll_entry->revents & POLLOUT))
+        if (!(c->revents & POLLOUT))
             return 0;
         len = send(c->fd, c->buffer_ptr, c->buffer_end - c->buffer_ptr, 0);
         if (len < 0) {
@@ -1039,12 +1414,12 @@ static int handle_connection(HTTPContext *c)
         }
         break;
     case RTSPSTATE_SEND_PACKET:
-        if (c->poll_entry->revents & (POLLERR | POLLHUP)) {
+        if (c->revents & (POLLERR | POLLHUP)) {
             av_freep(&c->packet_buffer);
             return -1;
         }
         /* no need to write if no events */
-        if (!(c->poll_entry->revents & POLLOUT))
+        if (!(c->revents & POLLOUT))
             return 0;
         len = send(c->fd, c->packet_buffer_ptr,
                     c->packet_buffer_end - c->packet_buffer_ptr, 0);
@@ -1443,6 +1818,79 @@ enum RedirType {
     REDIR_SDP,
 };
 
+/* open the file of a passthrough stream and find the part of it asked
+   for by a "Range: bytes=first-last" header, if any. Return 1 for a part,
+   0 for the whole file and AVERROR(ERANGE) if the part starts past the
+   end of the file. */
+static int open_passthrough_file(HTTPContext *c, int64_t *file_size)
+{
+    const char *p, *range = NULL;
+    char *end;
+    int64_t first, last;
+
+    c->file_fd = open(c->stream->feed_filename, O_RDONLY);
+    if (c->file_fd < 0) {
+        http_log("could not open %s: %s\n", c->stream->feed_filename, strerror(errno));
+        return AVERROR(errno);
+    }
+    c->use_passthrough = 1;
+    *file_size = lseek(c->file_fd, 0, SEEK_END);
+    if (*file_size < 0)
+        return AVERROR(errno);
+    c->file_pos = 0;
+    c->file_end = *file_size;
+
+    for (p = c->buffer; *p && *p != '\r' && *p != '\n'; ) {
+        if (strncasecmp(p, "Range:", 6) == 0) {
+            range = p + 6;
+            break;
+        }
+        p = strchr(p, '\n');
+        if (!p)
+            break;
+
+        p++;
+    }
+    if (!range)
+        return 0;
+
+    /* the whole file is sent for anything but a single valid range */
+    range += strspn(range, " \t");
+    if (strncasecmp(range, "bytes=", 6))
+        return 0;
+    range += 6;
+    if (*range == '-') {
+        /* last bytes of the file */
+        if (!isdigit(range[1]))
+            return 0;
+        last = strtoll(range + 1, &end, 10);
+        if (!last)
+            return AVERROR(ERANGE);
+        first = FFMAX(*file_size - last, 0);
+        last  = *file_size - 1;
+    } else {
+        if (!isdigit(*range))
+            return 0;
+        first = strtoll(range, &end, 10);
+        if (*end != '-')
+            return 0;
+        end++;
+        if (!isdigit(*end))
+            last = *file_size - 1;
+        else if ((last = strtoll(end, &end, 10)) < first)
+            return 0;
+    }
+    end += strspn(end, " \t");
+    if (*end != '\r' && *end != '\n')
+        return 0;
+    if (first >= *file_size)
+        return AVERROR(ERANGE);
+
+    c->file_pos = first;
+    c->file_end = FFMIN(last + 1, *file_size);
+    return 1;
+}
+
 /* parse http request and prepare header */
 static int http_parse_request(HTTPContext *c)
 {
@@ -1452,12 +1900,15 @@ static int http_parse_request(HTTPContext *c)
     char info[1024], filename[1024];
     char url[1024], *q;
     char protocol[32];
-    char msg[1024];
+    char msg[sizeof(url) + 64]; /* the url and the text around it */
     const char *mime_type;
     FFStream *stream;
     int i;
     char ratebuf[32];
+    char buf[128];
     char *useragent = 0;
+    int64_t file_size = 0;
+    int range = 0;
 
     p = c->buffer;
     get_word(cmd, sizeof(cmd), (const char **)&p);
@@ -1799,15 +2250,51 @@ static int http_parse_request(HTTPContext *c)
     if (c->stream->stream_type == STREAM_TYPE_STATUS)
         goto send_status;
 
+    /* live clients starting at the default position share the muxer
+       output, except asf ones which may switch to another rate */
+    c->use_shared_mux = c->stream->feed && c->stream->feed != c->stream &&
+                        !c->stream->no_shared_mux &&
+                        strcmp(c->stream->fmt->name, "asf_stream") &&
+                        !av_find_info_tag(buf, sizeof(buf), "date", info) &&
+                        !av_find_info_tag(buf, sizeof(buf), "buffer", info);
+
     /* open input stream */
-    if (open_input_stream(c, info) < 0) {
+    if (c->stream->passthrough && !av_find_info_tag(buf, sizeof(buf), "date", info)) {
+        /* the file is already in the output format: send it as is */
+        range = open_passthrough_file(c, &file_size);
+        if (range < 0 && range != AVERROR(ERANGE)) {
+            snprintf(msg, sizeof(msg), "Input stream corresponding to '%s' not found", url);
+            goto send_error;
+        }
+    } else if (c->use_shared_mux) {
+        c->start_time = cur_time;
+    } else if (open_input_stream(c, info) < 0) {
         snprintf(msg, sizeof(msg), "Input stream corresponding to '%s' not found", url);
         goto send_error;
     }
 
+    if (range == AVERROR(ERANGE)) {
+        c->http_error = 416;
+        q = c->buffer;
+        q += snprintf(q, c->buffer_size,
+                      "HTTP/1.0 416 Requested Range Not Satisfiable\r\n"
+                      "Content-Range: bytes */%"PRId64"\r\n"
+                      "Content-type: text/html\r\n"
+                      "\r\n"
+                      "<html><head><title>Requested Range Not Satisfiable</title></head><body>\r\n"
+                      "<p>The file is only %"PRId64" bytes long.</p>\r\n"
+                      "</body></html>\r\n", file_size, file_size);
+        /* prepare output buffer */
+        c->buffer_ptr = c->buffer;
+        c->buffer_end = q;
+        c->state = HTTPSTATE_SEND_HEADER;
+        return 0;
+    }
+
     /* prepare http header */
     q = c->buffer;
-    q += snprintf(q, q - (char *) c->buffer + c->buffer_size, "HTTP/1.0 200 OK\r\n");
+    q += snprintf(q, q - (char *) c->buffer + c->buffer_size, "HTTP/1.0 %s\r\n",
+                  range > 0 ? "206 Partial Content" : "200 OK");
     mime_type = c->stream->fmt->mime_type;
     if (!mime_type)
         mime_type = "application/x-octet-stream";
@@ -1821,6 +2308,15 @@ static int http_parse_request(HTTPContext *c)
 
         q += snprintf(q, q - (char *) c->buffer + c->buffer_size, "Server: Cougar 4.1.0.3923\r\nCache-Control: no-cache\r\nPragma: client-id=%d\r\nPragma: features=\"broadcast\"\r\n", c->wmp_client_id);
     }
+    if (c->use_passthrough) {
+        q += snprintf(q, q - (char *) c->buffer + c->buffer_size, "Accept-Ranges: bytes\r\n");
+        if (range > 0)
+            q += snprintf(q, q - (char *) c->buffer + c->buffer_size,
+                          "Content-Range: bytes %"PRId64"-%"PRId64"/%"PRId64"\r\n",
+                          c->file_pos, c->file_end - 1, file_size);
+        q += snprintf(q, q - (char *) c->buffer + c->buffer_size, "Content-Length: %"PRId64"\r\n",
+                      c->file_end - c->file_pos);
+    }
     q += snprintf(q, q - (char *) c->buffer + c->buffer_size, "Content-Type: %s\r\n", mime_type);
     q += snprintf(q, q - (char *) c->buffer + c->buffer_size, "\r\n");
 
@@ -2194,6 +2690,336 @@ static int open_input_stream(HTTPContext *c, const char *info)
     return 0;
 }
 
+/* set up ctx to mux stream and write the header, return its size */
+static int open_output_stream(AVFormatContext *ctx, FFStream *stream,
+                              uint8_t **header)
+{
+    int i;
+
+    memset(ctx, 0, sizeof(*ctx));
+    av_metadata_set2(&ctx->metadata, "author"   , stream->author   , 0);
+    av_metadata_set2(&ctx->metadata, "comment"  , stream->comment  , 0);
+    av_metadata_set2(&ctx->metadata, "copyright", stream->copyright, 0);
+    av_metadata_set2(&ctx->metadata, "title"    , stream->title    , 0);
+
+    for(i=0;i<stream->nb_streams;i++) {
+        AVStream *st;
+        AVStream *src;
+        st = av_mallocz(sizeof(AVStream));
+        ctx->streams[i] = st;
+        /* if file or feed, then just take streams from FFStream struct */
+        if (!stream->feed ||
+            stream->feed == stream)
+            src = stream->streams[i];
+        else
+            src = stream->feed->streams[stream->feed_streams[i]];
+
+        *st = *src;
+        st->priv_data = 0;
+        st->codec->frame_number = 0; /* XXX: should be done in
+                                       AVStream, not in codec */
+    }
+    /* set output format parameters */
+    ctx->oformat = stream->fmt;
+    ctx->nb_streams = stream->nb_streams;
+
+    /* prepare header and save header data in a stream */
+    if (url_open_dyn_buf(&ctx->pb) < 0) {
+        /* XXX: potential leak */
+        return -1;
+    }
+    ctx->pb->is_streamed = 1;
+
+    /*
+     * HACK to avoid mpeg ps muxer to spit many underflow errors
+     * Default value from FFmpeg
+     * Try to set it use configuration option
+     */
+    ctx->preload   = (int)(0.5*AV_TIME_BASE);
+    ctx->max_delay = (int)(0.7*AV_TIME_BASE);
+
+    av_set_parameters(ctx, NULL);
+    if (av_write_header(ctx) < 0) {
+        http_log("Error writing output header\n");
+        return -1;
+    }
+    av_metadata_free(&ctx->metadata);
+
+    return url_close_dyn_buf(ctx->pb, header);
+}
+
+static MuxChunk *mux_chunk_new(const uint8_t *data, int size, int64_t pts)
+{
+    MuxChunk *chunk = av_malloc(sizeof(MuxChunk) + size);
+
+    if (!chunk)
+        return NULL;
+    chunk->refcount = 1;
+    chunk->key = 0;
+    chunk->pts = pts;
+    chunk->size = size;
+    memcpy(chunk->data, data, size);
+    return chunk;
+}
+
+static void mux_chunk_unref(MuxChunk **chunk)
+{
+    if (*chunk && !--(*chunk)->refcount)
+        av_free(*chunk);
+    *chunk = NULL;
+}
+
+/* drop the oldest chunk, the clients sending it keep their reference */
+static void shared_mux_drop_chunk(SharedMux *mux)
+{
+    MuxChunk **chunk = &mux->chunks[mux->first_seq % SHARED_MUX_CHUNKS];
+
+    if (mux->nb_keys && mux->keys[mux->first_key] == mux->first_seq) {
+        mux->first_key = (mux->first_key + 1) % SHARED_MUX_KEYS;
+        mux->nb_keys--;
+    }
+    mux->size -= (*chunk)->size;
+    mux_chunk_unref(chunk);
+    mux->first_seq++;
+}
+
+/* drop the chunks before the second key frame */
+static void shared_mux_drop_gop(SharedMux *mux)
+{
+    int64_t end = mux->keys[(mux->first_key + 1) % SHARED_MUX_KEYS];
+
+    while (mux->first_seq < end)
+        shared_mux_drop_chunk(mux);
+}
+
+static int shared_mux_add(FFStream *stream, const uint8_t *data, int size,
+                          int64_t pts)
+{
+    SharedMux *mux = stream->shared_mux;
+    MuxChunk *chunk = mux_chunk_new(data, size, pts);
+
+    if (!chunk)
+        return AVERROR(ENOMEM);
+    chunk->key = mux->pending_key;
+    mux->pending_key = 0;
+
+    if (chunk->key) {
+        if (mux->nb_keys == SHARED_MUX_KEYS)
+            shared_mux_drop_gop(mux);
+        mux->keys[(mux->first_key + mux->nb_keys++) % SHARED_MUX_KEYS] = mux->next_seq;
+    }
+    if (mux->next_seq - mux->first_seq == SHARED_MUX_CHUNKS)
+        shared_mux_drop_chunk(mux);
+    mux->chunks[mux->next_seq++ % SHARED_MUX_CHUNKS] = chunk;
+    mux->size += size;
+
+    /* new clients join at the first key frame, so keep the most recent
+       one which is at least the preroll old */
+    while (mux->nb_keys > 1) {
+        int64_t next_seq = mux->keys[(mux->first_key + 1) % SHARED_MUX_KEYS];
+        MuxChunk *next = mux->chunks[next_seq % SHARED_MUX_CHUNKS];
+
+        if (mux->size <= SHARED_MUX_MAX_SIZE &&
+            (next->pts == AV_NOPTS_VALUE || pts == AV_NOPTS_VALUE ||
+             next->pts > pts - stream->prebuffer * (int64_t)1000))
+            break;
+        shared_mux_drop_gop(mux);
+    }
+    while (mux->size > SHARED_MUX_MAX_SIZE && mux->next_seq - mux->first_seq > 1)
+        shared_mux_drop_chunk(mux);
+    return 0;
+}
+
+static void shared_mux_close(FFStream *stream)
+{
+    SharedMux *mux = stream->shared_mux;
+    AVFormatContext *ctx = &mux->fmt_ctx;
+    uint8_t *buf;
+    int i;
+
+    if (mux->fmt_in) {
+        for(i=0;i<mux->fmt_in->nb_streams;i++) {
+            AVStream *st = mux->fmt_in->streams[i];
+            if (st->codec->codec)
+                avcodec_close(st->codec);
+        }
+        av_close_input_file(mux->fmt_in);
+    }
+    /* nobody gets the trailer, but it frees the muxer */
+    if (mux->header && url_open_dyn_buf(&ctx->pb) >= 0) {
+        av_write_trailer(ctx);
+        url_close_dyn_buf(ctx->pb, &buf);
+        av_free(buf);
+    }
+    for(i=0; i<ctx->nb_streams; i++)
+        av_free(ctx->streams[i]);
+
+    while (mux->first_seq < mux->next_seq)
+        shared_mux_drop_chunk(mux);
+    mux_chunk_unref(&mux->header);
+    av_freep(&stream->shared_mux);
+}
+
+/* start reading the feed where a client with the default position would,
+   and mux the header */
+static int shared_mux_open(FFStream *stream)
+{
+    SharedMux *mux;
+    AVFormatContext *s;
+    uint8_t *buf;
+    int i, len;
+
+    mux = av_mallocz(sizeof(SharedMux));
+    if (!mux)
+        return -1;
+    stream->shared_mux = mux;
+    mux->last_pts = AV_NOPTS_VALUE;
+    for(i=0;i<stream->nb_streams;i++)
+        if (stream->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+            mux->has_video = 1;
+
+    if (av_open_input_file(&s, stream->feed->feed_filename, stream->ifmt,
+                           FFM_PACKET_SIZE, stream->ap_in) < 0) {
+        http_log("could not open %s\n", stream->feed->feed_filename);
+        goto fail;
+    }
+    s->flags |= AVFMT_FLAG_GENPTS;
+    mux->fmt_in = s;
+    for(i=0;i<s->nb_streams;i++)
+        open_parser(s, i);
+    /* feeds are ffm files, which support seeking */
+    av_seek_frame(s, -1, av_gettime() - stream->prebuffer * (int64_t)1000, 0);
+
+    len = open_output_stream(&mux->fmt_ctx, stream, &buf);
+    if (len < 0)
+        goto fail;
+    mux->header = mux_chunk_new(buf, len, AV_NOPTS_VALUE);
+    av_free(buf);
+    if (!mux->header)
+        goto fail;
+    return 0;
+ fail:
+    shared_mux_close(stream);
+    return -1;
+}
+
+/* mux the next packet of the feed, return 1 if it gave a chunk, 0 if not,
+   AVERROR(EAGAIN) if the feed has no more data for now */
+static int shared_mux_read(FFStream *stream)
+{
+    SharedMux *mux = stream->shared_mux;
+    AVFormatContext *ctx = &mux->fmt_ctx;
+    AVStream *ist, *ost;
+    AVPacket pkt;
+    uint8_t *buf;
+    int i, len, ret;
+
+    ffm_set_write_index(mux->fmt_in,
+                        stream->feed->feed_write_index,
+                        stream->feed->feed_size);
+    if (av_read_frame(mux->fmt_in, &pkt) < 0)
+        return AVERROR(EAGAIN);
+
+    for(i=0;i<stream->nb_streams;i++)
+        if (stream->feed_streams[i] == pkt.stream_index)
+            break;
+    if (i == stream->nb_streams) {
+        av_free_packet(&pkt);
+        return 0;
+    }
+    ist = mux->fmt_in->streams[pkt.stream_index];
+    ost = ctx->streams[i];
+    pkt.stream_index = i;
+
+    /* without video, clients can join at any packet */
+    if (!mux->has_video ||
+        (pkt.flags & AV_PKT_FLAG_KEY &&
+         ist->codec->codec_type == AVMEDIA_TYPE_VIDEO))
+        mux->pending_key = 1;
+    if (pkt.dts != AV_NOPTS_VALUE)
+        mux->last_pts = av_rescale_q(pkt.dts, ist->time_base, AV_TIME_BASE_Q);
+
+    if (url_open_dyn_buf(&ctx->pb) < 0) {
+        av_free_packet(&pkt);
+        return AVERROR(ENOMEM);
+    }
+    ctx->pb->is_streamed = 1;
+    if (pkt.dts != AV_NOPTS_VALUE)
+        pkt.dts = av_rescale_q(pkt.dts, ist->time_base, ost->time_base);
+    if (pkt.pts != AV_NOPTS_VALUE)
+        pkt.pts = av_rescale_q(pkt.pts, ist->time_base, ost->time_base);
+    pkt.duration = av_rescale_q(pkt.duration, ist->time_base, ost->time_base);
+    ret = av_write_frame(ctx, &pkt);
+    len = url_close_dyn_buf(ctx->pb, &buf);
+    av_free_packet(&pkt);
+    ost->codec->frame_number++;
+
+    if (ret < 0)
+        http_log("Error writing frame to output\n");
+    else if (len > 0)
+        ret = shared_mux_add(stream, buf, len, mux->last_pts) < 0 ? AVERROR(ENOMEM) : 1;
+    else
+        ret = 0;
+    av_free(buf);
+    return ret;
+}
+
+/* http_prepare_data() for the clients of a shared mux, under server_lock */
+static int http_prepare_shared_data(HTTPContext *c)
+{
+    FFStream *stream = c->stream;
+    SharedMux *mux;
+    MuxChunk *chunk;
+    int ret;
+
+    switch(c->state) {
+    case HTTPSTATE_SEND_DATA_HEADER:
+        if (!stream->shared_mux && shared_mux_open(stream) < 0)
+            return -1;
+        c->mux = stream->shared_mux;
+        c->mux->nb_clients++;
+        c->mux_seq = -1;
+        chunk = c->mux->header;
+        c->state = HTTPSTATE_SEND_DATA;
+        c->last_packet_sent = 0;
+        break;
+    case HTTPSTATE_SEND_DATA:
+        /* no trailer when we time out, the muxer is not ours */
+        if (stream->max_time &&
+            stream->max_time + c->start_time - cur_time < 0)
+            return -1;
+        mux = c->mux;
+        for(;;) {
+            if (c->mux_seq >= 0 && c->mux_seq < mux->first_seq) {
+                http_log("%s: client too slow, skipping to the next key frame\n",
+                         inet_ntoa(c->from_addr.sin_addr));
+                c->mux_seq = -1;
+            }
+            if (c->mux_seq < 0 && mux->nb_keys)
+                c->mux_seq = mux->keys[mux->first_key];
+            if (c->mux_seq >= 0 && c->mux_seq < mux->next_seq)
+                break;
+            ret = shared_mux_read(stream);
+            if (ret == AVERROR(EAGAIN)) {
+                /* reached the end of the ffm file, wait for more data */
+                c->state = HTTPSTATE_WAIT_FEED;
+                c->feed_waiting = 1;
+                return 1; /* state changed */
+            } else if (ret < 0)
+                return -1;
+        }
+        chunk = mux->chunks[c->mux_seq++ % SHARED_MUX_CHUNKS];
+        break;
+    default:
+        return -1;
+    }
+    chunk->refcount++;
+    c->mux_chunk = chunk;
+    c->buffer_ptr = chunk->data;
+    c->buffer_end = chunk->data + chunk->size;
+    return 0;
+}
+
 /* return the server clock (in us) */
 static int64_t get_server_clock(HTTPContext *c)
 {
@@ -2224,60 +3050,24 @@ static int http_prepare_data(HTTPContext *c)
     AVFormatContext *ctx;
 
     av_freep(&c->pb_buffer);
+    if (c->use_shared_mux) {
+        lock_server();
+        mux_chunk_unref(&c->mux_chunk);
+        ret = http_prepare_shared_data(c);
+        unlock_server();
+        return ret;
+    }
+
     switch(c->state) {
     case HTTPSTATE_SEND_DATA_HEADER:
-        memset(&c->fmt_ctx, 0, sizeof(c->fmt_ctx));
-        av_metadata_set2(&c->fmt_ctx.metadata, "author"   , c->stream->author   , 0);
-        av_metadata_set2(&c->fmt_ctx.metadata, "comment"  , c->stream->comment  , 0);
-        av_metadata_set2(&c->fmt_ctx.metadata, "copyright", c->stream->copyright, 0);
-        av_metadata_set2(&c->fmt_ctx.metadata, "title"    , c->stream->title    , 0);
-
-        for(i=0;i<c->stream->nb_streams;i++) {
-            AVStream *st;
-            AVStream *src;
-            st = av_mallocz(sizeof(AVStream));
-            c->fmt_ctx.streams[i] = st;
-            /* if file or feed, then just take streams from FFStream struct */
-            if (!c->stream->feed ||
-                c->stream->feed == c->stream)
-                src = c->stream->streams[i];
-            else
-                src = c->stream->feed->streams[c->stream->feed_streams[i]];
-
-            *st = *src;
-            st->priv_data = 0;
-            st->codec->frame_number = 0; /* XXX: should be done in
-                                           AVStream, not in codec */
-        }
-        /* set output format parameters */
-        c->fmt_ctx.oformat = c->stream->fmt;
-        c->fmt_ctx.nb_streams = c->stream->nb_streams;
-
         c->got_key_frame = 0;
 
-        /* prepare header and save header data in a stream */
-        if (url_open_dyn_buf(&c->fmt_ctx.pb) < 0) {
-            /* XXX: potential leak */
-            return -1;
-        }
-        c->fmt_ctx.pb->is_streamed = 1;
-
-        /*
-         * HACK to avoid mpeg ps muxer to spit many underflow errors
-         * Default value from FFmpeg
-         * Try to set it use configuration option
-         */
-        c->fmt_ctx.preload   = (int)(0.5*AV_TIME_BASE);
-        c->fmt_ctx.max_delay = (int)(0.7*AV_TIME_BASE);
-
-        av_set_parameters(&c->fmt_ctx, NULL);
-        if (av_write_header(&c->fmt_ctx) < 0) {
-            http_log("Error writing output header\n");
+        /* our output streams share their codec contexts with the stream */
+        lock_server();
+        len = open_output_stream(&c->fmt_ctx, c->stream, &c->pb_buffer);
+        unlock_server();
+        if (len < 0)
             return -1;
-        }
-        av_metadata_free(&c->fmt_ctx.metadata);
-
-        len = url_close_dyn_buf(c->fmt_ctx.pb, &c->pb_buffer);
         c->buffer_ptr = c->pb_buffer;
         c->buffer_end = c->pb_buffer + len;
 
@@ -2287,10 +3077,15 @@ static int http_prepare_data(HTTPContext *c)
     case HTTPSTATE_SEND_DATA:
         /* find a new packet */
         /* read a packet from the input stream */
-        if (c->stream->feed)
-            ffm_set_write_index(c->fmt_in,
-                                c->stream->feed->feed_write_index,
-                                c->stream->feed->feed_size);
+        if (c->stream->feed) {
+            int64_t feed_size;
+
+            lock_server();
+            c->feed_write_index = c->stream->feed->feed_write_index;
+            feed_size           = c->stream->feed->feed_size;
+            unlock_server();
+            ffm_set_write_index(c->fmt_in, c->feed_write_index, feed_size);
+        }
 
         if (c->stream->max_time &&
             c->stream->max_time + c->start_time - cur_time < 0)
@@ -2303,9 +3098,15 @@ static int http_prepare_data(HTTPContext *c)
             if (ret < 0) {
                 if (c->stream->feed) {
                     /* if coming from feed, it means we reached the end of the
-                       ffm file, so must wait for more data */
-                    c->state = HTTPSTATE_WAIT_FEED;
-                    return 1; /* state changed */
+                       ffm file, so must wait for more data, unless some came
+                       since we looked */
+                    lock_server();
+                    if (c->feed_write_index == c->stream->feed->feed_write_index) {
+                        c->state = HTTPSTATE_WAIT_FEED;
+                        c->feed_waiting = 1;
+                    }
+                    unlock_server();
+                    return c->state == HTTPSTATE_WAIT_FEED; /* state changed */
                 } else if (ret == AVERROR(EAGAIN)) {
                     /* input not ready, come back later */
                     return 0;
@@ -2415,7 +3216,9 @@ static int http_prepare_data(HTTPContext *c)
                     c->buffer_ptr = c->pb_buffer;
                     c->buffer_end = c->pb_buffer + len;
 
+                    lock_server();
                     codec->frame_number++;
+                    unlock_server();
                     if (len == 0) {
                         av_free_packet(&pkt);
                         goto redo;
@@ -2451,10 +3254,49 @@ static int http_prepare_data(HTTPContext *c)
 /* should convert the format at the same time */
 /* send data starting at c->buffer_ptr to the output connection
    (either UDP or TCP connection) */
+/* send the next part of a passthrough file, 0 copy when possible */
+static int http_send_file(HTTPContext *c)
+{
+    int len = FFMIN(c->file_end - c->file_pos, FILE_CHUNK_SIZE);
+
+    c->state = HTTPSTATE_SEND_DATA;
+    if (len > 0) {
+#if HAVE_SYS_SENDFILE_H
+        off_t pos = c->file_pos;
+
+        len = sendfile(c->fd, c->file_fd, &pos, len);
+#else
+        len = pread(c->file_fd, c->buffer, FFMIN(len, c->buffer_size), c->file_pos);
+        if (len > 0)
+            len = send(c->fd, c->buffer, len, 0);
+#endif
+        if (len < 0) {
+            if (ff_neterrno() != AVERROR(EAGAIN) &&
+                ff_neterrno() != AVERROR(EINTR))
+                return -1;
+            return 0;
+        } else if (!len) {
+            /* the file was truncated */
+            return -1;
+        }
+        c->file_pos += len;
+
+        c->data_count += len;
+        update_datarate(&c->datarate, c->data_count);
+        add_bytes_served(c->stream, len);
+    }
+    if (c->file_pos >= c->file_end)
+        c->state = HTTPSTATE_SEND_DATA_TRAILER;
+    return 0;
+}
+
 static int http_send_data(HTTPContext *c)
 {
     int len, ret;
 
+    if (c->use_passthrough)
+        return http_send_file(c);
+
     for(;;) {
         if (c->buffer_ptr >= c->buffer_end) {
             ret = http_prepare_data(c);
@@ -2487,7 +3329,7 @@ static int http_send_data(HTTPContext *c)
                 c->data_count += len;
                 update_datarate(&c->datarate, c->data_count);
                 if (c->stream)
-                    c->stream->bytes_served += len;
+                    add_bytes_served(c->stream, len);
 
                 if (c->rtp_protocol == RTSP_LOWER_TRANSPORT_TCP) {
                     /* RTP packets are sent inside the RTSP TCP connection */
@@ -2534,6 +3376,7 @@ static int http_send_data(HTTPContext *c)
                            send it later, so a new state is needed to
                            "lock" the RTSP TCP connection */
                         rtsp_c->state = RTSPSTATE_SEND_PACKET;
+                        update_events(rtsp_c);
                         break;
                     } else
                         /* all data has been sent */
@@ -2562,7 +3405,7 @@ static int http_send_data(HTTPContext *c)
                 c->data_count += len;
                 update_datarate(&c->datarate, c->data_count);
                 if (c->stream)
-                    c->stream->bytes_served += len;
+                    add_bytes_served(c->stream, len);
                 break;
             }
         }
@@ -2613,9 +3456,24 @@ static int http_start_receive_data(HTTPContext *c)
     return 0;
 }
 
-static int http_receive_data(HTTPContext *c)
+/* tell the connections waiting for the feed of c that it got data (event 1)
+   or that its feeder left (event -1), under server_lock */
+static void wake_feed_clients(HTTPContext *c, int event)
 {
     HTTPContext *c1;
+
+    for(c1 = first_http_ctx; c1 != NULL; c1 = c1->next) {
+        if (c1->feed_waiting &&
+            c1->stream->feed == c->stream->feed) {
+            c1->feed_waiting = 0;
+            c1->feed_event = event;
+            wake_worker(c1);
+        }
+    }
+}
+
+static int http_receive_data(HTTPContext *c)
+{
     int len, loop_run = 0;
 
     while (c->chunked_encoding && !c->chunk_size &&
@@ -2688,6 +3546,7 @@ static int http_receive_data(HTTPContext *c)
                 goto fail;
             }
 
+            lock_server();
             feed->feed_write_index += FFM_PACKET_SIZE;
             /* update file size */
             if (feed->feed_write_index > c->stream->feed_size)
@@ -2697,18 +3556,15 @@ static int http_receive_data(HTTPContext *c)
             if (c->stream->feed_max_size && feed->feed_write_index >= c->stream->feed_max_size)
                 feed->feed_write_index = FFM_PACKET_SIZE;
 
+            /* wake up any waiting connections */
+            wake_feed_clients(c, 1);
+            unlock_server();
+
             /* write index */
             if (ffm_write_write_index(c->feed_fd, feed->feed_write_index) < 0) {
                 http_log("Error writing index to feed file: %s\n", strerror(errno));
                 goto fail;
             }
-
-            /* wake up any waiting connections */
-            for(c1 = first_http_ctx; c1 != NULL; c1 = c1->next) {
-                if (c1->state == HTTPSTATE_WAIT_FEED &&
-                    c1->stream->feed == c->stream->feed)
-                    c1->state = HTTPSTATE_SEND_DATA;
-            }
         } else {
             /* We have a header in our hands that contains useful data */
             AVFormatContext *s = NULL;
@@ -2738,11 +3594,13 @@ static int http_receive_data(HTTPContext *c)
                 goto fail;
             }
 
+            lock_server();
             for (i = 0; i < s->nb_streams; i++) {
                 AVStream *fst = feed->streams[i];
                 AVStream *st = s->streams[i];
                 avcodec_copy_context(fst->codec, st->codec);
             }
+            unlock_server();
 
             av_close_input_stream(s);
             av_free(pb);
@@ -2752,14 +3610,12 @@ static int http_receive_data(HTTPContext *c)
 
     return 0;
  fail:
+    lock_server();
     c->stream->feed_opened = 0;
-    close(c->feed_fd);
     /* wake up any waiting connections to stop waiting for feed */
-    for(c1 = first_http_ctx; c1 != NULL; c1 = c1->next) {
-        if (c1->state == HTTPSTATE_WAIT_FEED &&
-            c1->stream->feed == c->stream->feed)
-            c1->state = HTTPSTATE_SEND_DATA_TRAILER;
-    }
+    wake_feed_clients(c, -1);
+    unlock_server();
+    close(c->feed_fd);
     return -1;
 }
 
@@ -3029,11 +3885,14 @@ static HTTPContext *find_rtp_session(const char *session_id)
     if (session_id[0] == '\0')
         return NULL;
 
+    /* the RTP connections are all ours, but not the list */
+    lock_server();
     for(c = first_http_ctx; c != NULL; c = c->next) {
         if (!strcmp(c->session_id, session_id))
-            return c;
+            break;
     }
-    return NULL;
+    unlock_server();
+    return c;
 }
 
 static RTSPTransportField *find_transport(RTSPMessageHeader *h, enum RTSPLowerTransport lower_transport)
@@ -3097,9 +3956,12 @@ static void rtsp_cmd_setup(HTTPContext *c, const char *url,
  found:
 
     /* generate session id if needed */
-    if (h->session_id[0] == '\0')
+    if (h->session_id[0] == '\0') {
+        lock_server();
         snprintf(h->session_id, sizeof(h->session_id), "%08x%08x",
                  av_lfg_get(&random_state), av_lfg_get(&random_state));
+        unlock_server();
+    }
 
     /* find rtp session, and create it if none found */
     rtp_c = find_rtp_session(h->session_id);
@@ -3311,11 +4173,6 @@ static HTTPContext *rtp_new_connection(struct sockaddr_in *from_addr,
     HTTPContext *c = NULL;
     const char *proto_str;
 
-    /* XXX: should output a warning page when coming
-       close to the connection limit */
-    if (nb_connections >= nb_max_connections)
-        goto fail;
-
     /* add a new connection */
     c = av_mallocz(sizeof(HTTPContext));
     if (!c)
@@ -3328,7 +4185,6 @@ static HTTPContext *rtp_new_connection(struct sockaddr_in *from_addr,
     c->buffer = av_malloc(c->buffer_size);
     if (!c->buffer)
         goto fail;
-    nb_connections++;
     c->stream = stream;
     av_strlcpy(c->session_id, session_id, sizeof(c->session_id));
     c->state = HTTPSTATE_READY;
@@ -3353,10 +4209,17 @@ static HTTPContext *rtp_new_connection(struct sockaddr_in *from_addr,
     av_strlcpy(c->protocol, "RTP/", sizeof(c->protocol));
     av_strlcat(c->protocol, proto_str, sizeof(c->protocol));
 
+    lock_server();
+    /* XXX: should output a warning page when coming
+       close to the connection limit */
+    if (nb_connections >= nb_max_connections) {
+        unlock_server();
+        goto fail;
+    }
+    nb_connections++;
     current_bandwidth += stream->bandwidth;
-
-    c->next = first_http_ctx;
-    first_http_ctx = c;
+    add_connection(c, 0);
+    unlock_server();
     return c;
 
  fail:
@@ -3598,6 +4461,21 @@ static void extract_mpeg4_header(AVFormatContext *infile)
     }
 }
 
+/* return true if name is one of the comma separated names */
+static int match_format_name(const char *name, const char *names)
+{
+    int len = strlen(name);
+    const char *p;
+
+    for (p = names; p; p = strchr(p, ',')) {
+        if (*p == ',')
+            p++;
+        if (!strncmp(p, name, len) && (p[len] == ',' || !p[len]))
+            return 1;
+    }
+    return 0;
+}
+
 /* compute the needed AVStream for each file */
 static void build_file_streams(void)
 {
@@ -3642,6 +4520,15 @@ static void build_file_streams(void)
                 for(i=0;i<infile->nb_streams;i++)
                     add_av_stream1(stream, infile->streams[i]->codec, 1);
 
+                /* remuxing the file to its own format would only change
+                   its layout, unless it is cut or gets new metadata */
+                stream->passthrough = !stream->no_passthrough && stream->fmt &&
+                                      match_format_name(stream->fmt->name,
+                                                        infile->iformat->name) &&
+                                      !stream->max_time && !stream->loop &&
+                                      !stream->author[0] && !stream->title[0] &&
+                                      !stream->copyright[0] && !stream->comment[0];
+
                 av_close_input_file(infile);
             }
         }
@@ -4117,6 +5004,15 @@ static int parse_ffconfig(const char *filename)
             } else {
                 nb_max_connections = val;
             }
+        } else if (!strcasecmp(cmd, "Threads")) {
+            get_arg(arg, sizeof(arg), &p);
+            val = atoi(arg);
+            if (val < 1 || val > 256) {
+                ERROR("Invalid Threads: %s\n", arg);
+            } else {
+                /* the poll() loop only runs in one thread */
+                nb_workers = USE_WORKERS ? val : 1;
+            }
         } else if (!strcasecmp(cmd, "MaxBandwidth")) {
             int64_t llval;
             get_arg(arg, sizeof(arg), &p);
@@ -4568,6 +5464,12 @@ static int parse_ffconfig(const char *filename)
         } else if (!strcasecmp(cmd, "NoLoop")) {
             if (stream)
                 stream->loop = 0;
+        } else if (!strcasecmp(cmd, "NoSharedMux")) {
+            if (stream)
+                stream->no_shared_mux = 1;
+        } else if (!strcasecmp(cmd, "NoPassthrough")) {
+            if (stream)
+                stream->no_passthrough = 1;
         } else if (!strcasecmp(cmd, "</Stream>")) {
             if (!stream) {
                 ERROR("No corresponding <Stream> for </Stream>\n");
@@ -32,8 +32,8 @@
 #include "libavutil/cpu.h"
 
 #define LIBAVCODEC_VERSION_MAJOR 52
-#define LIBAVCODEC_VERSION_MINOR 113
-#define LIBAVCODEC_VERSION_MICRO  2
+#define LIBAVCODEC_VERSION_MINOR 115
+#define LIBAVCODEC_VERSION_MICRO  0
 
 #define LIBAVCODEC_VERSION_INT  AV_VERSION_INT(LIBAVCODEC_VERSION_MAJOR, \
                                                LIBAVCODEC_VERSION_MINOR, \
@@ -2202,6 +2202,7 @@ typedef struct AVCodecContext {
     /**
      * thread count
      * is used to decide how many independent tasks should be passed to execute()
+     * 0 selects one thread per logical CPU where this can be detected.
      * - encoding: Set by user.
      * - decoding: Set by user.
      */
@@ -2868,6 +2869,8 @@ typedef struct AVCodecContext {
      * Which multithreading methods to use.
      * Use of FF_THREAD_FRAME will increase decoding delay by one frame per thread,
      * so clients which cannot provide future frames should not use it.
+     * Intra-only encoders supporting FF_THREAD_FRAME delay their packets
+     * the same way.
      *
      * - encoding: Set by user, otherwise the default is used.
      * - decoding: Set by user, otherwise the default is used.
@@ -3201,6 +3204,29 @@ int av_grow_packet(AVPacket *pkt, int grow_by);
  */
 int av_dup_packet(AVPacket *pkt);
 
+/**
+ * Make dst a new reference to the packet src, sharing its payload
+ * instead of copying it. The payload is freed when the last reference
+ * to it is freed with av_free_packet().
+ *
+ * If src is not a reference already, dst gets a copy of its payload in
+ * a new shared buffer, unless dst and src are the same packet: a packet
+ * owning its payload is then turned into a reference to it without
+ * copying it, and its destructor is only called once the last reference
+ * is freed.
+ * av_shrink_packet() and av_grow_packet() give the packet they are
+ * called on a payload of its own again, the payload must not be
+ * written to in any other way while it is shared.
+ * The references to one payload may be made and freed from different
+ * threads.
+ *
+ * @param dst packet that is set to a new reference to src, including
+ *            all its other fields
+ * @param src packet to reference
+ * @return 0 if OK, AVERROR_xxx otherwise
+ */
+int av_ref_packet(AVPacket *dst, const AVPacket *src);
+
 /**
  * Free a packet.
  *
@@ -19,6 +19,11 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include "config.h"
+#if !HAVE_SYNC_ADD_AND_FETCH && HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #include "avcodec.h"
 #include "libavutil/avassert.h"
 
@@ -34,6 +39,87 @@ void av_destruct_packet(AVPacket *pkt)
     pkt->data = NULL; pkt->size = 0;
 }
 
+/**
+ * Payload shared by the references made with av_ref_packet(), kept in
+ * AVPacket.priv. It keeps the destructor the payload was owned through,
+ * which is called when the last reference is freed.
+ */
+typedef struct PacketBuffer {
+    uint8_t *data;
+    int size;
+    void (*destruct)(AVPacket *);
+    void *priv;
+    int refcount;
+} PacketBuffer;
+
+#if !HAVE_SYNC_ADD_AND_FETCH && HAVE_PTHREADS
+static pthread_mutex_t refcount_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * Add to the reference count of a shared payload, atomically as the
+ * references may be owned by different threads.
+ * @return the new reference count
+ */
+static int add_packet_ref(PacketBuffer *buf, int add)
+{
+#if HAVE_SYNC_ADD_AND_FETCH
+    return __sync_add_and_fetch(&buf->refcount, add);
+#elif HAVE_PTHREADS
+    int refcount;
+    pthread_mutex_lock(&refcount_mutex);
+    refcount = buf->refcount += add;
+    pthread_mutex_unlock(&refcount_mutex);
+    return refcount;
+#else
+    return buf->refcount += add;
+#endif
+}
+
+static void destruct_packet_ref(AVPacket *pkt)
+{
+    PacketBuffer *buf = pkt->priv;
+
+    if (!add_packet_ref(buf, -1)) {
+        AVPacket orig;
+        av_init_packet(&orig);
+        orig.data     = buf->data;
+        orig.size     = buf->size;
+        orig.priv     = buf->priv;
+        orig.destruct = buf->destruct;
+        if (orig.destruct)
+            orig.destruct(&orig);
+        av_free(buf);
+    }
+    pkt->priv = NULL;
+    pkt->data = NULL; pkt->size = 0;
+}
+
+/**
+ * Give pkt back a payload of its own, copying the payload if it is
+ * shared with other references.
+ */
+static int unshare_packet(AVPacket *pkt)
+{
+    PacketBuffer *buf = pkt->priv;
+
+    if (pkt->destruct != destruct_packet_ref)
+        return 0;
+    if (add_packet_ref(buf, 0) > 1 || pkt->data != buf->data) {
+        AVPacket tmp = *pkt;
+        tmp.destruct = NULL;
+        if (av_dup_packet(&tmp) < 0)
+            return AVERROR(ENOMEM);
+        destruct_packet_ref(pkt);
+        *pkt = tmp;
+    } else {
+        pkt->priv     = buf->priv;
+        pkt->destruct = buf->destruct;
+        av_free(buf);
+    }
+    return 0;
+}
+
 void av_init_packet(AVPacket *pkt)
 {
     pkt->pts   = AV_NOPTS_VALUE;
@@ -69,6 +155,8 @@ void av_shrink_packet(AVPacket *pkt, int size)
 {
     if (pkt->size <= size) return;
     pkt->size = size;
+    if (unshare_packet(pkt) < 0)
+        return;
     memset(pkt->data + size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
 }
 
@@ -78,6 +166,8 @@ int av_grow_packet(AVPacket *pkt, int grow_by)
     av_assert0((unsigned)pkt->size <= INT_MAX - FF_INPUT_BUFFER_PADDING_SIZE);
     if (!pkt->size)
         return av_new_packet(pkt, grow_by);
+    if (unshare_packet(pkt) < 0)
+        return AVERROR(ENOMEM);
     if ((unsigned)grow_by > INT_MAX - (pkt->size + FF_INPUT_BUFFER_PADDING_SIZE))
         return -1;
     new_ptr = av_realloc(pkt->data, pkt->size + grow_by + FF_INPUT_BUFFER_PADDING_SIZE);
@@ -108,6 +198,50 @@ int av_dup_packet(AVPacket *pkt)
     return 0;
 }
 
+int av_ref_packet(AVPacket *dst, const AVPacket *src)
+{
+    PacketBuffer *buf;
+
+    if (src->destruct == destruct_packet_ref) {
+        add_packet_ref(src->priv, 1);
+        *dst = *src;
+        return 0;
+    }
+
+    buf = av_malloc(sizeof(PacketBuffer));
+    if (!buf)
+        return AVERROR(ENOMEM);
+    if (dst == src) {
+        /* take over the payload, after giving the packet one of its own
+           if it does not own it */
+        if (av_dup_packet(dst) < 0) {
+            av_free(buf);
+            return AVERROR(ENOMEM);
+        }
+        buf->data     = dst->data;
+        buf->size     = dst->size;
+        buf->destruct = dst->destruct;
+        buf->priv     = dst->priv;
+    } else {
+        AVPacket copy = *src;
+        copy.destruct = NULL;
+        if (av_dup_packet(&copy) < 0) {
+            av_free(buf);
+            return AVERROR(ENOMEM);
+        }
+        buf->data     = copy.data;
+        buf->size     = copy.size;
+        buf->destruct = copy.destruct;
+        buf->priv     = NULL;
+    }
+    buf->refcount = 1;
+    *dst = *src;
+    dst->data     = buf->data;
+    dst->priv     = buf;
+    dst->destruct = destruct_packet_ref;
+    return 0;
+}
+
 void av_free_packet(AVPacket *pkt)
 {
     if (pkt) {
@@ -32,6 +32,7 @@
 #include "mpegvideo.h"
 #include "h264.h"
 #include "rectangle.h"
+#include "thread.h"
 
 /*
  * H264 redefines mb_intra so it is not mistakely used (its uninitialized in h264)
@@ -775,6 +776,15 @@ void ff_er_frame_end(MpegEncContext *s){
         s->current_picture= *s->current_picture_ptr;
     }
 
+    /* the concealment may read any part of the reference pictures, which
+     * can still be decoding in other frame threads */
+    if(HAVE_THREADS && s->avctx->active_thread_type&FF_THREAD_FRAME && s->codec_id != CODEC_ID_H264){
+        if(s->last_picture_ptr && s->last_picture_ptr != s->current_picture_ptr)
+            ff_thread_await_progress((AVFrame*)s->last_picture_ptr, INT_MAX, 0);
+        if(s->next_picture_ptr && s->next_picture_ptr != s->current_picture_ptr)
+            ff_thread_await_progress((AVFrame*)s->next_picture_ptr, INT_MAX, 0);
+    }
+
     if(s->avctx->debug&FF_DEBUG_ER){
         for(mb_y=0; mb_y<s->mb_height; mb_y++){
             for(mb_x=0; mb_x<s->mb_width; mb_x++){
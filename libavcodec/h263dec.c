@@ -37,6 +37,7 @@
 #include "vdpau_internal.h"
 #include "flv.h"
 #include "mpeg4video.h"
+#include "thread.h"
 
 //#define DEBUG
 //#define PRINT_FRAME_TIME
@@ -199,6 +200,13 @@ static int decode_slice(MpegEncContext *s){
             s->last_dc[2]= 128;
         }
 
+        /* B-frames read the MB types, skip flags and motion vectors of the
+         * next picture, the slice end check looks one MB ahead */
+        if (HAVE_THREADS && s->avctx->active_thread_type&FF_THREAD_FRAME
+            && s->pict_type == FF_B_TYPE)
+            ff_thread_await_progress((AVFrame*)s->next_picture_ptr,
+                                     FFMIN(s->mb_y + 1, s->mb_height - 1), 0);
+
         ff_init_block_index(s);
         for(; s->mb_x < s->mb_width; s->mb_x++) {
             int ret;
@@ -578,6 +586,12 @@ retry:
         || s->height != avctx->coded_height) {
         /* H.263 could change picture size any time */
         ParseContext pc= s->parse_context; //FIXME move these demuxng hack to avformat
+
+        if (s->context_initialized && avctx->coded_width
+            && HAVE_THREADS && avctx->active_thread_type&FF_THREAD_FRAME) {
+            av_log_missing_feature(s->avctx, "Width/height changing with frame threads is", 0);
+            return -1;
+        }
         s->parse_context.buffer=0;
         MPV_common_end(s);
         s->parse_context= pc;
@@ -627,6 +641,10 @@ retry:
     if(MPV_frame_start(s, avctx) < 0)
         return -1;
 
+    /* packed DivX streams store the next frame at the end of this one */
+    if (!s->divx_packed)
+        ff_thread_finish_setup(avctx);
+
     if (CONFIG_MPEG4_VDPAU_DECODER && (s->avctx->codec->capabilities & CODEC_CAP_HWACCEL_VDPAU)) {
         ff_vdpau_mpeg4_decode_picture(s, s->gb.buffer, s->gb.buffer_end - s->gb.buffer);
         goto frame_end;
@@ -744,9 +762,10 @@ AVCodec ff_h263_decoder = {
     NULL,
     ff_h263_decode_end,
     ff_h263_decode_frame,
-    CODEC_CAP_DRAW_HORIZ_BAND | CODEC_CAP_DR1 | CODEC_CAP_TRUNCATED | CODEC_CAP_DELAY,
+    CODEC_CAP_DRAW_HORIZ_BAND | CODEC_CAP_DR1 | CODEC_CAP_TRUNCATED | CODEC_CAP_DELAY | CODEC_CAP_FRAME_THREADS,
     .flush= ff_mpeg_flush,
     .max_lowres= 3,
     .long_name= NULL_IF_CONFIG_SMALL("H.263 / H.263-1996, H.263+ / H.263-1998 / H.263 version 2"),
     .pix_fmts= ff_hwaccel_pixfmt_list_420,
+    .update_thread_context= ONLY_IF_THREADS_ENABLED(ff_mpeg_update_thread_context),
 };
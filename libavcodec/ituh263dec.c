@@ -621,6 +621,11 @@ int ff_h263_decode_mb(MpegEncContext *s,
                 s->mv[0][0][0] = 0;
                 s->mv[0][0][1] = 0;
                 s->mb_skipped = !(s->obmc | s->loop_filter);
+                /* OBMC of skipped MBs needs the next MV too */
+                if(s->obmc && s->mb_x+1<s->mb_width && s->mb_num_left != 1){
+                    ff_h263_update_motion_val(s);
+                    preview_obmc(s);
+                }
                 goto end;
             }
             cbpc = get_vlc2(&s->gb, ff_h263_inter_MCBPC_vlc.table, INTER_MCBPC_VLC_BITS, 2);
@@ -843,8 +848,11 @@ intra:
     if(s->pb_frame && h263_skip_b_part(s, cbpb) < 0)
         return -1;
     if(s->obmc && !s->mb_intra){
-        if(s->pict_type == FF_P_TYPE && s->mb_x+1<s->mb_width && s->mb_num_left != 1)
+        if(s->pict_type == FF_P_TYPE && s->mb_x+1<s->mb_width && s->mb_num_left != 1){
+            /* the MV of this MB predicts the one of the next MB */
+            ff_h263_update_motion_val(s);
             preview_obmc(s);
+        }
     }
 end:
 
@@ -39,6 +39,7 @@
 #include "mjpeg.h"
 #include "mjpegdec.h"
 #include "jpeglsdec.h"
+#include "thread.h"
 
 
 static int build_vlc(VLC *vlc, const uint8_t *bits_table, const uint8_t *val_table,
@@ -77,6 +78,23 @@ static void build_basic_mjpeg_vlc(MJpegDecodeContext * s) {
               ff_mjpeg_val_ac_chrominance, 251, 0, 0);
 }
 
+static av_cold void init_huffman_tables(MJpegDecodeContext *s)
+{
+    AVCodecContext *avctx = s->avctx;
+
+    build_basic_mjpeg_vlc(s);
+
+    if (avctx->flags & CODEC_FLAG_EXTERN_HUFF)
+    {
+        av_log(avctx, AV_LOG_INFO, "mjpeg: using external huffman table\n");
+        init_get_bits(&s->gb, avctx->extradata, avctx->extradata_size*8);
+        if (ff_mjpeg_decode_dht(s)) {
+            av_log(avctx, AV_LOG_ERROR, "mjpeg: error using external huffman table, switching back to internal\n");
+            build_basic_mjpeg_vlc(s);
+        }
+    }
+}
+
 av_cold int ff_mjpeg_decode_init(AVCodecContext *avctx)
 {
     MJpegDecodeContext *s = avctx->priv_data;
@@ -91,17 +109,8 @@ av_cold int ff_mjpeg_decode_init(AVCodecContext *avctx)
     s->org_height = avctx->coded_height;
     avctx->chroma_sample_location = AVCHROMA_LOC_CENTER;
 
-    build_basic_mjpeg_vlc(s);
+    init_huffman_tables(s);
 
-    if (avctx->flags & CODEC_FLAG_EXTERN_HUFF)
-    {
-        av_log(avctx, AV_LOG_INFO, "mjpeg: using external huffman table\n");
-        init_get_bits(&s->gb, avctx->extradata, avctx->extradata_size*8);
-        if (ff_mjpeg_decode_dht(s)) {
-            av_log(avctx, AV_LOG_ERROR, "mjpeg: error using external huffman table, switching back to internal\n");
-            build_basic_mjpeg_vlc(s);
-        }
-    }
     if (avctx->extradata_size > 9 &&
         AV_RL32(avctx->extradata + 4) == MKTAG('f','i','e','l')) {
         if (avctx->extradata[9] == 6) { /* quicktime icefloe 019 */
@@ -115,6 +124,95 @@ av_cold int ff_mjpeg_decode_init(AVCodecContext *avctx)
     return 0;
 }
 
+static av_cold int mjpeg_decode_init_thread_copy(AVCodecContext *avctx)
+{
+    MJpegDecodeContext *s = avctx->priv_data;
+
+    /* each thread needs its own huffman tables, the other buffers are
+     * allocated as frames arrive */
+    s->avctx = avctx;
+    memset(s->vlcs, 0, sizeof(s->vlcs));
+    init_huffman_tables(s);
+
+    return 0;
+}
+
+static int build_dht_vlcs(MJpegDecodeContext *s, int class, int index)
+{
+    const uint8_t *bits_table = s->huff_bits[class][index];
+    const uint8_t *val_table  = s->huff_val [class][index];
+    int nb_codes = s->huff_nb_codes[class][index];
+
+    /* build VLC and flush previous vlc if present */
+    free_vlc(&s->vlcs[class][index]);
+    av_log(s->avctx, AV_LOG_DEBUG, "class=%d index=%d nb_codes=%d\n",
+           class, index, nb_codes);
+    if(build_vlc(&s->vlcs[class][index], bits_table, val_table, nb_codes, 0, class > 0) < 0){
+        return -1;
+    }
+
+    if(class>0){
+        free_vlc(&s->vlcs[2][index]);
+        if(build_vlc(&s->vlcs[2][index], bits_table, val_table, nb_codes, 0, 0) < 0){
+        return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Give the next frame thread the tables and the stream state that the
+ * packets decoded so far defined, as later packets may rely on them.
+ */
+static int mjpeg_decode_update_thread_context(AVCodecContext *dst, const AVCodecContext *src)
+{
+    MJpegDecodeContext *s = dst->priv_data, *s1 = src->priv_data;
+    int class, index;
+
+    if (dst == src)
+        return 0;
+
+    memcpy(s->quant_matrixes, s1->quant_matrixes, sizeof(s->quant_matrixes));
+    memcpy(s->qscale,         s1->qscale,         sizeof(s->qscale));
+
+    for (class = 0; class < 2; class++) {
+        for (index = 0; index < 4; index++) {
+            int n = s1->huff_nb_codes[class][index];
+
+            if (n == s->huff_nb_codes[class][index] &&
+                !memcmp(s->huff_bits[class][index], s1->huff_bits[class][index], 17) &&
+                !memcmp(s->huff_val [class][index], s1->huff_val [class][index], n))
+                continue;
+            memcpy(s->huff_bits[class][index], s1->huff_bits[class][index], 17);
+            memcpy(s->huff_val [class][index], s1->huff_val [class][index], n);
+            s->huff_nb_codes[class][index] = n;
+            if (build_dht_vlcs(s, class, index) < 0)
+                return -1;
+        }
+    }
+
+    if (s->width != s1->width || s->height != s1->height) {
+        av_freep(&s->qscale_table);
+        s->width  = s1->width;
+        s->height = s1->height;
+        if (s->width) {
+            s->qscale_table = av_mallocz((s->width+15)/16);
+            if (!s->qscale_table)
+                return AVERROR(ENOMEM);
+        }
+    }
+    s->first_picture = s1->first_picture;
+    s->interlaced    = s1->interlaced;
+    s->bottom_field  = s1->bottom_field;
+    s->picture.interlaced_frame = s1->picture.interlaced_frame;
+    s->picture.top_field_first  = s1->picture.top_field_first;
+    s->buggy_avid    = s1->buggy_avid;
+    s->cs_itu601     = s1->cs_itu601;
+    s->pegasus_rct   = s1->pegasus_rct;
+
+    return 0;
+}
+
 
 /* quantize tables */
 int ff_mjpeg_decode_dqt(MJpegDecodeContext *s)
@@ -169,6 +267,7 @@ int ff_mjpeg_decode_dht(MJpegDecodeContext *s)
         index = get_bits(&s->gb, 4);
         if (index >= 4)
             return -1;
+        bits_table[0] = 0;
         n = 0;
         for(i=1;i<=16;i++) {
             bits_table[i] = get_bits(&s->gb, 8);
@@ -187,20 +286,11 @@ int ff_mjpeg_decode_dht(MJpegDecodeContext *s)
         }
         len -= n;
 
-        /* build VLC and flush previous vlc if present */
-        free_vlc(&s->vlcs[class][index]);
-        av_log(s->avctx, AV_LOG_DEBUG, "class=%d index=%d nb_codes=%d\n",
-               class, index, code_max + 1);
-        if(build_vlc(&s->vlcs[class][index], bits_table, val_table, code_max + 1, 0, class > 0) < 0){
+        memcpy(s->huff_bits[class][index], bits_table, sizeof(bits_table));
+        memcpy(s->huff_val [class][index], val_table,  n);
+        s->huff_nb_codes[class][index] = code_max + 1;
+        if (build_dht_vlcs(s, class, index) < 0)
             return -1;
-        }
-
-        if(class>0){
-            free_vlc(&s->vlcs[2][index]);
-            if(build_vlc(&s->vlcs[2][index], bits_table, val_table, code_max + 1, 0, 0) < 0){
-            return -1;
-            }
-        }
     }
     return 0;
 }
@@ -343,10 +433,10 @@ int ff_mjpeg_decode_sof(MJpegDecodeContext *s)
     }
 
     if(s->picture.data[0])
-        s->avctx->release_buffer(s->avctx, &s->picture);
+        ff_thread_release_buffer(s->avctx, &s->picture);
 
     s->picture.reference= 0;
-    if(s->avctx->get_buffer(s->avctx, &s->picture) < 0){
+    if(ff_thread_get_buffer(s->avctx, &s->picture) < 0){
         av_log(s->avctx, AV_LOG_ERROR, "get_buffer() failed\n");
         return -1;
     }
@@ -771,6 +861,92 @@ static int ljpeg_decode_yuv_scan(MJpegDecodeContext *s, int predictor, int point
     return 0;
 }
 
+static av_always_inline int mjpeg_decode_mcu(MJpegDecodeContext *s, int nb_components, int Ah, int Al,
+                                              uint8_t **data, const int *linesize, int mb_x, int mb_y)
+{
+    int i;
+
+    for(i=0;i<nb_components;i++) {
+        uint8_t *ptr;
+        int n, h, v, x, y, c, j;
+        n = s->nb_blocks[i];
+        c = s->comp_index[i];
+        h = s->h_scount[i];
+        v = s->v_scount[i];
+        x = 0;
+        y = 0;
+        for(j=0;j<n;j++) {
+            ptr = data[c] +
+                (((linesize[c] * (v * mb_y + y) * 8) +
+                (h * mb_x + x) * 8) >> s->avctx->lowres);
+            if(s->interlaced && s->bottom_field)
+                ptr += linesize[c] >> 1;
+            if(!s->progressive) {
+                s->dsp.clear_block(s->block);
+                if(decode_block(s, s->block, i,
+                             s->dc_index[i], s->ac_index[i],
+                             s->quant_matrixes[ s->quant_index[c] ]) < 0) {
+                    av_log(s->avctx, AV_LOG_ERROR, "error y=%d x=%d\n", mb_y, mb_x);
+                    return -1;
+                }
+                s->dsp.idct_put(ptr, linesize[c], s->block);
+            } else {
+                int block_idx = s->block_stride[c] * (v * mb_y + y) + (h * mb_x + x);
+                DCTELEM *block = s->blocks[c][block_idx];
+                if(Ah)
+                    block[0] += get_bits1(&s->gb) * s->quant_matrixes[ s->quant_index[c] ][0] << Al;
+                else if(decode_dc_progressive(s, block, i, s->dc_index[i], s->quant_matrixes[ s->quant_index[c] ], Al) < 0) {
+                    av_log(s->avctx, AV_LOG_ERROR, "error y=%d x=%d\n", mb_y, mb_x);
+                    return -1;
+                }
+            }
+//            av_log(s->avctx, AV_LOG_DEBUG, "mb: %d %d processed\n", mb_y, mb_x);
+//av_log(NULL, AV_LOG_DEBUG, "%d %d %d %d %d %d %d %d \n", mb_x, mb_y, x, y, c, s->bottom_field, (v * mb_y + y) * 8, (h * mb_x + x) * 8);
+            if (++x == h) {
+                x = 0;
+                y++;
+            }
+        }
+    }
+    return 0;
+}
+
+typedef struct MJpegScanContext {
+    int nb_components;
+    uint8_t *data[MAX_COMPONENTS];
+    int linesize[MAX_COMPONENTS];
+    int error;                  ///< set by the restart intervals that failed to decode
+} MJpegScanContext;
+
+/**
+ * Decode one restart interval of a sequential scan.
+ * The intervals are independent, the DC predictors are reset at each
+ * RST marker, so they can be decoded by different threads.
+ */
+static int decode_restart_interval_thread(AVCodecContext *avctx, void *arg, int jobnr, int threadnr)
+{
+    MJpegDecodeContext *s0 = avctx->priv_data;
+    MJpegDecodeContext *s  = &s0->slice_context[threadnr];
+    MJpegScanContext *scan = arg;
+    int start = jobnr ? s0->restart_pos[jobnr - 1] : get_bits_count(&s0->gb) >> 3;
+    int end   = jobnr < s0->nb_restart_pos ? s0->restart_pos[jobnr] - 2 : s0->gb.size_in_bits >> 3;
+    int mcu     = jobnr * s->restart_interval;
+    int mcu_end = FFMIN(mcu + s->restart_interval, s->mb_width * s->mb_height);
+    int i;
+
+    init_get_bits(&s->gb, s0->gb.buffer + start, FFMAX(end - start, 0) * 8);
+    for (i = 0; i < scan->nb_components; i++)
+        s->last_dc[i] = 1024;
+
+    for (; mcu < mcu_end; mcu++)
+        if (mjpeg_decode_mcu(s, scan->nb_components, 0, 0, scan->data, scan->linesize,
+                             mcu % s->mb_width, mcu / s->mb_width) < 0) {
+            scan->error = 1;
+            return -1;
+        }
+    return 0;
+}
+
 static int mjpeg_decode_scan(MJpegDecodeContext *s, int nb_components, int Ah, int Al){
     int i, mb_x, mb_y;
     uint8_t* data[MAX_COMPONENTS];
@@ -792,53 +968,37 @@ static int mjpeg_decode_scan(MJpegDecodeContext *s, int nb_components, int Ah, i
         }
     }
 
+    /* decode the restart intervals in parallel when all their RST markers were found */
+    if (s->restart_interval && !s->restart_count && !s->progressive &&
+        s->avctx->active_thread_type&FF_THREAD_SLICE) {
+        int nb_intervals = (s->mb_width * s->mb_height + s->restart_interval - 1) / s->restart_interval;
+
+        if (!s->slice_context)
+            s->slice_context = av_malloc(s->avctx->thread_count * sizeof(*s->slice_context));
+
+        if (s->slice_context && nb_intervals > 1 && s->nb_restart_pos == nb_intervals - 1) {
+            MJpegScanContext scan;
+
+            scan.nb_components = nb_components;
+            scan.error         = 0;
+            memcpy(scan.data,     data,     sizeof(data));
+            memcpy(scan.linesize, linesize, sizeof(linesize));
+            for (i = 0; i < s->avctx->thread_count; i++)
+                memcpy(&s->slice_context[i], s, sizeof(*s));
+
+            s->avctx->execute2(s->avctx, decode_restart_interval_thread, &scan, NULL, nb_intervals);
+            skip_bits_long(&s->gb, get_bits_left(&s->gb));
+            return scan.error ? -1 : 0;
+        }
+    }
+
     for(mb_y = 0; mb_y < s->mb_height; mb_y++) {
         for(mb_x = 0; mb_x < s->mb_width; mb_x++) {
             if (s->restart_interval && !s->restart_count)
                 s->restart_count = s->restart_interval;
 
-            for(i=0;i<nb_components;i++) {
-                uint8_t *ptr;
-                int n, h, v, x, y, c, j;
-                n = s->nb_blocks[i];
-                c = s->comp_index[i];
-                h = s->h_scount[i];
-                v = s->v_scount[i];
-                x = 0;
-                y = 0;
-                for(j=0;j<n;j++) {
-                    ptr = data[c] +
-                        (((linesize[c] * (v * mb_y + y) * 8) +
-                        (h * mb_x + x) * 8) >> s->avctx->lowres);
-                    if(s->interlaced && s->bottom_field)
-                        ptr += linesize[c] >> 1;
-                    if(!s->progressive) {
-                        s->dsp.clear_block(s->block);
-                        if(decode_block(s, s->block, i,
-                                     s->dc_index[i], s->ac_index[i],
-                                     s->quant_matrixes[ s->quant_index[c] ]) < 0) {
-                            av_log(s->avctx, AV_LOG_ERROR, "error y=%d x=%d\n", mb_y, mb_x);
-                            return -1;
-                        }
-                        s->dsp.idct_put(ptr, linesize[c], s->block);
-                    } else {
-                        int block_idx = s->block_stride[c] * (v * mb_y + y) + (h * mb_x + x);
-                        DCTELEM *block = s->blocks[c][block_idx];
-                        if(Ah)
-                            block[0] += get_bits1(&s->gb) * s->quant_matrixes[ s->quant_index[c] ][0] << Al;
-                        else if(decode_dc_progressive(s, block, i, s->dc_index[i], s->quant_matrixes[ s->quant_index[c] ], Al) < 0) {
-                            av_log(s->avctx, AV_LOG_ERROR, "error y=%d x=%d\n", mb_y, mb_x);
-                            return -1;
-                        }
-                    }
-//                    av_log(s->avctx, AV_LOG_DEBUG, "mb: %d %d processed\n", mb_y, mb_x);
-//av_log(NULL, AV_LOG_DEBUG, "%d %d %d %d %d %d %d %d \n", mb_x, mb_y, x, y, c, s->bottom_field, (v * mb_y + y) * 8, (h * mb_x + x) * 8);
-                    if (++x == h) {
-                        x = 0;
-                        y++;
-                    }
-                }
-            }
+            if (mjpeg_decode_mcu(s, nb_components, Ah, Al, data, linesize, mb_x, mb_y) < 0)
+                return -1;
 
             if (s->restart_interval && !--s->restart_count) {
                 align_get_bits(&s->gb);
@@ -974,6 +1134,11 @@ int ff_mjpeg_decode_sos(MJpegDecodeContext *s)
                s->pegasus_rct ? "PRCT" : (s->rct ? "RCT" : ""));
 
 
+    /* a sequential scan of all components is the only one of its field,
+     * the tables and headers the next frames may rely on are known */
+    if (nb_components == s->nb_components && !s->progressive && !s->interlaced)
+        ff_thread_finish_setup(s->avctx);
+
     /* mjpeg-b can have padding bytes between sos and image data, skip them */
     for (i = s->mjpb_skiptosod; i > 0; i--)
         skip_bits(&s->gb, 8);
@@ -1260,6 +1425,26 @@ found:
     return val;
 }
 
+/**
+ * Remember where the data following a RST marker starts in the unescaped scan.
+ */
+static void add_restart_pos(MJpegDecodeContext *s, int pos)
+{
+    int *restart_pos;
+
+    if (s->nb_restart_pos < 0)
+        return;
+
+    restart_pos = av_fast_realloc(s->restart_pos, &s->restart_pos_size,
+                                  (s->nb_restart_pos + 1) * sizeof(*s->restart_pos));
+    if (!restart_pos) {
+        s->nb_restart_pos = -1;
+        return;
+    }
+    s->restart_pos = restart_pos;
+    s->restart_pos[s->nb_restart_pos++] = pos;
+}
+
 int ff_mjpeg_decode_frame(AVCodecContext *avctx,
                               void *data, int *data_size,
                               AVPacket *avpkt)
@@ -1299,6 +1484,7 @@ int ff_mjpeg_decode_frame(AVCodecContext *avctx,
                     const uint8_t *src = buf_ptr;
                     uint8_t *dst = s->buffer;
 
+                    s->nb_restart_pos = 0;
                     while (src<buf_end)
                     {
                         uint8_t x = *(src++);
@@ -1310,9 +1496,10 @@ int ff_mjpeg_decode_frame(AVCodecContext *avctx,
                                 while (src < buf_end && x == 0xff)
                                     x = *(src++);
 
-                                if (x >= 0xd0 && x <= 0xd7)
+                                if (x >= 0xd0 && x <= 0xd7) {
                                     *(dst++) = x;
-                                else if (x)
+                                    add_restart_pos(s, dst - s->buffer);
+                                } else if (x)
                                     break;
                             }
                         }
@@ -1523,6 +1710,8 @@ av_cold int ff_mjpeg_decode_end(AVCodecContext *avctx)
     av_free(s->buffer);
     av_free(s->qscale_table);
     av_freep(&s->ljpeg_buffer);
+    av_freep(&s->restart_pos);
+    av_freep(&s->slice_context);
     s->ljpeg_buffer_size=0;
 
     for(i=0;i<3;i++) {
@@ -1545,10 +1734,12 @@ AVCodec ff_mjpeg_decoder = {
     NULL,
     ff_mjpeg_decode_end,
     ff_mjpeg_decode_frame,
-    CODEC_CAP_DR1,
+    CODEC_CAP_DR1 | CODEC_CAP_FRAME_THREADS,
     NULL,
     .max_lowres = 3,
     .long_name = NULL_IF_CONFIG_SMALL("MJPEG (Motion JPEG)"),
+    .init_thread_copy = ONLY_IF_THREADS_ENABLED(mjpeg_decode_init_thread_copy),
+    .update_thread_context = ONLY_IF_THREADS_ENABLED(mjpeg_decode_update_thread_context),
 };
 
 AVCodec ff_thp_decoder = {
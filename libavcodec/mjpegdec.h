@@ -45,6 +45,9 @@ typedef struct MJpegDecodeContext {
 
     int16_t quant_matrixes[4][64];
     VLC vlcs[3][4];
+    uint8_t huff_bits[2][4][17];    ///< huffman tables last defined by DHT, to rebuild them in other frame threads
+    uint8_t huff_val[2][4][256];
+    int huff_nb_codes[2][4];        ///< 0 if the table was never defined by DHT
     int qscale[4];      ///< quantizer scale calculated from quant_matrixes
 
     int org_height;  /* size given at codec init */
@@ -93,6 +96,10 @@ typedef struct MJpegDecodeContext {
 
     int restart_interval;
     int restart_count;
+    int *restart_pos;           ///< offset of the data following each RST marker of the current scan
+    unsigned int restart_pos_size;
+    int nb_restart_pos;         ///< number of RST markers in the current scan, -1 if unknown
+    struct MJpegDecodeContext *slice_context; ///< per thread contexts decoding restart intervals in parallel
 
     int buggy_avid;
     int cs_itu601;
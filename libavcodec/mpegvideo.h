@@ -131,6 +131,8 @@ typedef struct Picture{
     uint8_t *mb_mean;           ///< Table for MB luminance
     int32_t *mb_cmp_score;      ///< Table for MB cmp scores, for mb decision FIXME remove
     int b_frame_score;          /* */
+    struct MpegEncContext *owner2; ///< pointer to the MpegEncContext that allocated this picture
+    int field_picture;          ///< whether or not the picture was encoded in separate fields
 } Picture;
 
 struct MpegEncContext;
@@ -461,6 +463,10 @@ typedef struct MpegEncContext {
     int next_lambda;               ///< next lambda used for retrying to encode a frame
     RateControlContext rc_context; ///< contains stuff only accessed in ratecontrol.c
 
+    /* b_frame_strategy 2 */
+    struct AVCodecContext *b_count_ctx[FF_MAX_B_FRAMES+1]; ///< downscaled encoder estimating each candidate B-frame count
+    uint8_t *b_count_outbuf[FF_MAX_B_FRAMES+1];
+
     /* statistics, used for 2-pass encoding */
     int mv_bits;
     int header_bits;
@@ -679,8 +685,23 @@ typedef struct MpegEncContext {
     int (*dct_quantize)(struct MpegEncContext *s, DCTELEM *block/*align 16*/, int n, int qscale, int *overflow);
     int (*fast_dct_quantize)(struct MpegEncContext *s, DCTELEM *block/*align 16*/, int n, int qscale, int *overflow);
     void (*denoise_dct)(struct MpegEncContext *s, DCTELEM *block);
+
+    int picture_count;         ///< number of allocated pictures (MAX_PICTURE_COUNT * avctx->thread_count)
+    int picture_range_start, picture_range_end; ///< the part of picture that this context can allocate in
 } MpegEncContext;
 
+/**
+ * Translates a Picture pointer of old_ctx into the corresponding one of new_ctx.
+ * Pointers into the picture array are mapped to the same index of the new
+ * array, pointers into the context itself (e.g. H.264 ref_list) are moved by
+ * the distance between the two contexts.
+ */
+#define REBASE_PICTURE(pic, new_ctx, old_ctx) ((pic) ? \
+    ((pic) >= (old_ctx)->picture && (pic) < (old_ctx)->picture+(old_ctx)->picture_count ?\
+        &(new_ctx)->picture[(pic) - (old_ctx)->picture] :\
+        (Picture*)((uint8_t*)(pic) - (uint8_t*)(old_ctx) + (uint8_t*)(new_ctx)))\
+    : NULL)
+
 
 void MPV_decode_defaults(MpegEncContext *s);
 int MPV_common_init(MpegEncContext *s);
@@ -701,9 +722,11 @@ void MPV_common_init_bfin(MpegEncContext *s);
 void ff_clean_intra_table_entries(MpegEncContext *s);
 void ff_draw_horiz_band(MpegEncContext *s, int y, int h);
 void ff_mpeg_flush(AVCodecContext *avctx);
+int ff_mpeg_update_thread_context(AVCodecContext *dst, const AVCodecContext *src);
 void ff_print_debug_info(MpegEncContext *s, AVFrame *pict);
 void ff_write_quant_matrix(PutBitContext *pb, uint16_t *matrix);
 int ff_find_unused_picture(MpegEncContext *s, int shared);
+void ff_release_unused_pictures(MpegEncContext *s, int remove_current);
 void ff_denoise_dct(MpegEncContext *s, DCTELEM *block);
 void ff_update_duplicate_context(MpegEncContext *dst, MpegEncContext *src);
 const uint8_t *ff_find_start_code(const uint8_t *p, const uint8_t *end, uint32_t *state);
@@ -476,7 +476,7 @@ av_cold int MPV_encode_init(AVCodecContext *avctx)
     }
 
     if(s->avctx->thread_count < 1){
-        av_log(avctx, AV_LOG_ERROR, "automatic thread number detection not supported by codec, patch welcome\n");
+        av_log(avctx, AV_LOG_ERROR, "automatic thread number detection not supported on this platform\n");
         return -1;
     }
 
@@ -764,9 +764,17 @@ av_cold int MPV_encode_init(AVCodecContext *avctx)
 av_cold int MPV_encode_end(AVCodecContext *avctx)
 {
     MpegEncContext *s = avctx->priv_data;
+    int i;
 
     ff_rate_control_uninit(s);
 
+    for(i=0; i<FF_ARRAY_ELEMS(s->b_count_ctx); i++){
+        if(s->b_count_ctx[i])
+            avcodec_close(s->b_count_ctx[i]);
+        av_freep(&s->b_count_ctx[i]);
+        av_freep(&s->b_count_outbuf[i]);
+    }
+
     MPV_common_end(s);
     if ((CONFIG_MJPEG_ENCODER || CONFIG_LJPEG_ENCODER) && s->out_format == FMT_MJPEG)
         ff_mjpeg_encode_close(s);
@@ -953,24 +961,74 @@ static int skip_check(MpegEncContext *s, Picture *p, Picture *ref){
     return 0;
 }
 
-static int estimate_best_b_count(MpegEncContext *s){
+typedef struct BCountCandidate {
+    MpegEncContext *s;
+    AVCodecContext *c;
+    AVFrame *input;
+    uint8_t *outbuf;
+    int outbuf_size;
+    int b_count;
+    int p_lambda, b_lambda, lambda2;
+    int64_t rd;
+} BCountCandidate;
+
+/**
+ * Encode the downscaled lookahead with b_count B-frames between references
+ * and store its rate-distortion cost.
+ */
+static int estimate_b_count_thread(AVCodecContext *avctx, void *arg){
+    BCountCandidate *cand= arg;
+    MpegEncContext *s= cand->s;
+    AVCodecContext *c= cand->c;
+    AVFrame frame;
+    int i, out_size, j= cand->b_count;
+    int64_t rd=0;
+
+    c->error[0]= c->error[1]= c->error[2]= 0;
+
+    frame= cand->input[0];
+    frame.pict_type= FF_I_TYPE;
+    frame.quality= 1 * FF_QP2LAMBDA;
+    out_size = avcodec_encode_video(c, cand->outbuf, cand->outbuf_size, &frame);
+//    rd += (out_size * lambda2) >> FF_LAMBDA_SHIFT;
+
+    for(i=0; i<s->max_b_frames+1; i++){
+        int is_p= i % (j+1) == j || i==s->max_b_frames;
+
+        frame= cand->input[i+1];
+        frame.pict_type= is_p ? FF_P_TYPE : FF_B_TYPE;
+        frame.quality= is_p ? cand->p_lambda : cand->b_lambda;
+        out_size = avcodec_encode_video(c, cand->outbuf, cand->outbuf_size, &frame);
+        rd += (out_size * cand->lambda2) >> (FF_LAMBDA_SHIFT - 3);
+    }
+
+    /* get the delayed frames */
+    while(out_size){
+        out_size = avcodec_encode_video(c, cand->outbuf, cand->outbuf_size, NULL);
+        rd += (out_size * cand->lambda2) >> (FF_LAMBDA_SHIFT - 3);
+    }
+
+    rd += c->error[0] + c->error[1] + c->error[2];
+
+    cand->rd= rd;
+    return 0;
+}
+
+/**
+ * Open the downscaled encoder estimating the cost of b_count B-frames.
+ * It is kept until the encoder is closed, each candidate count is always
+ * estimated by the same encoder whether the candidates run concurrently
+ * or not.
+ */
+static int open_b_count_context(MpegEncContext *s, int b_count){
     AVCodec *codec= avcodec_find_encoder(s->avctx->codec_id);
-    AVCodecContext *c= avcodec_alloc_context();
-    AVFrame input[FF_MAX_B_FRAMES+2];
+    AVCodecContext *c;
     const int scale= s->avctx->brd_scale;
-    int i, j, out_size, p_lambda, b_lambda, lambda2;
-    int outbuf_size= s->width * s->height; //FIXME
-    uint8_t *outbuf= av_malloc(outbuf_size);
-    int64_t best_rd= INT64_MAX;
-    int best_b_count= -1;
 
-    assert(scale>=0 && scale <=3);
-
-//    emms_c();
-    p_lambda= s->last_lambda_for[FF_P_TYPE]; //s->next_picture_ptr->quality;
-    b_lambda= s->last_lambda_for[FF_B_TYPE]; //p_lambda *FFABS(s->avctx->b_quant_factor) + s->avctx->b_quant_offset;
-    if(!b_lambda) b_lambda= p_lambda; //FIXME we should do this somewhere else
-    lambda2= (b_lambda*b_lambda + (1<<FF_LAMBDA_SHIFT)/2 ) >> FF_LAMBDA_SHIFT;
+    c= s->b_count_ctx[b_count]= avcodec_alloc_context();
+    s->b_count_outbuf[b_count]= av_malloc(s->width * s->height); //FIXME
+    if(!c || !s->b_count_outbuf[b_count])
+        return AVERROR(ENOMEM);
 
     c->width = s->width >> scale;
     c->height= s->height>> scale;
@@ -984,21 +1042,56 @@ static int estimate_best_b_count(MpegEncContext *s){
     c->time_base= s->avctx->time_base;
     c->max_b_frames= s->max_b_frames;
 
-    if (avcodec_open(c, codec) < 0)
+    if (avcodec_open(c, codec) < 0){
+        av_freep(&s->b_count_ctx[b_count]);
         return -1;
+    }
+    return 0;
+}
+
+static int estimate_best_b_count(MpegEncContext *s){
+    BCountCandidate cand[FF_MAX_B_FRAMES+1];
+    AVFrame input[FF_MAX_B_FRAMES+2];
+    const int scale= s->avctx->brd_scale;
+    const int width = s->width >> scale;
+    const int height= s->height>> scale;
+    int i, j, p_lambda, b_lambda, lambda2;
+    int nb_candidates;
+    int64_t best_rd= INT64_MAX;
+    int best_b_count= -1;
+
+    assert(scale>=0 && scale <=3);
+
+//    emms_c();
+    p_lambda= s->last_lambda_for[FF_P_TYPE]; //s->next_picture_ptr->quality;
+    b_lambda= s->last_lambda_for[FF_B_TYPE]; //p_lambda *FFABS(s->avctx->b_quant_factor) + s->avctx->b_quant_offset;
+    if(!b_lambda) b_lambda= p_lambda; //FIXME we should do this somewhere else
+    lambda2= (b_lambda*b_lambda + (1<<FF_LAMBDA_SHIFT)/2 ) >> FF_LAMBDA_SHIFT;
+
+    for(nb_candidates=0; nb_candidates<s->max_b_frames+1; nb_candidates++)
+        if(!s->input_picture[nb_candidates])
+            break;
+
+    for(j=0; j<nb_candidates; j++)
+        if(!s->b_count_ctx[j] && open_b_count_context(s, j) < 0)
+            return -1;
+
+    memset(input, 0, sizeof(input));
 
     for(i=0; i<s->max_b_frames+2; i++){
-        int ysize= c->width*c->height;
-        int csize= (c->width/2)*(c->height/2);
+        int ysize= width*height;
+        int csize= (width/2)*(height/2);
         Picture pre_input, *pre_input_ptr= i ? s->input_picture[i-1] : s->next_picture_ptr;
 
         avcodec_get_frame_defaults(&input[i]);
         input[i].data[0]= av_malloc(ysize + 2*csize);
+        if(!input[i].data[0])
+            goto fail;
         input[i].data[1]= input[i].data[0] + ysize;
         input[i].data[2]= input[i].data[1] + csize;
-        input[i].linesize[0]= c->width;
+        input[i].linesize[0]= width;
         input[i].linesize[1]=
-        input[i].linesize[2]= c->width/2;
+        input[i].linesize[2]= width/2;
 
         if(pre_input_ptr && (!i || s->input_picture[i-1])) {
             pre_input= *pre_input_ptr;
@@ -1009,52 +1102,44 @@ static int estimate_best_b_count(MpegEncContext *s){
                 pre_input.data[2]+=INPLACE_OFFSET;
             }
 
-            s->dsp.shrink[scale](input[i].data[0], input[i].linesize[0], pre_input.data[0], pre_input.linesize[0], c->width, c->height);
-            s->dsp.shrink[scale](input[i].data[1], input[i].linesize[1], pre_input.data[1], pre_input.linesize[1], c->width>>1, c->height>>1);
-            s->dsp.shrink[scale](input[i].data[2], input[i].linesize[2], pre_input.data[2], pre_input.linesize[2], c->width>>1, c->height>>1);
+            s->dsp.shrink[scale](input[i].data[0], input[i].linesize[0], pre_input.data[0], pre_input.linesize[0], width, height);
+            s->dsp.shrink[scale](input[i].data[1], input[i].linesize[1], pre_input.data[1], pre_input.linesize[1], width>>1, height>>1);
+            s->dsp.shrink[scale](input[i].data[2], input[i].linesize[2], pre_input.data[2], pre_input.linesize[2], width>>1, height>>1);
+        } else {
+            /* past the end of the input, the estimate must not depend on
+               whatever the buffer happened to contain */
+            memset(input[i].data[0], 0, ysize + 2*csize);
         }
     }
 
-    for(j=0; j<s->max_b_frames+1; j++){
-        int64_t rd=0;
-
-        if(!s->input_picture[j])
-            break;
-
-        c->error[0]= c->error[1]= c->error[2]= 0;
-
-        input[0].pict_type= FF_I_TYPE;
-        input[0].quality= 1 * FF_QP2LAMBDA;
-        out_size = avcodec_encode_video(c, outbuf, outbuf_size, &input[0]);
-//        rd += (out_size * lambda2) >> FF_LAMBDA_SHIFT;
-
-        for(i=0; i<s->max_b_frames+1; i++){
-            int is_p= i % (j+1) == j || i==s->max_b_frames;
-
-            input[i+1].pict_type= is_p ? FF_P_TYPE : FF_B_TYPE;
-            input[i+1].quality= is_p ? p_lambda : b_lambda;
-            out_size = avcodec_encode_video(c, outbuf, outbuf_size, &input[i+1]);
-            rd += (out_size * lambda2) >> (FF_LAMBDA_SHIFT - 3);
-        }
-
-        /* get the delayed frames */
-        while(out_size){
-            out_size = avcodec_encode_video(c, outbuf, outbuf_size, NULL);
-            rd += (out_size * lambda2) >> (FF_LAMBDA_SHIFT - 3);
-        }
+    for(j=0; j<nb_candidates; j++){
+        cand[j].s          = s;
+        cand[j].c          = s->b_count_ctx[j];
+        cand[j].input      = input;
+        cand[j].outbuf     = s->b_count_outbuf[j];
+        cand[j].outbuf_size= s->width * s->height;
+        cand[j].b_count    = j;
+        cand[j].p_lambda   = p_lambda;
+        cand[j].b_lambda   = b_lambda;
+        cand[j].lambda2    = lambda2;
+    }
 
-        rd += c->error[0] + c->error[1] + c->error[2];
+    /* the candidates are independent, evaluate them concurrently with slice threads */
+    if(s->avctx->active_thread_type&FF_THREAD_SLICE && s->avctx->thread_count > 1){
+        s->avctx->execute(s->avctx, estimate_b_count_thread, cand, NULL, nb_candidates, sizeof(BCountCandidate));
+    }else{
+        for(j=0; j<nb_candidates; j++)
+            estimate_b_count_thread(s->avctx, &cand[j]);
+    }
 
-        if(rd < best_rd){
-            best_rd= rd;
+    for(j=0; j<nb_candidates; j++){
+        if(cand[j].rd < best_rd){
+            best_rd= cand[j].rd;
             best_b_count= j;
         }
     }
 
-    av_freep(&outbuf);
-    avcodec_close(c);
-    av_freep(&c);
-
+fail:
     for(i=0; i<s->max_b_frames+2; i++){
         av_freep(&input[i].data[0]);
     }
@@ -444,6 +444,7 @@ AVCodec ff_png_encoder = {
     png_enc_init,
     encode_frame,
     NULL, //encode_end,
+    .capabilities = CODEC_CAP_FRAME_THREADS,
     .pix_fmts= (const enum PixelFormat[]){PIX_FMT_RGB24, PIX_FMT_RGB32, PIX_FMT_PAL8, PIX_FMT_GRAY8, PIX_FMT_MONOBLACK, PIX_FMT_NONE},
     .long_name= NULL_IF_CONFIG_SMALL("PNG image"),
 };
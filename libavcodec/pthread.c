@@ -29,33 +29,33 @@
  * @see doc/multithreading.txt
  */
 
+#include "config.h"
+
 #include <pthread.h>
+#if HAVE_SYSCONF
+#include <unistd.h>
+#endif
 
+#include "libavutil/threadpool.h"
 #include "avcodec.h"
+#include "dsputil.h"
 #include "thread.h"
 
 typedef int (action_func)(AVCodecContext *c, void *arg);
 typedef int (action_func2)(AVCodecContext *c, void *arg, int jobnr, int threadnr);
 
 typedef struct ThreadContext {
-    pthread_t *workers;
+    AVThreadPool *pool;
     action_func *func;
     action_func2 *func2;
-    void *args;
-    int *rets;
-    int rets_count;
-    int job_count;
     int job_size;
-
-    pthread_cond_t last_job_cond;
-    pthread_cond_t current_job_cond;
-    pthread_mutex_t current_job_lock;
-    int current_job;
-    int done;
 } ThreadContext;
 
+/// Max number of threads used when the thread count is detected automatically.
+#define MAX_AUTO_THREADS 16
+
 /// Max number of frame buffers that can be allocated when using frame threads.
-#define MAX_BUFFERS 32
+#define MAX_BUFFERS (32+1)
 
 /**
  * Context used by codec threads and stored in their AVCodecContext thread_opaque.
@@ -126,93 +126,33 @@ typedef struct FrameThreadContext {
     int die;                       ///< Set when threads should exit.
 } FrameThreadContext;
 
-static void* attribute_align_arg worker(void *v)
+static int run_job(void *v, void *args, int jobnr, int threadnr)
 {
     AVCodecContext *avctx = v;
     ThreadContext *c = avctx->thread_opaque;
-    int our_job = c->job_count;
-    int thread_count = avctx->thread_count;
-    int self_id;
-
-    pthread_mutex_lock(&c->current_job_lock);
-    self_id = c->current_job++;
-    for (;;){
-        while (our_job >= c->job_count) {
-            if (c->current_job == thread_count + c->job_count)
-                pthread_cond_signal(&c->last_job_cond);
-
-            pthread_cond_wait(&c->current_job_cond, &c->current_job_lock);
-            our_job = self_id;
-
-            if (c->done) {
-                pthread_mutex_unlock(&c->current_job_lock);
-                return NULL;
-            }
-        }
-        pthread_mutex_unlock(&c->current_job_lock);
-
-        c->rets[our_job%c->rets_count] = c->func ? c->func(avctx, (char*)c->args + our_job*c->job_size):
-                                                   c->func2(avctx, c->args, our_job, self_id);
-
-        pthread_mutex_lock(&c->current_job_lock);
-        our_job = c->current_job++;
-    }
-}
 
-static av_always_inline void avcodec_thread_park_workers(ThreadContext *c, int thread_count)
-{
-    pthread_cond_wait(&c->last_job_cond, &c->current_job_lock);
-    pthread_mutex_unlock(&c->current_job_lock);
+    return c->func ? c->func(avctx, (char*)args + jobnr*c->job_size):
+                     c->func2(avctx, args, jobnr, threadnr);
 }
 
 static void thread_free(AVCodecContext *avctx)
 {
     ThreadContext *c = avctx->thread_opaque;
-    int i;
-
-    pthread_mutex_lock(&c->current_job_lock);
-    c->done = 1;
-    pthread_cond_broadcast(&c->current_job_cond);
-    pthread_mutex_unlock(&c->current_job_lock);
-
-    for (i=0; i<avctx->thread_count; i++)
-         pthread_join(c->workers[i], NULL);
 
-    pthread_mutex_destroy(&c->current_job_lock);
-    pthread_cond_destroy(&c->current_job_cond);
-    pthread_cond_destroy(&c->last_job_cond);
-    av_free(c->workers);
+    avpriv_thread_pool_free(&c->pool);
     av_freep(&avctx->thread_opaque);
 }
 
 static int avcodec_thread_execute(AVCodecContext *avctx, action_func* func, void *arg, int *ret, int job_count, int job_size)
 {
     ThreadContext *c= avctx->thread_opaque;
-    int dummy_ret;
 
     if (!(avctx->active_thread_type&FF_THREAD_SLICE) || avctx->thread_count <= 1)
         return avcodec_default_execute(avctx, func, arg, ret, job_count, job_size);
 
-    if (job_count <= 0)
-        return 0;
-
-    pthread_mutex_lock(&c->current_job_lock);
-
-    c->current_job = avctx->thread_count;
-    c->job_count = job_count;
     c->job_size = job_size;
-    c->args = arg;
     c->func = func;
-    if (ret) {
-        c->rets = ret;
-        c->rets_count = job_count;
-    } else {
-        c->rets = &dummy_ret;
-        c->rets_count = 1;
-    }
-    pthread_cond_broadcast(&c->current_job_cond);
-
-    avcodec_thread_park_workers(c, avctx->thread_count);
+    avpriv_thread_pool_execute(c->pool, run_job, avctx, arg, ret, job_count);
 
     return 0;
 }
@@ -226,7 +166,6 @@ static int avcodec_thread_execute2(AVCodecContext *avctx, action_func2* func2, v
 
 static int thread_init(AVCodecContext *avctx)
 {
-    int i;
     ThreadContext *c;
     int thread_count = avctx->thread_count;
 
@@ -237,32 +176,13 @@ static int thread_init(AVCodecContext *avctx)
     if (!c)
         return -1;
 
-    c->workers = av_mallocz(sizeof(pthread_t)*thread_count);
-    if (!c->workers) {
+    c->pool = avpriv_thread_pool_create(thread_count);
+    if (!c->pool) {
         av_free(c);
         return -1;
     }
 
     avctx->thread_opaque = c;
-    c->current_job = 0;
-    c->job_count = 0;
-    c->job_size = 0;
-    c->done = 0;
-    pthread_cond_init(&c->current_job_cond, NULL);
-    pthread_cond_init(&c->last_job_cond, NULL);
-    pthread_mutex_init(&c->current_job_lock, NULL);
-    pthread_mutex_lock(&c->current_job_lock);
-    for (i=0; i<thread_count; i++) {
-        if(pthread_create(&c->workers[i], NULL, worker, avctx)) {
-           avctx->thread_count = i;
-           pthread_mutex_unlock(&c->current_job_lock);
-           ff_thread_free(avctx);
-           return -1;
-        }
-    }
-
-    avcodec_thread_park_workers(c, thread_count);
-
     avctx->execute = avcodec_thread_execute;
     avctx->execute2 = avcodec_thread_execute2;
     return 0;
@@ -314,6 +234,37 @@ static attribute_align_arg void *frame_worker_thread(void *arg)
     return NULL;
 }
 
+/**
+ * Codec worker thread for frame-threaded encoding.
+ *
+ * Encodes the picture stored in the PerThreadContext into its packet buffer.
+ */
+static attribute_align_arg void *frame_encoder_thread(void *arg)
+{
+    PerThreadContext *p = arg;
+    FrameThreadContext *fctx = p->parent;
+    AVCodecContext *avctx = p->avctx;
+
+    pthread_mutex_lock(&p->mutex);
+    while (1) {
+        while (p->state == STATE_INPUT_READY && !fctx->die)
+            pthread_cond_wait(&p->input_cond, &p->mutex);
+
+        if (fctx->die) break;
+
+        p->result = avctx->codec->encode(avctx, p->avpkt.data, p->avpkt.size, &p->frame);
+        emms_c();
+
+        pthread_mutex_lock(&p->progress_mutex);
+        p->state = STATE_INPUT_READY;
+        pthread_cond_signal(&p->output_cond);
+        pthread_mutex_unlock(&p->progress_mutex);
+    }
+    pthread_mutex_unlock(&p->mutex);
+
+    return NULL;
+}
+
 /**
  * Updates the next thread's AVCodecContext with values from the reference thread's context.
  *
@@ -332,6 +283,9 @@ static int update_context_from_thread(AVCodecContext *dst, AVCodecContext *src,
         dst->height    = src->height;
         dst->pix_fmt   = src->pix_fmt;
 
+        dst->coded_width  = src->coded_width;
+        dst->coded_height = src->coded_height;
+
         dst->has_b_frames = src->has_b_frames;
         dst->idct_algo    = src->idct_algo;
         dst->slice_count  = src->slice_count;
@@ -536,7 +490,11 @@ int ff_thread_decode_frame(AVCodecContext *avctx,
 
         *picture = p->frame;
         *got_picture_ptr = p->got_frame;
-        picture->pkt_dts = p->avpkt.dts;
+        /*
+         * A frame output while flushing belongs to the current empty packet,
+         * like without threads, not to the older one given to this thread.
+         */
+        picture->pkt_dts = p->avpkt.size ? p->avpkt.dts : avpkt->dts;
 
         /*
          * A later call with avkpt->size == 0 may loop over all threads,
@@ -558,6 +516,108 @@ int ff_thread_decode_frame(AVCodecContext *avctx,
     return p->result;
 }
 
+/**
+ * Copies a picture to an encoding thread and starts encoding it.
+ * The thread must be idle.
+ */
+static int submit_frame(PerThreadContext *p, const AVFrame *pict, int buf_size)
+{
+    AVCodecContext *avctx = p->avctx;
+    AVFrame *frame = &p->frame;
+
+    pthread_mutex_lock(&p->mutex);
+
+    av_fast_malloc(&p->avpkt.data, &p->allocated_buf_size, buf_size);
+    if (!p->avpkt.data) {
+        pthread_mutex_unlock(&p->mutex);
+        return AVERROR(ENOMEM);
+    }
+    p->avpkt.size = buf_size;
+
+    av_picture_copy((AVPicture*)frame, (const AVPicture*)pict,
+                    avctx->pix_fmt, avctx->width, avctx->height);
+    frame->pts              = pict->pts;
+    frame->quality          = pict->quality;
+    frame->pict_type        = pict->pict_type;
+    frame->key_frame        = pict->key_frame;
+    frame->interlaced_frame = pict->interlaced_frame;
+    frame->top_field_first  = pict->top_field_first;
+    frame->opaque           = pict->opaque;
+    frame->reordered_opaque = pict->reordered_opaque;
+
+    p->got_frame = 1;
+    p->state     = STATE_SETTING_UP;
+    pthread_cond_signal(&p->input_cond);
+    pthread_mutex_unlock(&p->mutex);
+
+    return 0;
+}
+
+int ff_thread_encode_video(AVCodecContext *avctx, uint8_t *buf, int buf_size,
+                           const AVFrame *pict)
+{
+    FrameThreadContext *fctx = avctx->thread_opaque;
+    PerThreadContext *p;
+    int err;
+
+    /*
+     * Submit the picture to the next encoding thread.
+     */
+
+    if (pict) {
+        p = &fctx->threads[fctx->next_decoding];
+        p->avctx->frame_number = avctx->frame_number;
+        err = submit_frame(p, pict, buf_size);
+        if (err) return err;
+
+        fctx->next_decoding++;
+        if (fctx->next_decoding >= avctx->thread_count) fctx->next_decoding = 0;
+
+        /*
+         * If we're still receiving the initial pictures, don't return a packet.
+         */
+
+        if (fctx->delaying) {
+            if (fctx->next_decoding >= avctx->thread_count-1) fctx->delaying = 0;
+            return 0;
+        }
+    }
+
+    /*
+     * Return the packet of the oldest picture. At the end of the stream,
+     * skip the pictures which did not produce any data, a return value
+     * of 0 would end the flushing.
+     */
+
+    do {
+        p = &fctx->threads[fctx->next_finished];
+        if (!p->got_frame)
+            return 0;
+
+        if (p->state != STATE_INPUT_READY) {
+            pthread_mutex_lock(&p->progress_mutex);
+            while (p->state != STATE_INPUT_READY)
+                pthread_cond_wait(&p->output_cond, &p->progress_mutex);
+            pthread_mutex_unlock(&p->progress_mutex);
+        }
+
+        p->got_frame = 0;
+        fctx->next_finished++;
+        if (fctx->next_finished >= avctx->thread_count) fctx->next_finished = 0;
+    } while (!pict && !p->result);
+
+    avctx->coded_frame = p->avctx->coded_frame;
+
+    if (p->result > buf_size) {
+        av_log(avctx, AV_LOG_ERROR, "encoded frame too large for the output buffer\n");
+        return -1;
+    }
+    if (p->result > 0)
+        memcpy(buf, p->avpkt.data, p->result);
+
+    return p->result;
+}
+
 void ff_thread_report_progress(AVFrame *f, int n, int field)
 {
     PerThreadContext *p;
@@ -643,6 +703,15 @@ static void frame_thread_free(AVCodecContext *avctx, int thread_count)
         pthread_mutex_unlock(&p->mutex);
 
         pthread_join(p->thread, NULL);
+    }
+
+    /* A thread may hold back buffers owned by another thread's context,
+     * so release them all before any context frees its buffers. */
+    for (i = 0; i < thread_count; i++)
+        release_delayed_buffers(&fctx->threads[i]);
+
+    for (i = 0; i < thread_count; i++) {
+        PerThreadContext *p = &fctx->threads[i];
 
         if (codec->close)
             codec->close(p->avctx);
@@ -664,12 +733,17 @@ static void frame_thread_free(AVCodecContext *avctx, int thread_count)
         pthread_cond_destroy(&p->output_cond);
         av_freep(&p->avpkt.data);
 
-        if (i)
+        if (i || codec->encode)
             av_freep(&p->avctx->priv_data);
+        if (codec->encode)
+            avpicture_free((AVPicture*)&p->frame);
 
         av_freep(&p->avctx);
     }
 
+    if (codec->encode)
+        av_freep(&avctx->extradata);
+
     av_freep(&fctx->threads);
     pthread_mutex_destroy(&fctx->buffer_mutex);
     av_freep(&avctx->thread_opaque);
@@ -735,6 +809,124 @@ error:
     return err;
 }
 
+/**
+ * Opens one encoder per thread.
+ *
+ * Every encoder gets its own copy of the user context and private data,
+ * so it must not depend on the previously encoded frames.
+ */
+static int frame_thread_encoder_init(AVCodecContext *avctx)
+{
+    int thread_count = avctx->thread_count;
+    AVCodec *codec = avctx->codec;
+    FrameThreadContext *fctx;
+    PerThreadContext *p;
+    int i, w, h, opened = 0, err = 0;
+
+    avctx->thread_opaque = fctx = av_mallocz(sizeof(FrameThreadContext));
+    if (!fctx)
+        return AVERROR(ENOMEM);
+
+    fctx->threads = av_mallocz(sizeof(PerThreadContext) * thread_count);
+    if (!fctx->threads) {
+        av_freep(&avctx->thread_opaque);
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&fctx->buffer_mutex, NULL);
+    fctx->delaying = 1;
+
+    for (i = 0; i < thread_count; i++) {
+        AVCodecContext *copy;
+
+        p = &fctx->threads[i];
+        opened = 0;
+
+        pthread_mutex_init(&p->mutex, NULL);
+        pthread_mutex_init(&p->progress_mutex, NULL);
+        pthread_cond_init(&p->input_cond, NULL);
+        pthread_cond_init(&p->progress_cond, NULL);
+        pthread_cond_init(&p->output_cond, NULL);
+
+        p->parent = fctx;
+        p->avctx  = copy = av_malloc(sizeof(AVCodecContext));
+        if (!copy) {
+            err = AVERROR(ENOMEM);
+            goto error;
+        }
+
+        *copy = *avctx;
+        copy->thread_opaque      = p;
+        copy->thread_count       = 1;
+        copy->active_thread_type = 0;
+        copy->extradata          = NULL;
+        copy->extradata_size     = 0;
+        copy->priv_data = av_malloc(codec->priv_data_size);
+        if (!copy->priv_data) {
+            err = AVERROR(ENOMEM);
+            goto error;
+        }
+        memcpy(copy->priv_data, avctx->priv_data, codec->priv_data_size);
+
+        /* the encoders may read past the visible picture */
+        w = avctx->width;
+        h = avctx->height;
+        avcodec_align_dimensions(copy, &w, &h);
+        avcodec_get_frame_defaults(&p->frame);
+        if (avpicture_alloc((AVPicture*)&p->frame, avctx->pix_fmt, w, h) < 0) {
+            err = AVERROR(ENOMEM);
+            goto error;
+        }
+        memset(p->frame.data[0], 0, avpicture_get_size(avctx->pix_fmt, w, h));
+
+        if (codec->init)
+            err = codec->init(copy);
+        if (err) goto error;
+        opened = 1;
+
+        if (!i) {
+            avctx->coded_frame           = copy->coded_frame;
+            avctx->bits_per_coded_sample = copy->bits_per_coded_sample;
+            if (copy->extradata_size) {
+                avctx->extradata = av_mallocz(copy->extradata_size + FF_INPUT_BUFFER_PADDING_SIZE);
+                if (!avctx->extradata) {
+                    err = AVERROR(ENOMEM);
+                    goto error;
+                }
+                memcpy(avctx->extradata, copy->extradata, copy->extradata_size);
+                avctx->extradata_size = copy->extradata_size;
+            }
+        }
+
+        err = pthread_create(&p->thread, NULL, frame_encoder_thread, p);
+        if (err) {
+            err = AVERROR(err);
+            goto error;
+        }
+    }
+
+    return 0;
+
+error:
+    /* undo the setup of the thread that failed, then stop the running ones */
+    if (p->avctx) {
+        if (opened && codec->close)
+            codec->close(p->avctx);
+        avcodec_default_free_buffers(p->avctx);
+        av_freep(&p->avctx->priv_data);
+        av_freep(&p->avctx);
+    }
+    avpicture_free((AVPicture*)&p->frame);
+    pthread_mutex_destroy(&p->mutex);
+    pthread_mutex_destroy(&p->progress_mutex);
+    pthread_cond_destroy(&p->input_cond);
+    pthread_cond_destroy(&p->progress_cond);
+    pthread_cond_destroy(&p->output_cond);
+
+    frame_thread_free(avctx, i);
+
+    return err;
+}
+
 void ff_thread_flush(AVCodecContext *avctx)
 {
     FrameThreadContext *fctx = avctx->thread_opaque;
@@ -849,6 +1041,12 @@ void ff_thread_release_buffer(AVCodecContext *avctx, AVFrame *f)
 
     p->released_buffers[p->num_released_buffers++] = *f;
     memset(f->data, 0, sizeof(f->data));
+
+    /* Once the threads are stopped, nothing can be using the frame anymore.
+     * Release it now, as close() may free the buffers of its context
+     * right after releasing its frames. */
+    if (p->parent->die)
+        release_delayed_buffers(p);
 }
 
 /**
@@ -865,7 +1063,8 @@ static void validate_thread_parameters(AVCodecContext *avctx)
     int frame_threading_supported = (avctx->codec->capabilities & CODEC_CAP_FRAME_THREADS)
                                 && !(avctx->flags & CODEC_FLAG_TRUNCATED)
                                 && !(avctx->flags & CODEC_FLAG_LOW_DELAY)
-                                && !(avctx->flags2 & CODEC_FLAG2_CHUNKS);
+                                && !(avctx->flags2 & CODEC_FLAG2_CHUNKS)
+                                && !(avctx->flags & (CODEC_FLAG_PASS1|CODEC_FLAG_PASS2));
     if (avctx->thread_count == 1) {
         avctx->active_thread_type = 0;
     } else if (frame_threading_supported && (avctx->thread_type & FF_THREAD_FRAME)) {
@@ -875,6 +1074,18 @@ static void validate_thread_parameters(AVCodecContext *avctx)
     }
 }
 
+static int get_logical_cpus(AVCodecContext *avctx)
+{
+    int nb_cpus = 1;
+
+#if HAVE_SYSCONF && defined(_SC_NPROCESSORS_ONLN)
+    nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    av_log(avctx, AV_LOG_DEBUG, "detected %d logical cores\n", nb_cpus);
+
+    return FFMAX(1, nb_cpus);
+}
+
 int ff_thread_init(AVCodecContext *avctx, int thread_count)
 {
     if (avctx->thread_opaque) {
@@ -882,6 +1093,9 @@ int ff_thread_init(AVCodecContext *avctx, int thread_count)
         return -1;
     }
 
+    if (!thread_count)
+        thread_count = FFMIN(get_logical_cpus(avctx), MAX_AUTO_THREADS);
+
     avctx->thread_count = FFMAX(1, thread_count);
 
     if (avctx->codec) {
@@ -890,7 +1104,8 @@ int ff_thread_init(AVCodecContext *avctx, int thread_count)
         if (avctx->active_thread_type&FF_THREAD_SLICE)
             return thread_init(avctx);
         else if (avctx->active_thread_type&FF_THREAD_FRAME)
-            return frame_thread_init(avctx);
+            return avctx->codec->encode ? frame_thread_encoder_init(avctx)
+                                        : frame_thread_init(avctx);
     }
 
     return 0;
@@ -48,6 +48,17 @@ void ff_thread_flush(AVCodecContext *avctx);
 int ff_thread_decode_frame(AVCodecContext *avctx, AVFrame *picture,
                            int *got_picture_ptr, AVPacket *avpkt);
 
+/**
+ * Submits a picture to an encoding thread.
+ * Returns the packet of the oldest picture in buf once every thread
+ * has received one, and 0 before that.
+ * When pict is NULL, the pending packets are returned in order.
+ *
+ * Parameters are the same as avcodec_encode_video().
+ */
+int ff_thread_encode_video(AVCodecContext *avctx, uint8_t *buf, int buf_size,
+                           const AVFrame *pict);
+
 /**
  * If the codec defines update_thread_context(), call this
  * when they are ready for the next thread to start decoding
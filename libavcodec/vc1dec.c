@@ -38,6 +38,7 @@
 #include "simple_idct.h"
 #include "mathops.h"
 #include "vdpau_internal.h"
+#include "thread.h"
 
 #undef NDEBUG
 #include <assert.h>
@@ -187,6 +188,32 @@ static void vc1_loop_filter_iblk(VC1Context *v, int pq)
     }
 }
 
+/** Wait until a reference picture is decoded down to the given luma line
+ * @param ref reference picture decoded by another frame thread
+ * @param y last luma line read by the motion compensation
+ */
+static av_always_inline void vc1_await_ref_line(VC1Context *v, Picture *ref, int y)
+{
+    MpegEncContext *s = &v->s;
+
+    if (HAVE_THREADS && s->avctx->active_thread_type&FF_THREAD_FRAME)
+        ff_thread_await_progress((AVFrame*)ref, av_clip(y >> 4, 0, s->mb_height - 1), 0);
+}
+
+/** Report the decoded rows of the current picture to the other frame threads
+ * The overlap smoothing and the loop filter of a macroblock row change
+ * the bottom lines of the row above, so only the rows above the current
+ * one are final.
+ */
+static void vc1_report_row(VC1Context *v)
+{
+    MpegEncContext *s = &v->s;
+
+    if (HAVE_THREADS && s->avctx->active_thread_type&FF_THREAD_FRAME
+       && s->current_picture.reference)
+        ff_thread_report_progress((AVFrame*)s->current_picture_ptr, s->mb_y - 1, 0);
+}
+
 /** Do motion compensation over 1 macroblock
  * Mostly adapted hpel_motion and qpel_motion from mpegvideo.c
  */
@@ -240,6 +267,9 @@ static void vc1_mc_1mv(VC1Context *v, int dir)
         uvsrc_y = av_clip(uvsrc_y,  -8, s->avctx->coded_height >> 1);
     }
 
+    vc1_await_ref_line(v, dir ? s->next_picture_ptr : s->last_picture_ptr,
+                       FFMAX(src_y, 2 * uvsrc_y) + 17);
+
     srcY += src_y * s->linesize + src_x;
     srcU += uvsrc_y * s->uvlinesize + uvsrc_x;
     srcV += uvsrc_y * s->uvlinesize + uvsrc_x;
@@ -365,6 +395,8 @@ static void vc1_mc_4mv_luma(VC1Context *v, int n)
         src_y   = av_clip(  src_y, -18, s->avctx->coded_height + 1);
     }
 
+    vc1_await_ref_line(v, s->last_picture_ptr, src_y + 9);
+
     srcY += src_y * s->linesize + src_x;
 
     if(v->rangeredfrm || (v->mv_mode == MV_PMODE_INTENSITY_COMP)
@@ -500,6 +532,8 @@ static void vc1_mc_4mv_chroma(VC1Context *v)
         uvsrc_y = av_clip(uvsrc_y,  -8, s->avctx->coded_height >> 1);
     }
 
+    vc1_await_ref_line(v, s->last_picture_ptr, 2 * uvsrc_y + 17);
+
     srcU = s->last_picture.data[1] + uvsrc_y * s->uvlinesize + uvsrc_x;
     srcV = s->last_picture.data[2] + uvsrc_y * s->uvlinesize + uvsrc_x;
     if(v->rangeredfrm || (v->mv_mode == MV_PMODE_INTENSITY_COMP)
@@ -824,6 +858,8 @@ static void vc1_interp_mc(VC1Context *v)
         uvsrc_y = av_clip(uvsrc_y,  -8, s->avctx->coded_height >> 1);
     }
 
+    vc1_await_ref_line(v, s->next_picture_ptr, FFMAX(src_y, 2 * uvsrc_y) + 17);
+
     srcY += src_y * s->linesize + src_x;
     srcU += uvsrc_y * s->uvlinesize + uvsrc_x;
     srcV += uvsrc_y * s->uvlinesize + uvsrc_x;
@@ -2676,6 +2712,7 @@ static void vc1_decode_i_blocks(VC1Context *v)
             ff_draw_horiz_band(s, s->mb_y * 16, 16);
         else if (s->mb_y)
             ff_draw_horiz_band(s, (s->mb_y-1) * 16, 16);
+        vc1_report_row(v);
 
         s->first_slice_line = 0;
     }
@@ -2824,6 +2861,7 @@ static void vc1_decode_i_blocks_adv(VC1Context *v)
             ff_draw_horiz_band(s, s->mb_y * 16, 16);
         else if (s->mb_y)
             ff_draw_horiz_band(s, (s->mb_y-1) * 16, 16);
+        vc1_report_row(v);
         s->first_slice_line = 0;
     }
     if (v->s.loop_filter)
@@ -2877,6 +2915,7 @@ static void vc1_decode_p_blocks(VC1Context *v)
         }
         memmove(v->cbp_base, v->cbp, sizeof(v->cbp_base[0])*s->mb_stride);
         ff_draw_horiz_band(s, s->mb_y * 16, 16);
+        vc1_report_row(v);
         s->first_slice_line = 0;
     }
     ff_er_add_slice(s, 0, 0, s->mb_width - 1, s->mb_height - 1, (AC_END|DC_END|MV_END));
@@ -2915,6 +2954,8 @@ static void vc1_decode_b_blocks(VC1Context *v)
     for(s->mb_y = 0; s->mb_y < s->mb_height; s->mb_y++) {
         s->mb_x = 0;
         ff_init_block_index(s);
+        /* the MV prediction reads the co-located motion vectors */
+        vc1_await_ref_line(v, s->next_picture_ptr, s->mb_y * 16 + 15);
         for(; s->mb_x < s->mb_width; s->mb_x++) {
             ff_update_block_index(s);
 
@@ -2947,10 +2988,12 @@ static void vc1_decode_skip_blocks(VC1Context *v)
         s->mb_x = 0;
         ff_init_block_index(s);
         ff_update_block_index(s);
+        vc1_await_ref_line(v, s->last_picture_ptr, s->mb_y * 16 + 15);
         memcpy(s->dest[0], s->last_picture.data[0] + s->mb_y * 16 * s->linesize, s->linesize * 16);
         memcpy(s->dest[1], s->last_picture.data[1] + s->mb_y * 8 * s->uvlinesize, s->uvlinesize * 8);
         memcpy(s->dest[2], s->last_picture.data[2] + s->mb_y * 8 * s->uvlinesize, s->uvlinesize * 8);
         ff_draw_horiz_band(s, s->mb_y * 16, 16);
+        vc1_report_row(v);
         s->first_slice_line = 0;
     }
     s->pict_type = FF_P_TYPE;
@@ -2990,6 +3033,36 @@ static void vc1_decode_blocks(VC1Context *v)
     }
 }
 
+/** Allocate the macroblock bitplanes and block info of a VC1Context
+ * @param v The VC1Context, its MpegEncContext must be initialized
+ * @return Status
+ */
+static av_cold int vc1_alloc_tables(VC1Context *v)
+{
+    MpegEncContext *s = &v->s;
+
+    /* Allocate mb bitplanes */
+    v->mv_type_mb_plane = av_malloc(s->mb_stride * s->mb_height);
+    v->direct_mb_plane = av_malloc(s->mb_stride * s->mb_height);
+    v->acpred_plane = av_malloc(s->mb_stride * s->mb_height);
+    v->over_flags_plane = av_malloc(s->mb_stride * s->mb_height);
+
+    v->cbp_base = av_malloc(sizeof(v->cbp_base[0]) * 2 * s->mb_stride);
+    v->cbp = v->cbp_base + s->mb_stride;
+
+    /* allocate block type info in that way so it could be used with s->block_index[] */
+    v->mb_type_base = av_malloc(s->b8_stride * (s->mb_height * 2 + 1) + s->mb_stride * (s->mb_height + 1) * 2);
+    v->mb_type[0] = v->mb_type_base + s->b8_stride + 1;
+    v->mb_type[1] = v->mb_type_base + s->b8_stride * (s->mb_height * 2 + 1) + s->mb_stride + 1;
+    v->mb_type[2] = v->mb_type[1] + s->mb_stride * (s->mb_height + 1);
+
+    if (!v->mv_type_mb_plane || !v->direct_mb_plane || !v->acpred_plane ||
+        !v->over_flags_plane || !v->cbp_base || !v->mb_type_base)
+        return -1;
+
+    return 0;
+}
+
 /** Initialize a VC1/WMV3 decoder
  * @todo TODO: Handle VC-1 IDUs (Transport level?)
  * @todo TODO: Decypher remaining bits in extra_data
@@ -3104,20 +3177,8 @@ static av_cold int vc1_decode_init(AVCodecContext *avctx)
     s->mb_width = (avctx->coded_width+15)>>4;
     s->mb_height = (avctx->coded_height+15)>>4;
 
-    /* Allocate mb bitplanes */
-    v->mv_type_mb_plane = av_malloc(s->mb_stride * s->mb_height);
-    v->direct_mb_plane = av_malloc(s->mb_stride * s->mb_height);
-    v->acpred_plane = av_malloc(s->mb_stride * s->mb_height);
-    v->over_flags_plane = av_malloc(s->mb_stride * s->mb_height);
-
-    v->cbp_base = av_malloc(sizeof(v->cbp_base[0]) * 2 * s->mb_stride);
-    v->cbp = v->cbp_base + s->mb_stride;
-
-    /* allocate block type info in that way so it could be used with s->block_index[] */
-    v->mb_type_base = av_malloc(s->b8_stride * (s->mb_height * 2 + 1) + s->mb_stride * (s->mb_height + 1) * 2);
-    v->mb_type[0] = v->mb_type_base + s->b8_stride + 1;
-    v->mb_type[1] = v->mb_type_base + s->b8_stride * (s->mb_height * 2 + 1) + s->mb_stride + 1;
-    v->mb_type[2] = v->mb_type[1] + s->mb_stride * (s->mb_height + 1);
+    if (vc1_alloc_tables(v) < 0)
+        return -1;
 
     /* Init coded blocks info */
     if (v->profile == PROFILE_ADVANCED)
@@ -3132,6 +3193,66 @@ static av_cold int vc1_decode_init(AVCodecContext *avctx)
     return 0;
 }
 
+static av_cold int vc1_decode_init_thread_copy(AVCodecContext *avctx)
+{
+    VC1Context *v = avctx->priv_data;
+
+    if (!avctx->is_copy) return 0;
+
+    /* the context was copied from the first thread, it gets its own tables
+     * in vc1_update_thread_context() once that thread decoded a frame */
+    memset(&v->s,  0, sizeof(v->s));
+    memset(&v->x8, 0, sizeof(v->x8));
+    v->s.avctx = avctx;
+
+    v->mv_type_mb_plane = NULL;
+    v->direct_mb_plane  = NULL;
+    v->acpred_plane     = NULL;
+    v->over_flags_plane = NULL;
+    v->mb_type_base     = NULL;
+    v->cbp_base         = NULL;
+
+    return 0;
+}
+
+#define copy_fields(to, from, start_field, end_field) memcpy(&to->start_field, &from->start_field, (char*)&to->end_field - (char*)&to->start_field)
+static int vc1_update_thread_context(AVCodecContext *dst, const AVCodecContext *src)
+{
+    VC1Context *v = dst->priv_data, *v1 = src->priv_data;
+    MpegEncContext *s = &v->s;
+    int inited = s->context_initialized, err;
+
+    if (dst == src || !v1->s.context_initialized) return 0;
+
+    err = ff_mpeg_update_thread_context(dst, src);
+    if (err) return err;
+
+    if (!inited) {
+        if (vc1_alloc_tables(v) < 0)
+            return AVERROR(ENOMEM);
+        ff_intrax8_common_init(&v->x8, s);
+    }
+
+    //sequence and entry point headers
+    copy_fields(v, v1, res_sprite, mv_mode);
+    v->zz_8x4                 = v1->zz_8x4;
+    v->zz_4x8                 = v1->zz_4x8;
+    copy_fields(v, v1, hrd_num_leaky_buckets, acpred_plane);
+    copy_fields(v, v1, range_mapy_flag, p_frame_skipped);
+    v->broken_link            = v1->broken_link;
+    v->closed_entry           = v1->closed_entry;
+    s->loop_filter            = v1->s.loop_filter;
+    s->resync_marker          = v1->s.resync_marker;
+
+    //state carried from the previous frame header: rounding control of
+    //simple/main P-frames and intensity compensation reused by B-frames
+    v->rnd                    = v1->rnd;
+    v->use_ic                 = v1->use_ic;
+    memcpy(v->luty,  v1->luty,  sizeof(v->luty));
+    memcpy(v->lutuv, v1->lutuv, sizeof(v->lutuv));
+
+    return 0;
+}
 
 /** Decode a VC1/WMV3 frame
  * @todo TODO: Handle VC-1 IDUs (Transport level?)
@@ -3284,6 +3405,8 @@ static int vc1_decode_frame(AVCodecContext *avctx,
     s->me.qpel_put= s->dsp.put_qpel_pixels_tab;
     s->me.qpel_avg= s->dsp.avg_qpel_pixels_tab;
 
+    ff_thread_finish_setup(avctx);
+
     if ((CONFIG_VC1_VDPAU_DECODER)
         &&s->avctx->codec->capabilities&CODEC_CAP_HWACCEL_VDPAU)
         ff_vdpau_vc1_decode_picture(s, buf_start, (buf + buf_size) - buf_start);
@@ -3302,6 +3425,9 @@ static int vc1_decode_frame(AVCodecContext *avctx,
 //av_log(s->avctx, AV_LOG_INFO, "Consumed %i/%i bits\n", get_bits_count(&s->gb), buf_size*8);
 //  if(get_bits_count(&s->gb) > buf_size * 8)
 //      return -1;
+        /* s->mspel selects the WMV2 motion compensation in MPV_decode_mb(),
+         * the concealment has to use the generic one */
+        s->mspel = 0;
         ff_er_frame_end(s);
     }
 
@@ -3355,10 +3481,12 @@ AVCodec ff_vc1_decoder = {
     NULL,
     vc1_decode_end,
     vc1_decode_frame,
-    CODEC_CAP_DR1 | CODEC_CAP_DELAY,
+    CODEC_CAP_DR1 | CODEC_CAP_DELAY | CODEC_CAP_FRAME_THREADS,
     NULL,
     .long_name = NULL_IF_CONFIG_SMALL("SMPTE VC-1"),
-    .pix_fmts = ff_hwaccel_pixfmt_list_420
+    .pix_fmts = ff_hwaccel_pixfmt_list_420,
+    .init_thread_copy      = ONLY_IF_THREADS_ENABLED(vc1_decode_init_thread_copy),
+    .update_thread_context = ONLY_IF_THREADS_ENABLED(vc1_update_thread_context)
 };
 
 #if CONFIG_WMV3_DECODER
@@ -3371,10 +3499,12 @@ AVCodec ff_wmv3_decoder = {
     NULL,
     vc1_decode_end,
     vc1_decode_frame,
-    CODEC_CAP_DR1 | CODEC_CAP_DELAY,
+    CODEC_CAP_DR1 | CODEC_CAP_DELAY | CODEC_CAP_FRAME_THREADS,
     NULL,
     .long_name = NULL_IF_CONFIG_SMALL("Windows Media Video 9"),
-    .pix_fmts = ff_hwaccel_pixfmt_list_420
+    .pix_fmts = ff_hwaccel_pixfmt_list_420,
+    .init_thread_copy      = ONLY_IF_THREADS_ENABLED(vc1_decode_init_thread_copy),
+    .update_thread_context = ONLY_IF_THREADS_ENABLED(vc1_update_thread_context)
 };
 #endif
 
@@ -89,8 +89,9 @@ typedef struct {
     VP8DSPContext vp8dsp;
     H264PredContext hpc;
     vp8_mc_func put_pixels_tab[3][3][3];
-    AVFrame frames[4];
+    AVFrame frames[5];
     AVFrame *framep[4];
+    AVFrame *next_framep[4];
     uint8_t *edge_emu_buffer;
     VP56RangeCoder c;   ///< header context, includes mb modes and motion vectors
     int profile;
@@ -126,7 +127,19 @@ typedef struct {
 
     uint8_t *intra4x4_pred_mode_top;
     uint8_t intra4x4_pred_mode_left[4];
-    uint8_t *segmentation_map;
+
+    /**
+     * Segmentation map of each entry in frames[]. The map persists between
+     * frames, so each frame keeps its own copy for the frame decoded after it.
+     */
+    uint8_t *segmentation_maps[5];
+
+    /**
+     * Maps of released frames, which another thread may still be reading.
+     * They are freed at the start of the next decode call.
+     */
+    uint8_t *released_segmentation_maps[5];
+    int num_released_segmentation_maps;
 
     /**
      * Cache of the top row needed for intra prediction
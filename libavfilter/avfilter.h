@@ -26,7 +26,7 @@
 #include "libavutil/samplefmt.h"
 
 #define LIBAVFILTER_VERSION_MAJOR  1
-#define LIBAVFILTER_VERSION_MINOR 76
+#define LIBAVFILTER_VERSION_MINOR 77
 #define LIBAVFILTER_VERSION_MICRO  0
 
 #define LIBAVFILTER_VERSION_INT AV_VERSION_INT(LIBAVFILTER_VERSION_MAJOR, \
@@ -58,6 +58,27 @@ const char *avfilter_license(void);
 typedef struct AVFilterContext AVFilterContext;
 typedef struct AVFilterLink    AVFilterLink;
 typedef struct AVFilterPad     AVFilterPad;
+typedef struct AVFilterPool    AVFilterPool;
+
+/**
+ * Function run by AVFilterContext.execute() for each job.
+ *
+ * @param jobnr   index of the job, from 0 to nb_jobs - 1
+ * @param nb_jobs total number of jobs
+ * @return the value stored in the ret array passed to execute()
+ */
+typedef int (avfilter_action_func)(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs);
+
+/**
+ * Run func once for each of the nb_jobs jobs, possibly in parallel.
+ * It returns only when all the jobs are done.
+ *
+ * @param ret array of nb_jobs entries receiving the return values of func,
+ *            may be NULL
+ * @return 0
+ */
+typedef int (avfilter_execute_func)(AVFilterContext *ctx, avfilter_action_func *func,
+                                    void *arg, int *ret, int nb_jobs);
 
 /**
  * A reference-counted buffer data type used by the filter system. Filters
@@ -472,6 +493,10 @@ void avfilter_set_common_formats(AVFilterContext *ctx, AVFilterFormats *formats)
 /** Default handler for query_formats() */
 int avfilter_default_query_formats(AVFilterContext *ctx);
 
+/** default handler for AVFilterContext.execute(), runs the jobs one after another */
+int avfilter_default_execute(AVFilterContext *ctx, avfilter_action_func *func,
+                             void *arg, int *ret, int nb_jobs);
+
 /** start_frame() handler for filters which simply pass video along */
 void avfilter_null_start_frame(AVFilterLink *link, AVFilterBufferRef *picref);
 
@@ -554,6 +579,16 @@ struct AVFilterContext {
     AVFilterLink **outputs;         ///< array of pointers to output links
 
     void *priv;                     ///< private data for use by the filter
+
+    struct AVFilterGraph *graph;    ///< filter graph this filter belongs to, NULL if none
+
+    /**
+     * Run a function on a number of jobs, in parallel when the filter
+     * graph has a thread pool. Filters whose rows can be processed
+     * independently use it to split their work in horizontal slices.
+     * Set by avfilter_open() and avfilter_graph_config().
+     */
+    avfilter_execute_func *execute;
 };
 
 /**
@@ -617,6 +652,13 @@ struct AVFilterLink {
      * input link is assumed to be an unchangeable property.
      */
     AVRational time_base;
+
+    /**
+     * Pool of the video buffers allocated by
+     * avfilter_default_get_video_buffer() for this link, which are
+     * recycled when their last reference is released.
+     */
+    AVFilterPool *pool;
 };
 
 /**
@@ -23,6 +23,7 @@
 #include <ctype.h>
 #include <string.h>
 
+#include "config.h"
 #include "avfilter.h"
 #include "avfiltergraph.h"
 #include "internal.h"
@@ -38,6 +39,9 @@ void avfilter_graph_free(AVFilterGraph **graph)
         return;
     for (; (*graph)->filter_count > 0; (*graph)->filter_count--)
         avfilter_free((*graph)->filters[(*graph)->filter_count - 1]);
+#if HAVE_PTHREADS
+    ff_avfilter_graph_thread_free(*graph);
+#endif
     av_freep(&(*graph)->scale_sws_opts);
     av_freep(&(*graph)->filters);
     av_freep(graph);
@@ -52,10 +56,18 @@ int avfilter_graph_add_filter(AVFilterGraph *graph, AVFilterContext *filter)
 
     graph->filters = filters;
     graph->filters[graph->filter_count++] = filter;
+    filter->graph = graph;
 
     return 0;
 }
 
+int ff_avfilter_thread_count(AVFilterContext *ctx)
+{
+    if (!ctx->graph || !ctx->graph->thread_opaque)
+        return 1;
+    return ctx->graph->thread_count;
+}
+
 int avfilter_graph_create_filter(AVFilterContext **filt_ctx, AVFilter *filt,
                                  const char *name, const char *args, void *opaque,
                                  AVFilterGraph *graph_ctx)
@@ -235,6 +247,12 @@ int avfilter_graph_config(AVFilterGraph *graphctx, AVClass *log_ctx)
         return ret;
     if ((ret = ff_avfilter_graph_config_formats(graphctx, log_ctx)))
         return ret;
+#if HAVE_PTHREADS
+    /* started before configuring the links, so that the filters know how
+     * many jobs to allocate their slice contexts for */
+    if ((ret = ff_avfilter_graph_thread_init(graphctx)) < 0)
+        return ret;
+#endif
     if ((ret = ff_avfilter_graph_config_links(graphctx, log_ctx)))
         return ret;
 
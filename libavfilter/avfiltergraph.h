@@ -29,6 +29,15 @@ typedef struct AVFilterGraph {
     AVFilterContext **filters;
 
     char *scale_sws_opts; ///< sws options to use for the auto-inserted scale filters
+
+    /**
+     * Maximum number of threads used by the filters of the graph.
+     * 0 or 1 disables threading.
+     * Must be set before avfilter_graph_config().
+     */
+    int thread_count;
+
+    void *thread_opaque;  ///< private data of the graph thread pool
 } AVFilterGraph;
 
 /**
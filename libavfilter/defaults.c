@@ -19,31 +19,171 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include "config.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #include "libavutil/audioconvert.h"
 #include "libavutil/imgutils.h"
 #include "libavutil/samplefmt.h"
 #include "avfilter.h"
 #include "internal.h"
 
-/* TODO: buffer pool.  see comment for avfilter_default_get_video_buffer() */
 void ff_avfilter_default_free_buffer(AVFilterBuffer *ptr)
 {
     av_free(ptr->data[0]);
     av_free(ptr);
 }
 
-/* TODO: set the buffer's priv member to a context structure for the whole
- * filter chain.  This will allow for a buffer pool instead of the constant
- * alloc & free cycle currently implemented. */
+/** maximum number of unused buffers kept by a link buffer pool */
+#define POOL_SIZE 32
+
+/**
+ * maximum number of bytes held by the unused buffers of a link buffer
+ * pool, so that large pictures do not pin POOL_SIZE frames of memory
+ */
+#define POOL_MAX_BYTES (64 << 20)
+
+/**
+ * Pool of the video buffers allocated for a link, so that the pictures
+ * can be recycled instead of being allocated and freed for every frame.
+ * Buffers may be released from another thread than the one getting
+ * them, e.g. by the encoding threads of the application, so the pool is
+ * protected by a mutex.
+ */
+struct AVFilterPool {
+    AVFilterBuffer *pic[POOL_SIZE]; ///< unused buffers, oldest first
+    int count;                      ///< number of unused buffers in pic
+    int64_t size;                   ///< number of bytes held by the unused buffers
+    int refcount;                   ///< number of buffers of the pool still referenced
+    int draining;                   ///< set when the link is freed, the pool goes with its last buffer
+#if HAVE_PTHREADS
+    pthread_mutex_t mutex;
+#endif
+};
+
+static void lock_pool(AVFilterPool *pool)
+{
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&pool->mutex);
+#endif
+}
+
+static void unlock_pool(AVFilterPool *pool)
+{
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&pool->mutex);
+#endif
+}
+
+static void free_pool(AVFilterPool *pool)
+{
+#if HAVE_PTHREADS
+    pthread_mutex_destroy(&pool->mutex);
+#endif
+    av_free(pool);
+}
+
+static int pool_buffer_size(AVFilterBuffer *pic)
+{
+    uint8_t *data[4];
+
+    return av_image_fill_pointers(data, pic->format, pic->h, NULL, pic->linesize);
+}
+
+/* drop the oldest unused buffer of pool, called with the pool locked */
+static void drop_oldest(AVFilterPool *pool)
+{
+    pool->size -= pool_buffer_size(pool->pic[0]);
+    ff_avfilter_default_free_buffer(pool->pic[0]);
+    memmove(pool->pic, pool->pic + 1, (pool->count - 1) * sizeof(*pool->pic));
+    pool->count--;
+}
+
+static void free_pool_buffer(AVFilterBuffer *pic)
+{
+    AVFilterPool *pool = pic->priv;
+    int size;
+
+    lock_pool(pool);
+    if (pool->draining) {
+        ff_avfilter_default_free_buffer(pic);
+        if (!--pool->refcount) {
+            unlock_pool(pool);
+            free_pool(pool);
+            return;
+        }
+        unlock_pool(pool);
+        return;
+    }
+
+    size = pool_buffer_size(pic);
+    while (pool->count &&
+           (pool->count == POOL_SIZE || pool->size + size > POOL_MAX_BYTES))
+        drop_oldest(pool);
+    pool->pic[pool->count++] = pic;
+    pool->size += size;
+    pool->refcount--;
+    unlock_pool(pool);
+}
+
+void ff_avfilter_free_pool(AVFilterPool *pool)
+{
+    if (!pool)
+        return;
+
+    lock_pool(pool);
+    while (pool->count)
+        drop_oldest(pool);
+    if (pool->refcount) {
+        pool->draining = 1;
+        unlock_pool(pool);
+    } else {
+        unlock_pool(pool);
+        free_pool(pool);
+    }
+}
+
 AVFilterBufferRef *avfilter_default_get_video_buffer(AVFilterLink *link, int perms, int w, int h)
 {
+    AVFilterPool *pool = link->pool;
+    AVFilterBuffer *pic = NULL;
     int linesize[4];
     uint8_t *data[4];
     AVFilterBufferRef *picref = NULL;
+    int i;
+
+    if (!pool) {
+        if (!(pool = link->pool = av_mallocz(sizeof(AVFilterPool))))
+            return NULL;
+#if HAVE_PTHREADS
+        pthread_mutex_init(&pool->mutex, NULL);
+#endif
+    }
 
-    // +2 is needed for swscaler, +16 to be SIMD-friendly
-    if (av_image_alloc(data, linesize, w, h, link->format, 16) < 0)
-        return NULL;
+    lock_pool(pool);
+    for (i = pool->count - 1; i >= 0; i--) {
+        if (pool->pic[i]->w == w && pool->pic[i]->h == h &&
+            pool->pic[i]->format == link->format) {
+            pic = pool->pic[i];
+            pool->size -= pool_buffer_size(pic);
+            memmove(pool->pic + i, pool->pic + i + 1, (pool->count - i - 1) * sizeof(*pool->pic));
+            pool->count--;
+            break;
+        }
+    }
+    unlock_pool(pool);
+
+    if (pic) {
+        memcpy(data,     pic->data,     sizeof(data));
+        memcpy(linesize, pic->linesize, sizeof(linesize));
+        av_free(pic);
+    } else {
+        // +2 is needed for swscaler, +16 to be SIMD-friendly
+        if (av_image_alloc(data, linesize, w, h, link->format, 16) < 0)
+            return NULL;
+    }
 
     picref = avfilter_get_video_buffer_ref_from_arrays(data, linesize,
                                                        perms, w, h, link->format);
@@ -51,6 +191,11 @@ AVFilterBufferRef *avfilter_default_get_video_buffer(AVFilterLink *link, int per
         av_free(data[0]);
         return NULL;
     }
+    picref->buf->priv = pool;
+    picref->buf->free = free_pool_buffer;
+    lock_pool(pool);
+    pool->refcount++;
+    unlock_pool(pool);
 
     return picref;
 }
@@ -265,6 +410,19 @@ int avfilter_default_query_formats(AVFilterContext *ctx)
     return 0;
 }
 
+int avfilter_default_execute(AVFilterContext *ctx, avfilter_action_func *func,
+                             void *arg, int *ret, int nb_jobs)
+{
+    int i;
+
+    for (i = 0; i < nb_jobs; i++) {
+        int r = func(ctx, arg, i, nb_jobs);
+        if (ret)
+            ret[i] = r;
+    }
+    return 0;
+}
+
 void avfilter_null_start_frame(AVFilterLink *link, AVFilterBufferRef *picref)
 {
     avfilter_start_frame(link->dst->outputs[0], picref);
@@ -52,4 +52,29 @@ int ff_avfilter_graph_config_formats(AVFilterGraph *graphctx, AVClass *log_ctx);
 /** default handler for freeing audio/video buffer when there are no references left */
 void ff_avfilter_default_free_buffer(AVFilterBuffer *buf);
 
+/**
+ * Detach a buffer pool from its link, freeing its unused buffers.
+ * The pool itself is freed once all its buffers are released.
+ */
+void ff_avfilter_free_pool(AVFilterPool *pool);
+
+/**
+ * Start the thread pool of graph, if graph->thread_count asks for one,
+ * and make the execute() callback of all its filters use it.
+ *
+ * @return 0 in case of success, a negative AVERROR code otherwise
+ */
+int ff_avfilter_graph_thread_init(AVFilterGraph *graph);
+
+/**
+ * Stop and free the thread pool of graph, if any.
+ */
+void ff_avfilter_graph_thread_free(AVFilterGraph *graph);
+
+/**
+ * Return the number of jobs a filter should split its work in when
+ * calling execute(), 1 if the filter is not part of a threaded graph.
+ */
+int ff_avfilter_thread_count(AVFilterContext *ctx);
+
 #endif  /* AVFILTER_INTERNAL_H */
@@ -0,0 +1,97 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Filter graph thread pool.
+ *
+ * One pool of graph->thread_count workers is shared by all the filters of
+ * a graph. The graph only runs one filter at a time, so the filters never
+ * compete for it; a filter hands it its work through its execute() callback
+ * and gets control back once all the jobs are done.
+ */
+
+#include "libavutil/threadpool.h"
+#include "avfilter.h"
+#include "avfiltergraph.h"
+#include "internal.h"
+
+typedef struct ThreadContext {
+    AVThreadPool *pool;
+    avfilter_action_func *func;
+    int nb_jobs;
+} ThreadContext;
+
+static int run_job(void *v, void *arg, int jobnr, int threadnr)
+{
+    AVFilterContext *ctx = v;
+    ThreadContext *c = ctx->graph->thread_opaque;
+
+    return c->func(ctx, arg, jobnr, c->nb_jobs);
+}
+
+static int thread_execute(AVFilterContext *ctx, avfilter_action_func *func,
+                          void *arg, int *ret, int nb_jobs)
+{
+    ThreadContext *c = ctx->graph->thread_opaque;
+
+    if (nb_jobs <= 1)
+        return avfilter_default_execute(ctx, func, arg, ret, nb_jobs);
+
+    c->func    = func;
+    c->nb_jobs = nb_jobs;
+    avpriv_thread_pool_execute(c->pool, run_job, ctx, arg, ret, nb_jobs);
+
+    return 0;
+}
+
+void ff_avfilter_graph_thread_free(AVFilterGraph *graph)
+{
+    ThreadContext *c = graph->thread_opaque;
+
+    if (!c)
+        return;
+
+    avpriv_thread_pool_free(&c->pool);
+    av_freep(&graph->thread_opaque);
+}
+
+int ff_avfilter_graph_thread_init(AVFilterGraph *graph)
+{
+    ThreadContext *c;
+    int i;
+
+    if (graph->thread_opaque || graph->thread_count <= 1)
+        return 0;
+
+    c = av_mallocz(sizeof(ThreadContext));
+    if (!c)
+        return AVERROR(ENOMEM);
+    c->pool = avpriv_thread_pool_create(graph->thread_count);
+    if (!c->pool) {
+        av_free(c);
+        graph->thread_count = 1;
+        return AVERROR(ENOMEM);
+    }
+    graph->thread_opaque = c;
+
+    for (i = 0; i < graph->filter_count; i++)
+        graph->filters[i]->execute = thread_execute;
+
+    return 0;
+}
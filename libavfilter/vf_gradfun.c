@@ -37,6 +37,7 @@
 #include "libavutil/pixdesc.h"
 #include "avfilter.h"
 #include "gradfun.h"
+#include "internal.h"
 
 DECLARE_ALIGNED(16, static const uint16_t, dither)[8][8] = {
     {0x00,0x60,0x18,0x78,0x06,0x66,0x1E,0x7E},
@@ -74,25 +75,41 @@ void ff_gradfun_blur_line_c(uint16_t *dc, uint16_t *buf, uint16_t *buf1, uint8_t
     }
 }
 
-static void filter(GradFunContext *ctx, uint8_t *dst, uint8_t *src, int width, int height, int dst_linesize, int src_linesize, int r)
+/**
+ * Deband the lines slice_start to slice_end - 1 of a plane.
+ *
+ * The vertical blur keeps running sums of 2x2 blocks in a ring of r lines.
+ * A slice starting below the top of the plane fills the ring with the r
+ * steps preceding the first one it needs. Only the differences between the
+ * sums are used, so this gives the same values as filtering the whole plane.
+ */
+static void filter(GradFunContext *ctx, uint16_t *tmpbuf, uint8_t *dst, uint8_t *src, int width, int height,
+                   int dst_linesize, int src_linesize, int r, int slice_start, int slice_end)
 {
     int bstride = FFALIGN(width, 16) / 2;
+    int last = r + ((height - 2 * r - 1) & ~1); ///< last line the blur is updated on
+    int step = av_clip(slice_start & ~1, r, last);
     int y;
     uint32_t dc_factor = (1 << 21) / (r * r);
-    uint16_t *dc = ctx->buf + 16;
-    uint16_t *buf = ctx->buf + bstride + 32;
+    uint16_t *dc = tmpbuf + 16;
+    uint16_t *buf = tmpbuf + bstride + 32;
     int thresh = ctx->thresh;
 
     memset(dc, 0, (bstride + 16) * sizeof(*buf));
-    for (y = 0; y < r; y++)
-        ctx->blur_line(dc, buf + y * bstride, buf + (y - 1) * bstride, src + 2 * y * src_linesize, src_linesize, width / 2);
-    for (;;) {
-        if (y < height - r) {
-            int mod = ((y + r) / 2) % r;
+    for (y = step - 2 * r; y < step; y += 2) {
+        int mod = ((y + r) / 2) % r;
+        ctx->blur_line(dc, buf + mod * bstride, buf + (mod ? mod - 1 : r - 1) * bstride,
+                       src + (y + r) * src_linesize, src_linesize, width / 2);
+    }
+    for (y = slice_start; y < slice_end; y++) {
+        if (av_clip(y & ~1, r, last) == step) {
+            int mod = ((step + r) / 2) % r;
             uint16_t *buf0 = buf + mod * bstride;
             uint16_t *buf1 = buf + (mod ? mod - 1 : r - 1) * bstride;
             int x, v;
-            ctx->blur_line(dc, buf0, buf1, src + (y + r) * src_linesize, src_linesize, width / 2);
+            /* the last step of a plane of odd height only has one line left */
+            ctx->blur_line(dc, buf0, buf1, src + (step + r) * src_linesize,
+                           step + r + 1 < height ? src_linesize : 0, width / 2);
             for (x = v = 0; x < r; x++)
                 v += dc[x];
             for (; x < width / 2; x++) {
@@ -103,15 +120,9 @@ static void filter(GradFunContext *ctx, uint8_t *dst, uint8_t *src, int width, i
                 dc[x-r] = v * dc_factor >> 16;
             for (x = -r / 2; x < 0; x++)
                 dc[x] = dc[0];
+            step += 2;
         }
-        if (y == r) {
-            for (y = 0; y < r; y++)
-                ctx->filter_line(dst + y * dst_linesize, src + y * src_linesize, dc - r / 2, width, thresh, dither[y & 7]);
-        }
-        ctx->filter_line(dst + y * dst_linesize, src + y * src_linesize, dc - r / 2, width, thresh, dither[y & 7]);
-        if (++y >= height) break;
         ctx->filter_line(dst + y * dst_linesize, src + y * src_linesize, dc - r / 2, width, thresh, dither[y & 7]);
-        if (++y >= height) break;
     }
 }
 
@@ -171,7 +182,9 @@ static int config_input(AVFilterLink *inlink)
     int hsub = av_pix_fmt_descriptors[inlink->format].log2_chroma_w;
     int vsub = av_pix_fmt_descriptors[inlink->format].log2_chroma_h;
 
-    gf->buf = av_mallocz((FFALIGN(inlink->w, 16) * (gf->radius + 1) / 2 + 32) * sizeof(uint16_t));
+    gf->nb_threads = ff_avfilter_thread_count(inlink->dst);
+    gf->buf_size   = FFALIGN(inlink->w, 16) * (gf->radius + 1) / 2 + 32;
+    gf->buf = av_mallocz(gf->buf_size * gf->nb_threads * sizeof(uint16_t));
     if (!gf->buf)
         return AVERROR(ENOMEM);
 
@@ -184,10 +197,13 @@ static int config_input(AVFilterLink *inlink)
 
 static void start_frame(AVFilterLink *inlink, AVFilterBufferRef *inpicref)
 {
+    GradFunContext *gf = inlink->dst->priv;
     AVFilterLink *outlink = inlink->dst->outputs[0];
     AVFilterBufferRef *outpicref;
 
-    if (inpicref->perms & AV_PERM_PRESERVE) {
+    /* the slices read the lines around them, so they cannot be
+     * filtered in place in parallel */
+    if (inpicref->perms & AV_PERM_PRESERVE || gf->nb_threads > 1) {
         outpicref = avfilter_get_video_buffer(outlink, AV_PERM_WRITE, outlink->w, outlink->h);
         avfilter_copy_buffer_ref_props(outpicref, inpicref);
         outpicref->video->w = outlink->w;
@@ -201,29 +217,46 @@ static void start_frame(AVFilterLink *inlink, AVFilterBufferRef *inpicref)
 
 static void null_draw_slice(AVFilterLink *link, int y, int h, int slice_dir) { }
 
-static void end_frame(AVFilterLink *inlink)
+static int filter_slice(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs)
 {
-    GradFunContext *gf = inlink->dst->priv;
-    AVFilterBufferRef *inpic = inlink->cur_buf;
-    AVFilterLink *outlink = inlink->dst->outputs[0];
-    AVFilterBufferRef *outpic = outlink->out_buf;
+    GradFunContext *gf = ctx->priv;
+    AVFilterLink *inlink = ctx->inputs[0];
+    AVFilterBufferRef *inpic  = inlink->cur_buf;
+    AVFilterBufferRef *outpic = ctx->outputs[0]->out_buf;
     int p;
 
     for (p = 0; p < 4 && inpic->data[p]; p++) {
         int w = inlink->w;
         int h = inlink->h;
         int r = gf->radius;
+        int slice_start, slice_end;
         if (p) {
             w = gf->chroma_w;
             h = gf->chroma_h;
             r = gf->chroma_r;
         }
+        slice_start = h *  jobnr      / nb_jobs;
+        slice_end   = h * (jobnr + 1) / nb_jobs;
 
         if (FFMIN(w, h) > 2 * r)
-            filter(gf, outpic->data[p], inpic->data[p], w, h, outpic->linesize[p], inpic->linesize[p], r);
+            filter(gf, gf->buf + jobnr * gf->buf_size, outpic->data[p], inpic->data[p], w, h,
+                   outpic->linesize[p], inpic->linesize[p], r, slice_start, slice_end);
         else if (outpic->data[p] != inpic->data[p])
-            av_image_copy_plane(outpic->data[p], outpic->linesize[p], inpic->data[p], inpic->linesize[p], w, h);
+            av_image_copy_plane(outpic->data[p] + slice_start * outpic->linesize[p], outpic->linesize[p],
+                                inpic->data[p]  + slice_start * inpic->linesize[p],  inpic->linesize[p],
+                                w, slice_end - slice_start);
     }
+    return 0;
+}
+
+static void end_frame(AVFilterLink *inlink)
+{
+    GradFunContext *gf = inlink->dst->priv;
+    AVFilterBufferRef *inpic = inlink->cur_buf;
+    AVFilterLink *outlink = inlink->dst->outputs[0];
+    AVFilterBufferRef *outpic = outlink->out_buf;
+
+    inlink->dst->execute(inlink->dst, filter_slice, NULL, NULL, gf->nb_threads);
 
     avfilter_draw_slice(outlink, 0, inlink->h, 1);
     avfilter_end_frame(outlink);
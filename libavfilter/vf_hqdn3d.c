@@ -35,6 +35,10 @@ typedef struct {
     int hsub, vsub;
 } HQDN3DContext;
 
+typedef struct {
+    AVFilterBufferRef *in, *out;
+} ThreadData;
+
 static inline unsigned int LowPassMul(unsigned int PrevMul, unsigned int CurrMul, int *Coef)
 {
     //    int dMul= (PrevMul&0xFFFFFF)-(CurrMul&0xFFFFFF);
@@ -280,7 +284,8 @@ static int config_input(AVFilterLink *inlink)
     hqdn3d->hsub = av_pix_fmt_descriptors[inlink->format].log2_chroma_w;
     hqdn3d->vsub = av_pix_fmt_descriptors[inlink->format].log2_chroma_h;
 
-    hqdn3d->Line = av_malloc(inlink->w * sizeof(*hqdn3d->Line));
+    /* one line per plane, so that the planes can be denoised in parallel */
+    hqdn3d->Line = av_malloc(3 * inlink->w * sizeof(*hqdn3d->Line));
     if (!hqdn3d->Line)
         return AVERROR(ENOMEM);
 
@@ -289,33 +294,41 @@ static int config_input(AVFilterLink *inlink)
 
 static void null_draw_slice(AVFilterLink *link, int y, int h, int slice_dir) { }
 
+/* The filter is recursive in all directions, so the planes are the
+ * smallest units of work that can be processed in parallel. */
+static int denoise_plane(AVFilterContext *ctx, void *arg, int plane, int nb_jobs)
+{
+    HQDN3DContext *hqdn3d = ctx->priv;
+    ThreadData *td = arg;
+    AVFilterBufferRef *inpic  = td->in;
+    AVFilterBufferRef *outpic = td->out;
+    int w = inpic->video->w;
+    int h = inpic->video->h;
+    int c = plane ? 2 : 0;
+
+    if (plane) {
+        w >>= hqdn3d->hsub;
+        h >>= hqdn3d->vsub;
+    }
+
+    deNoise(inpic->data[plane], outpic->data[plane],
+            hqdn3d->Line + plane * inpic->video->w, &hqdn3d->Frame[plane], w, h,
+            inpic->linesize[plane], outpic->linesize[plane],
+            hqdn3d->Coefs[c],
+            hqdn3d->Coefs[c],
+            hqdn3d->Coefs[c+1]);
+    return 0;
+}
+
 static void end_frame(AVFilterLink *inlink)
 {
-    HQDN3DContext *hqdn3d = inlink->dst->priv;
-    AVFilterLink *outlink = inlink->dst->outputs[0];
+    AVFilterContext *ctx = inlink->dst;
+    AVFilterLink *outlink = ctx->outputs[0];
     AVFilterBufferRef *inpic  = inlink ->cur_buf;
     AVFilterBufferRef *outpic = outlink->out_buf;
-    int cw = inpic->video->w >> hqdn3d->hsub;
-    int ch = inpic->video->h >> hqdn3d->vsub;
-
-    deNoise(inpic->data[0], outpic->data[0],
-            hqdn3d->Line, &hqdn3d->Frame[0], inpic->video->w, inpic->video->h,
-            inpic->linesize[0], outpic->linesize[0],
-            hqdn3d->Coefs[0],
-            hqdn3d->Coefs[0],
-            hqdn3d->Coefs[1]);
-    deNoise(inpic->data[1], outpic->data[1],
-            hqdn3d->Line, &hqdn3d->Frame[1], cw, ch,
-            inpic->linesize[1], outpic->linesize[1],
-            hqdn3d->Coefs[2],
-            hqdn3d->Coefs[2],
-            hqdn3d->Coefs[3]);
-    deNoise(inpic->data[2], outpic->data[2],
-            hqdn3d->Line, &hqdn3d->Frame[2], cw, ch,
-            inpic->linesize[2], outpic->linesize[2],
-            hqdn3d->Coefs[2],
-            hqdn3d->Coefs[2],
-            hqdn3d->Coefs[3]);
+    ThreadData td = { inpic, outpic };
+
+    ctx->execute(ctx, denoise_plane, &td, NULL, 3);
 
     avfilter_draw_slice(outlink, 0, inpic->video->h, 1);
     avfilter_end_frame(outlink);
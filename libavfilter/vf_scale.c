@@ -24,6 +24,8 @@
  */
 
 #include "avfilter.h"
+#include "internal.h"
+#include "libavutil/opt.h"
 #include "libavutil/pixdesc.h"
 #include "libswscale/swscale.h"
 
@@ -103,12 +105,31 @@ static int query_formats(AVFilterContext *ctx)
     return 0;
 }
 
+/**
+ * Replace a YUVJ format with the corresponding YUV format, as
+ * sws_getContext() does for the contexts it sets up itself.
+ *
+ * @return 1 if the format was a full range one, 0 otherwise
+ */
+static int handle_jpeg(enum PixelFormat *format)
+{
+    switch (*format) {
+    case PIX_FMT_YUVJ420P: *format = PIX_FMT_YUV420P; return 1;
+    case PIX_FMT_YUVJ422P: *format = PIX_FMT_YUV422P; return 1;
+    case PIX_FMT_YUVJ444P: *format = PIX_FMT_YUV444P; return 1;
+    case PIX_FMT_YUVJ440P: *format = PIX_FMT_YUV440P; return 1;
+    default:                                          return 0;
+    }
+}
+
 static int config_props(AVFilterLink *outlink)
 {
     AVFilterContext *ctx = outlink->src;
     AVFilterLink *inlink = outlink->src->inputs[0];
     ScaleContext *scale = ctx->priv;
     int64_t w, h;
+    enum PixelFormat src_format = inlink->format, dst_format = outlink->format;
+    int src_range, dst_range;
 
     if (!(w = scale->w))
         w = inlink->w;
@@ -135,11 +156,30 @@ static int config_props(AVFilterLink *outlink)
 
     scale->input_is_pal = av_pix_fmt_descriptors[inlink->format].flags & PIX_FMT_PAL;
 
-    scale->sws = sws_getContext(inlink ->w, inlink ->h, inlink ->format,
-                                outlink->w, outlink->h, outlink->format,
-                                scale->flags, NULL, NULL, NULL);
+    /* same setup as sws_getContext(), plus the graph thread count, which
+     * lets libswscale scale the whole pictures in parallel bands */
+    scale->sws = sws_alloc_context();
     if (!scale->sws)
+        return AVERROR(ENOMEM);
+
+    src_range = handle_jpeg(&src_format);
+    dst_range = handle_jpeg(&dst_format);
+    av_set_int(scale->sws, "srcw",       inlink ->w);
+    av_set_int(scale->sws, "srch",       inlink ->h);
+    av_set_int(scale->sws, "src_format", src_format);
+    av_set_int(scale->sws, "dstw",       outlink->w);
+    av_set_int(scale->sws, "dsth",       outlink->h);
+    av_set_int(scale->sws, "dst_format", dst_format);
+    av_set_int(scale->sws, "sws_flags",  scale->flags);
+    av_set_int(scale->sws, "threads",    ff_avfilter_thread_count(ctx));
+    sws_setColorspaceDetails(scale->sws, sws_getCoefficients(SWS_CS_DEFAULT), src_range,
+                             sws_getCoefficients(SWS_CS_DEFAULT), dst_range, 0, 1 << 16, 1 << 16);
+
+    if (sws_init_context(scale->sws, NULL, NULL) < 0) {
+        sws_freeContext(scale->sws);
+        scale->sws = NULL;
         return AVERROR(EINVAL);
+    }
 
     return 0;
 }
@@ -37,6 +37,7 @@
  */
 
 #include "avfilter.h"
+#include "internal.h"
 #include "libavutil/common.h"
 #include "libavutil/mem.h"
 #include "libavutil/pixdesc.h"
@@ -61,32 +62,52 @@ typedef struct FilterParam {
 typedef struct {
     FilterParam luma;   ///< luma parameters (width, height, amount)
     FilterParam chroma; ///< chroma parameters (width, height, amount)
+    int nb_threads;     ///< number of slices the planes are split in
 } UnsharpContext;
 
-static void unsharpen(uint8_t *dst, uint8_t *src, int dst_stride, int src_stride, int width, int height, FilterParam *fp)
+typedef struct {
+    AVFilterBufferRef *in, *out;
+} ThreadData;
+
+/**
+ * Filter the lines slice_start to slice_end - 1 of a plane.
+ * The vertical filter state is rebuilt from the 2 * steps_y lines around
+ * the top of the slice, so that slices can be filtered independently.
+ * The lines above and below the plane are replaced by its first and last
+ * lines.
+ */
+static void unsharpen(uint8_t *dst, uint8_t *src, int dst_stride, int src_stride, int width, int height,
+                      int slice_start, int slice_end, FilterParam *fp, int jobnr)
 {
-    uint32_t **sc = fp->sc;
+    uint32_t *sc[(MAX_SIZE * MAX_SIZE) - 1];
     uint32_t sr[(MAX_SIZE * MAX_SIZE) - 1], tmp1, tmp2;
+    int sc_size = width + 2 * fp->steps_x;
 
     int32_t res;
     int x, y, z;
 
     if (!fp->amount) {
+        dst += slice_start * dst_stride;
+        src += slice_start * src_stride;
         if (dst_stride == src_stride)
-            memcpy(dst, src, src_stride * height);
+            memcpy(dst, src, src_stride * (slice_end - slice_start));
         else
-            for (y = 0; y < height; y++, dst += dst_stride, src += src_stride)
+            for (y = slice_start; y < slice_end; y++, dst += dst_stride, src += src_stride)
                 memcpy(dst, src, width);
         return;
     }
 
-    for (y = 0; y < 2 * fp->steps_y; y++)
-        memset(sc[y], 0, sizeof(sc[y][0]) * (width + 2 * fp->steps_x));
+    for (y = 0; y < 2 * fp->steps_y; y++) {
+        sc[y] = fp->sc[y] + jobnr * sc_size;
+        memset(sc[y], 0, sizeof(sc[y][0]) * sc_size);
+    }
+
+    for (y = slice_start - fp->steps_y; y < slice_end + fp->steps_y; y++) {
+        uint8_t *srcy = src + av_clip(y, 0, height - 1) * src_stride;
 
-    for (y = -fp->steps_y; y < height + fp->steps_y; y++) {
         memset(sr, 0, sizeof(sr[0]) * (2 * fp->steps_x - 1));
         for (x = -fp->steps_x; x < width + fp->steps_x; x++) {
-            tmp1 = x <= 0 ? src[0] : x >= width ? src[width-1] : src[x];
+            tmp1 = x <= 0 ? srcy[0] : x >= width ? srcy[width-1] : srcy[x];
             for (z = 0; z < fp->steps_x * 2; z += 2) {
                 tmp2 = sr[z + 0] + tmp1; sr[z + 0] = tmp1;
                 tmp1 = sr[z + 1] + tmp2; sr[z + 1] = tmp2;
@@ -95,21 +116,35 @@ static void unsharpen(uint8_t *dst, uint8_t *src, int dst_stride, int src_stride
                 tmp2 = sc[z + 0][x + fp->steps_x] + tmp1; sc[z + 0][x + fp->steps_x] = tmp1;
                 tmp1 = sc[z + 1][x + fp->steps_x] + tmp2; sc[z + 1][x + fp->steps_x] = tmp2;
             }
-            if (x >= fp->steps_x && y >= fp->steps_y) {
-                uint8_t* srx = src - fp->steps_y * src_stride + x - fp->steps_x;
-                uint8_t* dsx = dst - fp->steps_y * dst_stride + x - fp->steps_x;
+            if (x >= fp->steps_x && y >= slice_start + fp->steps_y) {
+                uint8_t* srx = src + (y - fp->steps_y) * src_stride + x - fp->steps_x;
+                uint8_t* dsx = dst + (y - fp->steps_y) * dst_stride + x - fp->steps_x;
 
                 res = (int32_t)*srx + ((((int32_t) * srx - (int32_t)((tmp1 + fp->halfscale) >> fp->scalebits)) * fp->amount) >> 16);
                 *dsx = av_clip_uint8(res);
             }
         }
-        if (y >= 0) {
-            dst += dst_stride;
-            src += src_stride;
-        }
     }
 }
 
+static int filter_slice(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs)
+{
+    UnsharpContext *unsharp = ctx->priv;
+    AVFilterLink *link = ctx->inputs[0];
+    ThreadData *td = arg;
+    AVFilterBufferRef *in  = td->in;
+    AVFilterBufferRef *out = td->out;
+    int cw = CHROMA_WIDTH(link), ch = CHROMA_HEIGHT(link);
+    int i;
+
+    unsharpen(out->data[0], in->data[0], out->linesize[0], in->linesize[0], link->w, link->h,
+              link->h * jobnr / nb_jobs, link->h * (jobnr + 1) / nb_jobs, &unsharp->luma, jobnr);
+    for (i = 1; i < 3; i++)
+        unsharpen(out->data[i], in->data[i], out->linesize[i], in->linesize[i], cw, ch,
+                  ch * jobnr / nb_jobs, ch * (jobnr + 1) / nb_jobs, &unsharp->chroma, jobnr);
+    return 0;
+}
+
 static void set_filter_param(FilterParam *fp, int msize_x, int msize_y, double amount)
 {
     fp->msize_x = msize_x;
@@ -160,7 +195,8 @@ static int query_formats(AVFilterContext *ctx)
     return 0;
 }
 
-static void init_filter_param(AVFilterContext *ctx, FilterParam *fp, const char *effect_type, int width)
+static int init_filter_param(AVFilterContext *ctx, FilterParam *fp, const char *effect_type,
+                             int width, int nb_threads)
 {
     int z;
     const char *effect;
@@ -171,15 +207,24 @@ static void init_filter_param(AVFilterContext *ctx, FilterParam *fp, const char
            effect, effect_type, fp->msize_x, fp->msize_y, fp->amount / 65535.0);
 
     for (z = 0; z < 2 * fp->steps_y; z++)
-        fp->sc[z] = av_malloc(sizeof(*(fp->sc[z])) * (width + 2 * fp->steps_x));
+        if (!(fp->sc[z] = av_malloc(sizeof(*(fp->sc[z])) * (width + 2 * fp->steps_x) * nb_threads)))
+            return AVERROR(ENOMEM);
+
+    return 0;
 }
 
 static int config_props(AVFilterLink *link)
 {
     UnsharpContext *unsharp = link->dst->priv;
+    int ret;
+
+    unsharp->nb_threads = ff_avfilter_thread_count(link->dst);
 
-    init_filter_param(link->dst, &unsharp->luma,   "luma",   link->w);
-    init_filter_param(link->dst, &unsharp->chroma, "chroma", CHROMA_WIDTH(link));
+    if ((ret = init_filter_param(link->dst, &unsharp->luma,   "luma",   link->w,
+                                 unsharp->nb_threads)) < 0 ||
+        (ret = init_filter_param(link->dst, &unsharp->chroma, "chroma", CHROMA_WIDTH(link),
+                                 unsharp->nb_threads)) < 0)
+        return ret;
 
     return 0;
 }
@@ -205,10 +250,9 @@ static void end_frame(AVFilterLink *link)
     UnsharpContext *unsharp = link->dst->priv;
     AVFilterBufferRef *in  = link->cur_buf;
     AVFilterBufferRef *out = link->dst->outputs[0]->out_buf;
+    ThreadData td = { in, out };
 
-    unsharpen(out->data[0], in->data[0], out->linesize[0], in->linesize[0], link->w,            link->h,             &unsharp->luma);
-    unsharpen(out->data[1], in->data[1], out->linesize[1], in->linesize[1], CHROMA_WIDTH(link), CHROMA_HEIGHT(link), &unsharp->chroma);
-    unsharpen(out->data[2], in->data[2], out->linesize[2], in->linesize[2], CHROMA_WIDTH(link), CHROMA_HEIGHT(link), &unsharp->chroma);
+    link->dst->execute(link->dst, filter_slice, &td, NULL, unsharp->nb_threads);
 
     avfilter_unref_buffer(in);
     avfilter_draw_slice(link->dst->outputs[0], 0, link->h, 1);
@@ -21,6 +21,7 @@
 #include "libavutil/cpu.h"
 #include "libavutil/common.h"
 #include "avfilter.h"
+#include "internal.h"
 #include "yadif.h"
 
 #undef NDEBUG
@@ -115,25 +116,35 @@ static void filter_line_c(uint8_t *dst,
     }
 }
 
-static void filter(AVFilterContext *ctx, AVFilterBufferRef *dstpic,
-                   int parity, int tff)
+typedef struct {
+    AVFilterBufferRef *dstpic;
+    int parity;
+    int tff;
+} ThreadData;
+
+static int filter_slice(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs)
 {
     YADIFContext *yadif = ctx->priv;
+    ThreadData *td = arg;
+    AVFilterBufferRef *dstpic = td->dstpic;
+    int parity = td->parity;
     int y, i;
 
     for (i = 0; i < 3; i++) {
         int is_chroma = !!i;
-        int w = dstpic->video->w >> is_chroma;
-        int h = dstpic->video->h >> is_chroma;
+        int w = -((-dstpic->video->w) >> is_chroma);
+        int h = -((-dstpic->video->h) >> is_chroma);
         int refs = yadif->cur->linesize[i];
+        int slice_start = h *  jobnr      / nb_jobs;
+        int slice_end   = h * (jobnr + 1) / nb_jobs;
 
-        for (y = 0; y < h; y++) {
+        for (y = slice_start; y < slice_end; y++) {
             if ((y ^ parity) & 1) {
                 uint8_t *prev = &yadif->prev->data[i][y*refs];
                 uint8_t *cur  = &yadif->cur ->data[i][y*refs];
                 uint8_t *next = &yadif->next->data[i][y*refs];
                 uint8_t *dst  = &dstpic->data[i][y*dstpic->linesize[i]];
-                yadif->filter_line(dst, prev, cur, next, w, refs, parity ^ tff, yadif->mode);
+                yadif->filter_line(dst, prev, cur, next, w, refs, parity ^ td->tff, yadif->mode);
             } else {
                 memcpy(&dstpic->data[i][y*dstpic->linesize[i]],
                        &yadif->cur->data[i][y*refs], w);
@@ -143,22 +154,44 @@ static void filter(AVFilterContext *ctx, AVFilterBufferRef *dstpic,
 #if HAVE_MMX
     __asm__ volatile("emms \n\t" : : : "memory");
 #endif
+    return 0;
+}
+
+static void filter(AVFilterContext *ctx, AVFilterBufferRef *dstpic,
+                   int parity, int tff)
+{
+    ThreadData td = { dstpic, parity, tff };
+
+    ctx->execute(ctx, filter_slice, &td, NULL, ff_avfilter_thread_count(ctx));
 }
 
 static AVFilterBufferRef *get_video_buffer(AVFilterLink *link, int perms, int w, int h)
 {
     AVFilterBufferRef *picref;
     int width = FFALIGN(w, 32);
-    int height= FFALIGN(h+6, 32);
-    int i;
+    /* 3 lines of padding above and below each plane, chroma ones included */
+    int height= FFALIGN(h+13, 32);
+    int i, y;
 
     picref = avfilter_default_get_video_buffer(link, perms, width, height);
 
     picref->video->w = w;
     picref->video->h = h;
 
-    for (i = 0; i < 3; i++)
-        picref->data[i] += 3 * picref->linesize[i];
+    /* filter_line() reads up to 2 lines above and below the picture and
+     * 3 pixels past its sides, make them deterministic instead of leaving
+     * whatever the buffer held */
+    for (i = 0; i < 3 && picref->data[i]; i++) {
+        int pw = i ? -((-w) >> 1) : w;
+        int ph = i ? -((-h) >> 1) : h;
+        int ls = picref->linesize[i];
+
+        memset(picref->data[i], 0, 3 * ls);
+        picref->data[i] += 3 * ls;
+        for (y = 0; y < ph; y++)
+            memset(picref->data[i] + y * ls + pw, 0, ls - pw);
+        memset(picref->data[i] + ph * ls, 0, 3 * ls);
+    }
 
     return picref;
 }
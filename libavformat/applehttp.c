@@ -29,7 +29,17 @@
 #include "libavutil/avstring.h"
 #include "avformat.h"
 #include "internal.h"
+#include "avio_internal.h"
+#include "http.h"
 #include <unistd.h>
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#define INITIAL_BUFFER_SIZE 32768
+/* Number of segments downloaded ahead of the one being demuxed */
+#define PREFETCH_SEGMENTS 2
+#define PREFETCH_CHUNK_SIZE 32768
 
 /*
  * An apple http stream consists of a playlist with media segment files,
@@ -41,6 +51,15 @@
  *
  * If the main playlist doesn't point at any variants, we still create
  * one anonymous toplevel variant for this, to maintain the structure.
+ *
+ * When threads are available, the segments are downloaded by a separate
+ * thread, which fetches the current and the next PREFETCH_SEGMENTS
+ * segments of each needed variant into memory, and reloads the playlists
+ * of live streams when they are due. The demuxers read the segments from
+ * memory, so that they don't have to wait for a new request at each
+ * segment boundary. All the state shared with that thread (the segment
+ * lists, the prefetched segments, cur_seq_no and the needed flags) is
+ * protected by the context lock.
  */
 
 struct segment {
@@ -48,15 +67,35 @@ struct segment {
     char url[MAX_URL_SIZE];
 };
 
+/*
+ * A segment downloaded into memory by the prefetch thread. The demuxer
+ * may start reading it before the download is complete.
+ */
+struct prefetched_segment {
+    int seq_no;
+    uint8_t *buf;
+    int size, allocated;
+    int done;       ///< 1 once completely downloaded, negative on error
+    int in_use;     ///< being read by the demuxer, must not be freed
+};
+
 /*
  * Each variant has its own demuxer. If it currently is active,
  * it has an open AVIOContext too, and potentially an AVPacket
- * containing the next packet from this stream.
+ * containing the next packet from this stream. The connection the
+ * last segment was read from is kept open, to fetch the next one;
+ * it belongs to the prefetch thread while that one is running.
  */
 struct variant {
+    struct AppleHTTPContext *parent;
     int bandwidth;
     char url[MAX_URL_SIZE];
     AVIOContext *pb;
+    URLContext *input;
+    struct prefetched_segment **prefetched;
+    int n_prefetched;
+    struct prefetched_segment *reading; ///< segment pb reads from
+    int read_pos;
     AVFormatContext *ctx;
     AVPacket pkt;
     int stream_offset;
@@ -76,8 +115,36 @@ typedef struct AppleHTTPContext {
     int64_t last_load_time;
     int64_t last_packet_dts;
     int max_start_seq, min_end_seq;
+    int prefetching;
+    int reloading;
+    int reload_error;
+#if HAVE_PTHREADS
+    pthread_t prefetch_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int abort; ///< also interrupts the downloads of the prefetch thread
+#endif
 } AppleHTTPContext;
 
+static void lock_context(AppleHTTPContext *c)
+{
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&c->lock);
+#endif
+}
+
+/*
+ * Release the lock, waking up whoever waits for the shared state to
+ * change: the prefetch thread or the demuxer waiting for a segment.
+ */
+static void unlock_context(AppleHTTPContext *c)
+{
+#if HAVE_PTHREADS
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+#endif
+}
+
 static int read_chomp_line(AVIOContext *s, char *buf, int maxlen)
 {
     int len = ff_get_line(s, buf, maxlen);
@@ -137,15 +204,75 @@ static void make_absolute_url(char *buf, int size, const char *base,
     av_strlcat(buf, rel, size);
 }
 
-static void free_segment_list(struct variant *var)
+static void free_segments(struct segment **segments, int n_segments)
 {
     int i;
-    for (i = 0; i < var->n_segments; i++)
-        av_free(var->segments[i]);
-    av_freep(&var->segments);
+    for (i = 0; i < n_segments; i++)
+        av_free(segments[i]);
+    av_free(segments);
+}
+
+static void free_segment_list(struct variant *var)
+{
+    free_segments(var->segments, var->n_segments);
+    var->segments   = NULL;
     var->n_segments = 0;
 }
 
+static void free_prefetched(struct variant *var, int i)
+{
+    av_free(var->prefetched[i]->buf);
+    av_free(var->prefetched[i]);
+    var->prefetched[i] = var->prefetched[--var->n_prefetched];
+}
+
+/*
+ * Close the AVIOContext of the current segment, but not the connection
+ * it reads from, which can carry the request for the next segment.
+ */
+static void close_segment(struct variant *var)
+{
+    av_free(var->pb->buffer);
+    av_freep(&var->pb);
+    if (var->reading) {
+        lock_context(var->parent);
+        var->reading->in_use = 0;
+        var->reading = NULL;
+        unlock_context(var->parent);
+    }
+}
+
+static void close_input(struct variant *var)
+{
+    if (var->pb)
+        close_segment(var);
+    if (var->input && !var->parent->prefetching) {
+        url_close(var->input);
+        var->input = NULL;
+    }
+}
+
+static int open_input(struct variant *var, const char *url)
+{
+    if (var->input) {
+        if (!strcmp(var->input->prot->name, "http") &&
+            ff_http_do_new_request(var->input, url) >= 0)
+            return 0;
+        url_close(var->input);
+        var->input = NULL;
+    }
+    return url_open(&var->input, url, URL_RDONLY);
+}
+
+static int open_segment(struct variant *var, const char *url)
+{
+    int ret;
+
+    if ((ret = open_input(var, url)) < 0)
+        return ret;
+    return url_fdopen(&var->pb, var->input);
+}
+
 static void free_variant_list(AppleHTTPContext *c)
 {
     int i;
@@ -153,8 +280,10 @@ static void free_variant_list(AppleHTTPContext *c)
         struct variant *var = c->variants[i];
         free_segment_list(var);
         av_free_packet(&var->pkt);
-        if (var->pb)
-            avio_close(var->pb);
+        close_input(var);
+        while (var->n_prefetched)
+            free_prefetched(var, 0);
+        av_freep(&var->prefetched);
         if (var->ctx) {
             var->ctx->pb = NULL;
             av_close_input_file(var->ctx);
@@ -182,6 +311,7 @@ static struct variant *new_variant(AppleHTTPContext *c, int bandwidth,
     if (!var)
         return NULL;
     reset_packet(&var->pkt);
+    var->parent    = c;
     var->bandwidth = bandwidth;
     make_absolute_url(var->url, sizeof(var->url), base, url);
     dynarray_add(&c->variants, &c->n_variants, var);
@@ -201,10 +331,18 @@ static void handle_variant_args(struct variant_info *info, const char *key,
     }
 }
 
+/*
+ * The new segment list is built aside and only replaces the current one
+ * once the whole playlist has been read, so that the context doesn't
+ * have to be locked while waiting for the network.
+ */
 static int parse_playlist(AppleHTTPContext *c, const char *url,
                           struct variant *var, AVIOContext *in)
 {
     int ret = 0, duration = 0, is_segment = 0, is_variant = 0, bandwidth = 0;
+    int finished = 0, target_duration = -1, start_seq_no = -1;
+    struct segment **segments = NULL;
+    int n_segments = 0;
     char line[1024];
     const char *ptr;
     int close_in = 0;
@@ -221,9 +359,6 @@ static int parse_playlist(AppleHTTPContext *c, const char *url,
         goto fail;
     }
 
-    if (var)
-        free_segment_list(var);
-    c->finished = 0;
     while (!url_feof(in)) {
         read_chomp_line(in, line, sizeof(line));
         if (av_strstart(line, "#EXT-X-STREAM-INF:", &ptr)) {
@@ -233,7 +368,7 @@ static int parse_playlist(AppleHTTPContext *c, const char *url,
                                &info);
             bandwidth = atoi(info.bandwidth);
         } else if (av_strstart(line, "#EXT-X-TARGETDURATION:", &ptr)) {
-            c->target_duration = atoi(ptr);
+            target_duration = atoi(ptr);
         } else if (av_strstart(line, "#EXT-X-MEDIA-SEQUENCE:", &ptr)) {
             if (!var) {
                 var = new_variant(c, 0, url, NULL);
@@ -242,9 +377,9 @@ static int parse_playlist(AppleHTTPContext *c, const char *url,
                     goto fail;
                 }
             }
-            var->start_seq_no = atoi(ptr);
+            start_seq_no = atoi(ptr);
         } else if (av_strstart(line, "#EXT-X-ENDLIST", &ptr)) {
-            c->finished = 1;
+            finished = 1;
         } else if (av_strstart(line, "#EXTINF:", &ptr)) {
             is_segment = 1;
             duration   = atoi(ptr);
@@ -275,24 +410,325 @@ static int parse_playlist(AppleHTTPContext *c, const char *url,
                 }
                 seg->duration = duration;
                 make_absolute_url(seg->url, sizeof(seg->url), url, line);
-                dynarray_add(&var->segments, &var->n_segments, seg);
+                dynarray_add(&segments, &n_segments, seg);
                 is_segment = 0;
             }
         }
     }
+
+    lock_context(c);
+    if (var) {
+        free_segment_list(var);
+        var->segments   = segments;
+        var->n_segments = n_segments;
+        segments        = NULL;
+        n_segments      = 0;
+        if (start_seq_no >= 0)
+            var->start_seq_no = start_seq_no;
+    }
+    if (target_duration >= 0)
+        c->target_duration = target_duration;
+    c->finished       = finished;
     c->last_load_time = av_gettime();
+    unlock_context(c);
 
 fail:
+    free_segments(segments, n_segments);
     if (close_in)
         avio_close(in);
     return ret;
 }
 
+/*
+ * Reload the playlists of the needed variants, and update the range of
+ * sequence numbers available in all of them. c->reloading tells that
+ * c->finished may already be set while that range is not updated yet.
+ */
+static int reload_playlists(AppleHTTPContext *c)
+{
+    int ret = 0, i, needed;
+
+    lock_context(c);
+    c->reloading = 1;
+    unlock_context(c);
+    for (i = 0; i < c->n_variants; i++) {
+        struct variant *var = c->variants[i];
+        lock_context(c);
+        needed = var->needed;
+        unlock_context(c);
+        if (needed && (ret = parse_playlist(c, var->url, var, NULL)) < 0)
+            break;
+    }
+    lock_context(c);
+    c->reloading     = 0;
+    c->max_start_seq = 0;
+    c->min_end_seq   = INT_MAX;
+    for (i = 0; i < c->n_variants; i++) {
+        struct variant *var = c->variants[i];
+        if (var->needed) {
+            c->max_start_seq = FFMAX(c->max_start_seq, var->start_seq_no);
+            c->min_end_seq   = FFMIN(c->min_end_seq,
+                                     var->start_seq_no + var->n_segments);
+        }
+    }
+    unlock_context(c);
+    return ret;
+}
+
+#if HAVE_PTHREADS
+static void wait_context(AppleHTTPContext *c, int64_t timeout)
+{
+    int64_t t = av_gettime() + timeout;
+    struct timespec ts = { t / 1000000, t % 1000000 * 1000 };
+    pthread_cond_timedwait(&c->cond, &c->lock, &ts);
+}
+
+static struct prefetched_segment *find_prefetched(struct variant *var,
+                                                  int seq_no)
+{
+    int i;
+    for (i = 0; i < var->n_prefetched; i++)
+        if (var->prefetched[i]->seq_no == seq_no)
+            return var->prefetched[i];
+    return NULL;
+}
+
+static int segment_available(struct variant *var, int seq_no)
+{
+    return seq_no >= var->start_seq_no &&
+           seq_no <  var->start_seq_no + var->n_segments;
+}
+
+static int prefetch_wanted(AppleHTTPContext *c, struct variant *var,
+                           struct prefetched_segment *seg)
+{
+    return seg->in_use || (var->needed && !c->abort &&
+                           seg->seq_no >= c->cur_seq_no &&
+                           seg->seq_no <= c->cur_seq_no + PREFETCH_SEGMENTS);
+}
+
+/*
+ * Free the segments that have been read or skipped, and close the
+ * connections of the variants that are no longer needed.
+ * Called with the lock held.
+ */
+static void drop_prefetched(AppleHTTPContext *c)
+{
+    int i, j;
+    for (i = 0; i < c->n_variants; i++) {
+        struct variant *var = c->variants[i];
+        for (j = var->n_prefetched - 1; j >= 0; j--)
+            if (!prefetch_wanted(c, var, var->prefetched[j]))
+                free_prefetched(var, j);
+        if (!var->needed && var->input) {
+            url_close(var->input);
+            var->input = NULL;
+        }
+    }
+}
+
+/*
+ * Pick the next segment to download, in sequence order, and add an
+ * empty entry for it. Called with the lock held.
+ */
+static struct prefetched_segment *next_prefetch(AppleHTTPContext *c,
+                                                struct variant **pvar,
+                                                char *url)
+{
+    int seq_no, i;
+    for (seq_no = c->cur_seq_no;
+         seq_no <= c->cur_seq_no + PREFETCH_SEGMENTS; seq_no++) {
+        for (i = 0; i < c->n_variants; i++) {
+            struct variant *var = c->variants[i];
+            struct prefetched_segment *seg;
+            if (!var->needed || !segment_available(var, seq_no) ||
+                find_prefetched(var, seq_no))
+                continue;
+            seg = av_mallocz(sizeof(struct prefetched_segment));
+            if (!seg)
+                return NULL;
+            seg->seq_no = seq_no;
+            dynarray_add(&var->prefetched, &var->n_prefetched, seg);
+            av_strlcpy(url, var->segments[seq_no - var->start_seq_no]->url,
+                       MAX_URL_SIZE);
+            *pvar = var;
+            return seg;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Download a segment into memory. The lock is only held while growing
+ * the buffer and publishing the new data, not while reading from the
+ * network. The download is given up if the segment is no longer wanted.
+ */
+static void download_segment(AppleHTTPContext *c, struct variant *var,
+                             struct prefetched_segment *seg, const char *url)
+{
+    int ret = open_input(var, url);
+
+    while (ret >= 0) {
+        lock_context(c);
+        if (!prefetch_wanted(c, var, seg)) {
+            unlock_context(c);
+            ret = AVERROR(EINTR);
+            break;
+        }
+        if (seg->allocated - seg->size < PREFETCH_CHUNK_SIZE) {
+            int size = FFMAX(2 * seg->allocated,
+                             seg->size + PREFETCH_CHUNK_SIZE);
+            uint8_t *buf = av_realloc(seg->buf, size);
+            if (buf) {
+                seg->buf       = buf;
+                seg->allocated = size;
+            } else
+                ret = AVERROR(ENOMEM);
+        }
+        unlock_context(c);
+        if (ret < 0)
+            break;
+        ret = url_read(var->input, seg->buf + seg->size, PREFETCH_CHUNK_SIZE);
+        if (ret <= 0)
+            break;
+        lock_context(c);
+        seg->size += ret;
+        unlock_context(c);
+    }
+    if (ret < 0 && ret != AVERROR(EINTR))
+        av_log(NULL, AV_LOG_WARNING, "Failed downloading %s\n", url);
+    lock_context(c);
+    seg->done = ret < 0 ? ret : 1;
+    unlock_context(c);
+}
+
+static void *prefetch_task(void *arg)
+{
+    AppleHTTPContext *c = arg;
+    struct prefetched_segment *seg;
+    struct variant *var;
+    char url[MAX_URL_SIZE];
+    int ret;
+
+    ff_url_set_thread_abort(&c->abort);
+    pthread_mutex_lock(&c->lock);
+    while (!c->abort) {
+        drop_prefetched(c);
+        if (!c->finished && !c->reload_error &&
+            av_gettime() - c->last_load_time >= c->target_duration*1000000) {
+            pthread_mutex_unlock(&c->lock);
+            ret = reload_playlists(c);
+            pthread_mutex_lock(&c->lock);
+            c->reload_error = FFMIN(ret, 0);
+            pthread_cond_broadcast(&c->cond);
+        } else if ((seg = next_prefetch(c, &var, url))) {
+            pthread_mutex_unlock(&c->lock);
+            download_segment(c, var, seg, url);
+            pthread_mutex_lock(&c->lock);
+        } else
+            wait_context(c, 100000);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+static int read_prefetched(void *opaque, uint8_t *buf, int buf_size)
+{
+    struct variant *var = opaque;
+    AppleHTTPContext *c = var->parent;
+    struct prefetched_segment *seg = var->reading;
+    int ret;
+
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        if (var->read_pos < seg->size) {
+            ret = FFMIN(buf_size, seg->size - var->read_pos);
+            memcpy(buf, seg->buf + var->read_pos, ret);
+            var->read_pos += ret;
+            break;
+        }
+        if (seg->done) {
+            ret = FFMIN(seg->done, 0);
+            break;
+        }
+        if (url_interrupt_cb()) {
+            ret = AVERROR(EINTR);
+            break;
+        }
+        wait_context(c, 100000);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+/*
+ * Wait until the prefetch thread has started receiving the current
+ * segment of var, and set up var->pb to read it from memory.
+ * Nothing is opened if the segment has expired from the playlist
+ * meanwhile.
+ */
+static int open_prefetched(AppleHTTPContext *c, struct variant *var)
+{
+    struct prefetched_segment *seg;
+    uint8_t *buf;
+    int ret = 0, i;
+
+    pthread_mutex_lock(&c->lock);
+    pthread_cond_broadcast(&c->cond);
+    for (;;) {
+        if (!segment_available(var, c->cur_seq_no))
+            goto end;
+        seg = find_prefetched(var, c->cur_seq_no);
+        if (seg && (seg->size || seg->done))
+            break;
+        if (url_interrupt_cb()) {
+            ret = AVERROR(EINTR);
+            goto end;
+        }
+        wait_context(c, 100000);
+    }
+    if (!seg->size && seg->done < 0) {
+        /* Drop it, so that it is requested again if we're called again */
+        ret = seg->done;
+        for (i = 0; var->prefetched[i] != seg; i++)
+            ;
+        free_prefetched(var, i);
+        goto end;
+    }
+    seg->in_use   = 1;
+    var->reading  = seg;
+    var->read_pos = 0;
+    pthread_mutex_unlock(&c->lock);
+
+    buf = av_malloc(INITIAL_BUFFER_SIZE);
+    if (buf)
+        var->pb = avio_alloc_context(buf, INITIAL_BUFFER_SIZE, 0, var,
+                                     read_prefetched, NULL, NULL);
+    if (!var->pb) {
+        av_free(buf);
+        lock_context(c);
+        seg->in_use  = 0;
+        var->reading = NULL;
+        unlock_context(c);
+        return AVERROR(ENOMEM);
+    }
+    var->pb->is_streamed = 1;
+    return 0;
+end:
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+#endif
+
 static int applehttp_read_header(AVFormatContext *s, AVFormatParameters *ap)
 {
     AppleHTTPContext *c = s->priv_data;
     int ret = 0, i, j, stream_offset = 0;
 
+#if HAVE_PTHREADS
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+#endif
     if ((ret = parse_playlist(c, s->filename, NULL, s->pb)) < 0)
         goto fail;
 
@@ -360,27 +796,58 @@ static int applehttp_read_header(AVFormatContext *s, AVFormatParameters *ap)
     if (!c->finished && c->min_end_seq - c->max_start_seq > 3)
         c->cur_seq_no = c->min_end_seq - 2;
 
+#if HAVE_PTHREADS
+    /* All the streams are wanted until told otherwise, start downloading
+     * their first segments right away. */
+    for (i = 0; i < c->n_variants; i++)
+        c->variants[i]->needed = c->variants[i]->n_segments > 0;
+    if (!pthread_create(&c->prefetch_thread, NULL, prefetch_task, c))
+        c->prefetching = 1;
+    else
+        av_log(s, AV_LOG_WARNING,
+               "Unable to start the prefetch thread, downloading "
+               "the segments on demand\n");
+#endif
+
     return 0;
 fail:
     free_variant_list(c);
+#if HAVE_PTHREADS
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+#endif
     return ret;
 }
 
 static int open_variant(AppleHTTPContext *c, struct variant *var, int skip)
 {
+    char url[MAX_URL_SIZE];
     int ret;
 
+    lock_context(c);
     if (c->cur_seq_no < var->start_seq_no) {
         av_log(NULL, AV_LOG_WARNING,
                "seq %d not available in variant %s, skipping\n",
                var->start_seq_no, var->url);
+        unlock_context(c);
         return 0;
     }
-    if (c->cur_seq_no - var->start_seq_no >= var->n_segments)
-        return c->finished ? AVERROR_EOF : 0;
-    ret = avio_open(&var->pb,
-                    var->segments[c->cur_seq_no - var->start_seq_no]->url,
-                    URL_RDONLY);
+    if (c->cur_seq_no - var->start_seq_no >= var->n_segments) {
+        ret = c->finished ? AVERROR_EOF : 0;
+        unlock_context(c);
+        return ret;
+    }
+    av_strlcpy(url, var->segments[c->cur_seq_no - var->start_seq_no]->url,
+               sizeof(url));
+    unlock_context(c);
+#if HAVE_PTHREADS
+    if (c->prefetching) {
+        ret = open_prefetched(c, var);
+        if (ret < 0 || !var->pb)
+            return ret;
+    } else
+#endif
+    ret = open_segment(var, url);
     if (ret < 0)
         return ret;
     var->ctx->pb = var->pb;
@@ -411,6 +878,7 @@ static int applehttp_read_packet(AVFormatContext *s, AVPacket *pkt)
         variants = 0;
 
     /* Recheck the discard flags - which streams are desired at the moment */
+    lock_context(c);
     for (i = 0; i < c->n_variants; i++)
         c->variants[i]->needed = 0;
     for (i = 0; i < s->nb_streams; i++) {
@@ -424,6 +892,7 @@ static int applehttp_read_packet(AVFormatContext *s, AVPacket *pkt)
          * streams are desired. */
         var->ctx->streams[i - var->stream_offset]->discard = st->discard;
     }
+    unlock_context(c);
     if (!needed)
         return AVERROR_EOF;
 start:
@@ -435,8 +904,7 @@ start:
                    "Closing variant stream %d, no longer needed\n", i);
             av_free_packet(&var->pkt);
             reset_packet(&var->pkt);
-            avio_close(var->pb);
-            var->pb = NULL;
+            close_input(var);
             changed = 1;
         } else if (!var->pb && var->needed) {
             if (first)
@@ -483,35 +951,29 @@ start:
      * current segments. */
     for (i = 0; i < c->n_variants; i++) {
         struct variant *var = c->variants[i];
-        if (var->pb) {
-            avio_close(var->pb);
-            var->pb = NULL;
-        }
+        if (var->pb)
+            close_segment(var);
     }
     /* Indicate that we're opening the next segment, not opening a new
      * variant stream in parallel, so we shouldn't try to skip ahead. */
     first = 0;
+    lock_context(c);
     c->cur_seq_no++;
 reload:
-    if (!c->finished) {
-        /* If this is a live stream and target_duration has elapsed since
-         * the last playlist reload, reload the variant playlists now. */
-        int64_t now = av_gettime();
-        if (now - c->last_load_time >= c->target_duration*1000000) {
-            c->max_start_seq = 0;
-            c->min_end_seq   = INT_MAX;
-            for (i = 0; i < c->n_variants; i++) {
-                struct variant *var = c->variants[i];
-                if (var->needed) {
-                    if ((ret = parse_playlist(c, var->url, var, NULL)) < 0)
-                        return ret;
-                    c->max_start_seq = FFMAX(c->max_start_seq,
-                                             var->start_seq_no);
-                    c->min_end_seq   = FFMIN(c->min_end_seq,
-                                             var->start_seq_no + var->n_segments);
-                }
-            }
-        }
+    /* If this is a live stream and target_duration has elapsed since
+     * the last playlist reload, reload the variant playlists now, unless
+     * the prefetch thread takes care of it. */
+    if (!c->prefetching && !c->finished &&
+        av_gettime() - c->last_load_time >= c->target_duration*1000000) {
+        unlock_context(c);
+        if ((ret = reload_playlists(c)) < 0)
+            return ret;
+        lock_context(c);
+    }
+    if (c->reload_error) {
+        ret = c->reload_error;
+        unlock_context(c);
+        return ret;
     }
     if (c->cur_seq_no < c->max_start_seq) {
         av_log(NULL, AV_LOG_WARNING,
@@ -520,18 +982,30 @@ reload:
         c->cur_seq_no = c->max_start_seq;
     }
     /* If more segments exit, open the next one */
-    if (c->cur_seq_no < c->min_end_seq)
+    if (c->cur_seq_no < c->min_end_seq) {
+        unlock_context(c);
         goto start;
+    }
     /* We've reached the end of the playlists - return eof if this is a
      * non-live stream, wait until the next playlist reload if it is live. */
-    if (c->finished)
+    if (c->finished && !c->reloading) {
+        unlock_context(c);
         return AVERROR_EOF;
-    while (av_gettime() - c->last_load_time < c->target_duration*1000000) {
-        if (url_interrupt_cb())
-            return AVERROR(EINTR);
+    }
+    if (url_interrupt_cb()) {
+        unlock_context(c);
+        return AVERROR(EINTR);
+    }
+#if HAVE_PTHREADS
+    if (c->prefetching)
+        wait_context(c, 100000);
+    else
+#endif
+    {
+        unlock_context(c);
         usleep(100*1000);
+        lock_context(c);
     }
-    /* Enough time has elapsed since the last reload */
     goto reload;
 }
 
@@ -539,7 +1013,23 @@ static int applehttp_close(AVFormatContext *s)
 {
     AppleHTTPContext *c = s->priv_data;
 
+#if HAVE_PTHREADS
+    if (c->prefetching) {
+        /* makes a download or playlist reload blocked on a stalled
+         * server return AVERROR(EINTR), so that the join cannot hang */
+        pthread_mutex_lock(&c->lock);
+        c->abort = 1;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+        pthread_join(c->prefetch_thread, NULL);
+        c->prefetching = 0;
+    }
+#endif
     free_variant_list(c);
+#if HAVE_PTHREADS
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+#endif
     return 0;
 }
 
@@ -557,14 +1047,13 @@ static int applehttp_read_seek(AVFormatContext *s, int stream_index,
     c->last_packet_dts = AV_NOPTS_VALUE;
     for (i = 0; i < c->n_variants; i++) {
         struct variant *var = c->variants[i];
-        if (var->pb) {
-            avio_close(var->pb);
-            var->pb = NULL;
-        }
+        if (var->pb)
+            close_segment(var);
         av_free_packet(&var->pkt);
         reset_packet(&var->pkt);
     }
 
+    lock_context(c);
     timestamp = av_rescale_rnd(timestamp, 1, stream_index >= 0 ?
                                s->streams[stream_index]->time_base.den :
                                AV_TIME_BASE, flags & AVSEEK_FLAG_BACKWARD ?
@@ -573,10 +1062,12 @@ static int applehttp_read_seek(AVFormatContext *s, int stream_index,
     for (i = 0; i < var->n_segments; i++) {
         if (timestamp >= pos && timestamp < pos + var->segments[i]->duration) {
             c->cur_seq_no = var->start_seq_no + i;
+            unlock_context(c);
             return 0;
         }
         pos += var->segments[i]->duration;
     }
+    unlock_context(c);
     return AVERROR(EIO);
 }
 
@@ -0,0 +1,300 @@
+/*
+ * Asynchronous read-ahead URL protocol
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Asynchronous read-ahead URL protocol.
+ *
+ * A thread reads the wrapped resource ahead of the caller into a FIFO of
+ * buffer_size bytes, so that waiting for the network or the disk overlaps
+ * with demuxing and decoding. A seek that lands inside the data already
+ * read ahead only drops the skipped bytes, any other seek is forwarded to
+ * the thread, which discards what it has read and starts over from the
+ * new position.
+ */
+
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "libavutil/avstring.h"
+#include "libavutil/fifo.h"
+#include "libavutil/opt.h"
+#include "avformat.h"
+#include "avio_internal.h"
+
+#define READ_CHUNK_SIZE 32768
+
+typedef struct AsyncContext {
+    const AVClass *class;
+    int buffer_size;
+    URLContext *inner;
+    int64_t inner_size;
+
+    AVFifoBuffer *fifo;
+    int64_t pos;            ///< position of the next byte returned to the caller
+    int eof;
+    int error;
+
+    int seek_request;
+    int64_t seek_pos;
+    int64_t seek_ret;
+    int seek_completed;
+    int abort_request;      ///< also makes url_read()/url_seek() on inner give up
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_reader;     ///< signaled when data, eof or a seek result is ready
+    pthread_cond_t cond_thread;     ///< signaled when space or a request is ready
+} AsyncContext;
+
+#define OFFSET(x) offsetof(AsyncContext, x)
+static const AVOption options[] = {
+    { "buffer_size", "size of the read-ahead window in bytes", OFFSET(buffer_size), FF_OPT_TYPE_INT, 4 * 1024 * 1024, READ_CHUNK_SIZE, INT_MAX },
+    { NULL }
+};
+
+static const AVClass async_class = {
+    "Async", av_default_item_name, options, LIBAVUTIL_VERSION_INT
+};
+
+static void *async_buffer_task(void *arg)
+{
+    URLContext *h = arg;
+    AsyncContext *c = h->priv_data;
+    uint8_t *buf = av_malloc(READ_CHUNK_SIZE);
+    int ret;
+
+    ff_url_set_thread_abort(&c->abort_request);
+    pthread_mutex_lock(&c->mutex);
+    if (!buf) {
+        c->error = AVERROR(ENOMEM);
+        pthread_cond_signal(&c->cond_reader);
+    }
+    while (!c->abort_request) {
+        if (c->seek_request) {
+            int64_t pos = c->seek_pos;
+            pthread_mutex_unlock(&c->mutex);
+            ret = url_seek(c->inner, pos, SEEK_SET);
+            pthread_mutex_lock(&c->mutex);
+            if (ret >= 0) {
+                av_fifo_reset(c->fifo);
+                c->pos   = ret;
+                c->eof   = 0;
+                c->error = buf ? 0 : AVERROR(ENOMEM);
+            }
+            c->seek_ret       = ret;
+            c->seek_request   = 0;
+            c->seek_completed = 1;
+            pthread_cond_signal(&c->cond_reader);
+            continue;
+        }
+        if (c->eof || c->error ||
+            av_fifo_space(c->fifo) < READ_CHUNK_SIZE) {
+            pthread_cond_wait(&c->cond_thread, &c->mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&c->mutex);
+        ret = url_read(c->inner, buf, READ_CHUNK_SIZE);
+        pthread_mutex_lock(&c->mutex);
+        /* the data belongs to the old position if a seek came in meanwhile */
+        if (c->seek_request)
+            continue;
+        if (ret > 0)
+            av_fifo_generic_write(c->fifo, buf, ret, NULL);
+        else if (ret == 0 || ret == AVERROR_EOF)
+            c->eof = 1;
+        else
+            c->error = ret;
+        pthread_cond_signal(&c->cond_reader);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    av_free(buf);
+    return NULL;
+}
+
+/* wake up every 100 ms to check the interrupt callback */
+static void wait_reader(AsyncContext *c)
+{
+    struct timeval tv;
+    struct timespec ts;
+
+    gettimeofday(&tv, NULL);
+    ts.tv_sec  = tv.tv_sec + (tv.tv_usec + 100000) / 1000000;
+    ts.tv_nsec = (tv.tv_usec + 100000) % 1000000 * 1000;
+    pthread_cond_timedwait(&c->cond_reader, &c->mutex, &ts);
+}
+
+static int async_open(URLContext *h, const char *uri, int flags)
+{
+    AsyncContext *c = h->priv_data;
+    const char *p;
+    int ret;
+
+    if (flags != URL_RDONLY)
+        return AVERROR(EINVAL);
+
+    av_strstart(uri, "async:", &uri);
+    if (av_strstart(uri, "buffer_size=", &p)) {
+        char *end;
+        long size = strtol(p, &end, 10);
+        if (end == p || *end != ':' || size < READ_CHUNK_SIZE) {
+            av_log(NULL, AV_LOG_ERROR, "Invalid async buffer_size, at least %d bytes "
+                   "followed by ':' and the URL are expected\n", READ_CHUNK_SIZE);
+            return AVERROR(EINVAL);
+        }
+        c->buffer_size = FFMIN(size, INT_MAX);
+        uri = end + 1;
+    }
+    if ((ret = url_open(&c->inner, uri, flags)) < 0)
+        return ret;
+    h->is_streamed = c->inner->is_streamed;
+    c->inner_size  = url_seek(c->inner, 0, AVSEEK_SIZE);
+
+    c->fifo = av_fifo_alloc(c->buffer_size);
+    if (!c->fifo) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->cond_reader, NULL);
+    pthread_cond_init(&c->cond_thread, NULL);
+    if (pthread_create(&c->thread, NULL, async_buffer_task, h)) {
+        av_log(NULL, AV_LOG_ERROR, "pthread_create failed\n");
+        pthread_mutex_destroy(&c->mutex);
+        pthread_cond_destroy(&c->cond_reader);
+        pthread_cond_destroy(&c->cond_thread);
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    return 0;
+fail:
+    av_fifo_free(c->fifo);
+    c->fifo = NULL;
+    url_close(c->inner);
+    return ret;
+}
+
+static int async_read(URLContext *h, unsigned char *buf, int size)
+{
+    AsyncContext *c = h->priv_data;
+    int ret;
+
+    pthread_mutex_lock(&c->mutex);
+    for (;;) {
+        int avail = av_fifo_size(c->fifo);
+        if (avail) {
+            ret = FFMIN(avail, size);
+            av_fifo_generic_read(c->fifo, buf, ret, NULL);
+            c->pos += ret;
+            pthread_cond_signal(&c->cond_thread);
+            break;
+        }
+        if (c->error) {
+            ret = c->error;
+            break;
+        }
+        if (c->eof) {
+            ret = 0;
+            break;
+        }
+        if (ff_check_interrupt()) {
+            ret = AVERROR(EINTR);
+            break;
+        }
+        wait_reader(c);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return ret;
+}
+
+static int64_t async_seek(URLContext *h, int64_t pos, int whence)
+{
+    AsyncContext *c = h->priv_data;
+    int64_t ret;
+
+    if (whence == AVSEEK_SIZE)
+        return c->inner_size;
+    if (whence == SEEK_END) {
+        if (c->inner_size < 0)
+            return AVERROR(ENOSYS);
+        pos += c->inner_size;
+    } else if (whence != SEEK_SET && whence != SEEK_CUR)
+        return AVERROR(EINVAL);
+
+    pthread_mutex_lock(&c->mutex);
+    if (whence == SEEK_CUR)
+        pos += c->pos;
+    if (pos < 0) {
+        pthread_mutex_unlock(&c->mutex);
+        return AVERROR(EINVAL);
+    }
+    /* forward seek within the data already read ahead */
+    if (pos >= c->pos && pos - c->pos <= av_fifo_size(c->fifo)) {
+        av_fifo_drain(c->fifo, pos - c->pos);
+        c->pos = pos;
+        pthread_cond_signal(&c->cond_thread);
+        pthread_mutex_unlock(&c->mutex);
+        return pos;
+    }
+    c->seek_request   = 1;
+    c->seek_pos       = pos;
+    c->seek_completed = 0;
+    pthread_cond_signal(&c->cond_thread);
+    while (!c->seek_completed) {
+        if (ff_check_interrupt()) {
+            pthread_mutex_unlock(&c->mutex);
+            return AVERROR(EINTR);
+        }
+        wait_reader(c);
+    }
+    ret = c->seek_ret;
+    pthread_mutex_unlock(&c->mutex);
+    return ret;
+}
+
+static int async_close(URLContext *h)
+{
+    AsyncContext *c = h->priv_data;
+
+    /* a url_read() or url_seek() the thread is blocked in returns
+     * AVERROR(EINTR) once it sees the flag; c->inner is only touched
+     * again after the thread has exited */
+    pthread_mutex_lock(&c->mutex);
+    c->abort_request = 1;
+    pthread_cond_signal(&c->cond_thread);
+    pthread_mutex_unlock(&c->mutex);
+    pthread_join(c->thread, NULL);
+
+    pthread_mutex_destroy(&c->mutex);
+    pthread_cond_destroy(&c->cond_reader);
+    pthread_cond_destroy(&c->cond_thread);
+    av_fifo_free(c->fifo);
+    return url_close(c->inner);
+}
+
+URLProtocol ff_async_protocol = {
+    .name            = "async",
+    .url_open        = async_open,
+    .url_read        = async_read,
+    .url_seek        = async_seek,
+    .url_close       = async_close,
+    .priv_data_size  = sizeof(AsyncContext),
+    .priv_data_class = &async_class,
+};
@@ -609,8 +609,9 @@ typedef struct AVStream {
     int probe_packets;
 
     /**
-     * last packet in packet_buffer for this stream when muxing.
-     * used internally, NOT PART OF PUBLIC API, dont read or write from outside of libav*
+     * Unused, the packets waiting to be interleaved are kept in
+     * AVFormatContext.interleave_queue.
+     * NOT PART OF PUBLIC API
      */
     struct AVPacketList *last_in_packet_buffer;
 
@@ -779,6 +780,7 @@ typedef struct AVFormatContext {
 #define AVFMT_FLAG_NOFILLIN     0x0010 ///< Do not infer any values from other values, just return what is stored in the container
 #define AVFMT_FLAG_NOPARSE      0x0020 ///< Do not use AVParsers, you also must set AVFMT_FLAG_NOFILLIN as the fillin code works on frames and no parsing -> no frames. Also seeking to frames can not work if parsing to find frame boundaries has been disabled
 #define AVFMT_FLAG_RTP_HINT     0x0040 ///< Add RTP hinting to the output file
+#define AVFMT_FLAG_FASTPROBE    0x0080 ///< Make av_find_stream_info() trust the parameters and streams given by the container, and bound it by the input size as well as by the decoded data
 
     int loop_input;
 
@@ -872,6 +874,12 @@ typedef struct AVFormatContext {
      * - decoding: Unused.
      */
     int64_t start_time_realtime;
+
+    /**
+     * Packets waiting to be interleaved when muxing.
+     * NOT PART OF PUBLIC API
+     */
+    struct InterleaveQueue *interleave_queue;
 } AVFormatContext;
 
 typedef struct AVPacketList {
@@ -1119,6 +1127,12 @@ AVFormatContext *avformat_alloc_context(void);
  * The logical file position is not changed by this function;
  * examined packets may be buffered for later processing.
  *
+ * With AVFMT_FLAG_FASTPROBE set in ic->flags, the analysis stops as soon
+ * as the parameters of all the streams announced by the container are
+ * known, the frame rate of the container or of the codec is used as is,
+ * ic->probesize also bounds the data the demuxer skipped, and
+ * ic->max_analyze_duration also bounds the real time spent reading.
+ *
  * @param ic media file handle
  * @return >=0 if OK, AVERROR_xxx on error
  * @todo Let the user decide somehow what information is needed so that
@@ -1555,6 +1569,39 @@ int av_filename_number_test(const char *filename);
  */
 int avf_sdp_create(AVFormatContext *ac[], int n_files, char *buff, int size);
 
+/**
+ * Counters of the MPEG-TS demuxer about one PID of the transport stream.
+ * New fields may be added to the end with minor version bumps.
+ */
+typedef struct AVMpegTSPIDStats {
+    int64_t packets;        ///< number of TS packets received
+    int64_t cc_errors;      ///< number of continuity counter errors
+    int64_t pcrs;           ///< number of PCRs received
+    /**
+     * Difference between the last PCR and the PCR expected from its
+     * position at the average PCR rate of the PID, in 27 MHz units.
+     */
+    int64_t pcr_jitter;
+    int64_t pcr_jitter_max; ///< largest absolute value of pcr_jitter
+} AVMpegTSPIDStats;
+
+/**
+ * Get the counters of the MPEG-TS demuxer about one PID.
+ *
+ * All the PIDs of the transport stream are counted, including the ones
+ * of discarded programs, as the packets are read.
+ *
+ * @param s context opened with the mpegts or mpegtsraw demuxer
+ * @param pid PID, from 0 to 0x1fff
+ * @param stats set to the counters, valid until s is closed
+ * @return 0 on success, AVERROR(ENOENT) if no packet was received on the
+ *         PID, AVERROR(EINVAL) if s is not an MPEG-TS demuxer context or
+ *         pid is out of range, AVERROR(ENOSYS) if the MPEG-TS demuxer is
+ *         not compiled in
+ */
+int av_mpegts_get_pid_stats(AVFormatContext *s, int pid,
+                            const AVMpegTSPIDStats **stats);
+
 /**
  * Return a positive value if the given filename has one of the given
  * extensions, 0 otherwise.
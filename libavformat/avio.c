@@ -26,9 +26,13 @@
 #include "libavutil/opt.h"
 #include "os_support.h"
 #include "avformat.h"
+#include "avio_internal.h"
 #if CONFIG_NETWORK
 #include "network.h"
 #endif
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #if FF_API_URL_CLASS
 /** @name Logging context. */
@@ -214,7 +218,7 @@ static inline int retry_transfer_wrapper(URLContext *h, unsigned char *buf, int
 
     len = 0;
     while (len < size_min) {
-        if (url_interrupt_cb())
+        if (ff_check_interrupt())
             return AVERROR(EINTR);
         ret = transfer_func(h, buf+len, size-len);
         if (ret == AVERROR(EINTR))
@@ -341,6 +345,37 @@ void url_set_interrupt_cb(URLInterruptCB *interrupt_cb)
     url_interrupt_cb = interrupt_cb;
 }
 
+#if HAVE_PTHREADS
+static pthread_key_t  thread_abort_key;
+static pthread_once_t thread_abort_once = PTHREAD_ONCE_INIT;
+
+static void thread_abort_init(void)
+{
+    pthread_key_create(&thread_abort_key, NULL);
+}
+#endif
+
+void ff_url_set_thread_abort(int *abort_request)
+{
+#if HAVE_PTHREADS
+    pthread_once(&thread_abort_once, thread_abort_init);
+    pthread_setspecific(thread_abort_key, abort_request);
+#endif
+}
+
+int ff_check_interrupt(void)
+{
+#if HAVE_PTHREADS
+    volatile int *abort_request;
+
+    pthread_once(&thread_abort_once, thread_abort_init);
+    abort_request = pthread_getspecific(thread_abort_key);
+    if (abort_request && *abort_request)
+        return 1;
+#endif
+    return url_interrupt_cb();
+}
+
 int av_url_read_pause(URLContext *h, int pause)
 {
     if (!h->prot->url_read_pause)
@@ -659,6 +659,11 @@ void init_checksum(AVIOContext *s,
 /* udp.c */
 int udp_set_remote_url(URLContext *h, const char *uri);
 int udp_get_local_port(URLContext *h);
+/**
+ * Get the number of datagrams, and of their payload bytes, dropped so far
+ * because the receiving circular buffer (fifo_size option) was full.
+ */
+void udp_get_overrun(URLContext *h, int *count, int64_t *bytes);
 #if FF_API_UDP_GET_FILE
 int udp_get_file_handle(URLContext *h);
 #endif
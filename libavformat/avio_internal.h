@@ -40,8 +40,40 @@ int ffio_init_context(AVIOContext *s,
  */
 int ffio_read_partial(AVIOContext *s, unsigned char *buf, int size);
 
+/**
+ * Read size bytes from AVIOContext, without copying them if possible.
+ * @param buf buffer the data is copied to if it is not all available in
+ *            the AVIOContext buffer
+ * @param data set to the address of the data, which is either buf or a
+ *             pointer into the AVIOContext buffer, valid until the next
+ *             operation on s
+ * @return number of bytes read or AVERROR
+ */
+int ffio_read_indirect(AVIOContext *s, unsigned char *buf, int size,
+                       const unsigned char **data);
+
 void ffio_fill(AVIOContext *s, int b, int count);
 
+/**
+ * Make the URL functions called from the current thread give up with
+ * AVERROR(EINTR) once *abort_request is nonzero, as they do when the
+ * interrupt callback returns nonzero. This lets a protocol or demuxer
+ * stop a thread of its own that is blocked on the network without
+ * touching the URLContext the thread is using.
+ *
+ * @param abort_request flag to check, NULL to stop checking one
+ */
+void ff_url_set_thread_abort(int *abort_request);
+
+/**
+ * Check whether the current blocking operation should be aborted, either
+ * because the interrupt callback asks for it or because the abort flag of
+ * the calling thread is set.
+ *
+ * @return nonzero if the operation should be aborted
+ */
+int ff_check_interrupt(void);
+
 #define ffio_wfourcc(pb, str) avio_wl32(pb, MKTAG((str)[0], (str)[1], (str)[2], (str)[3]))
 
 #endif // AVFORMAT_AVIO_INTERNAL_H
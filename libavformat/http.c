@@ -36,6 +36,8 @@
 /* used for protocol handling */
 #define BUFFER_SIZE 1024
 #define MAX_REDIRECTS 8
+/* forward seeks up to this size are done by reading on the same connection */
+#define SHORT_SEEK_SIZE (64 * 1024)
 
 typedef struct {
     const AVClass *class;
@@ -49,6 +51,7 @@ typedef struct {
     HTTPAuthState auth_state;
     unsigned char headers[BUFFER_SIZE];
     int willclose;          /**< Set if the server correctly handles Connection: close and will close the connection after feeding us the content. */
+    int end_chunked_reached; /**< Set once the last chunk of a chunked response has been read. */
 } HTTPContext;
 
 #define OFFSET(x) offsetof(HTTPContext, x)
@@ -85,6 +88,20 @@ void ff_http_init_auth_state(URLContext *dest, const URLContext *src)
            &((HTTPContext*)src->priv_data)->auth_state, sizeof(HTTPAuthState));
 }
 
+/**
+ * Return non zero if the body of the current response has been read
+ * completely and the server keeps the connection open, so that it can
+ * carry another request.
+ */
+static int http_body_done(HTTPContext *s)
+{
+    if (!s->hd || s->willclose)
+        return 0;
+    if (s->chunksize >= 0)
+        return s->end_chunked_reached;
+    return s->filesize >= 0 && s->off >= s->filesize;
+}
+
 /* return non zero if error */
 static int http_open_cnx(URLContext *h)
 {
@@ -122,18 +139,23 @@ static int http_open_cnx(URLContext *h)
     if (port < 0)
         port = 80;
 
-    ff_url_join(buf, sizeof(buf), "tcp", NULL, hostname, port, NULL);
-    err = url_open(&hd, buf, URL_RDWR);
-    if (err < 0)
-        goto fail;
+    /* an idle persistent connection is reused as is */
+    if (!s->hd) {
+        ff_url_join(buf, sizeof(buf), "tcp", NULL, hostname, port, NULL);
+        err = url_open(&hd, buf, URL_RDWR);
+        if (err < 0)
+            goto fail;
+        s->hd = hd;
+    }
+    hd = s->hd;
 
-    s->hd = hd;
     cur_auth_type = s->auth_state.auth_type;
     if (http_connect(h, path, hoststr, auth, &location_changed) < 0)
         goto fail;
     if (s->http_code == 401) {
         if (cur_auth_type == HTTP_AUTH_NONE && s->auth_state.auth_type != HTTP_AUTH_NONE) {
             url_close(hd);
+            s->hd = NULL;
             goto redo;
         } else
             goto fail;
@@ -142,6 +164,7 @@ static int http_open_cnx(URLContext *h)
         && location_changed == 1) {
         /* url moved, get next */
         url_close(hd);
+        s->hd = NULL;
         if (redirects++ >= MAX_REDIRECTS)
             return AVERROR(EIO);
         location_changed = 0;
@@ -166,6 +189,34 @@ static int http_open(URLContext *h, const char *uri, int flags)
 
     return http_open_cnx(h);
 }
+
+int ff_http_do_new_request(URLContext *h, const char *uri)
+{
+    HTTPContext *s = h->priv_data;
+    char proto1[10], proto2[10], hostname1[1024], hostname2[1024];
+    int port1, port2;
+
+    if (!http_body_done(s))
+        return AVERROR(EINVAL);
+
+    av_url_split(proto1, sizeof(proto1), NULL, 0, hostname1, sizeof(hostname1),
+                 &port1, NULL, 0, s->location);
+    av_url_split(proto2, sizeof(proto2), NULL, 0, hostname2, sizeof(hostname2),
+                 &port2, NULL, 0, uri);
+    if (strcmp(proto1, proto2) || strcmp(hostname1, hostname2) || port1 != port2)
+        return AVERROR(EINVAL);
+
+    h->is_streamed = 1;
+    s->off = 0;
+    av_strlcpy(s->location, uri, sizeof(s->location));
+
+    /* The server may have closed the connection since the last request,
+     * in which case the second attempt goes over a new one. */
+    if (http_open_cnx(h) < 0 && http_open_cnx(h) < 0)
+        return AVERROR(EIO);
+    return 0;
+}
+
 static int http_getc(HTTPContext *s)
 {
     int len;
@@ -310,7 +361,8 @@ static int http_connect(URLContext *h, const char *path, const char *hoststr,
         len += av_strlcatf(headers + len, sizeof(headers) - len,
                            "Range: bytes=%"PRId64"-\r\n", s->off);
     if (!has_header(s->headers, "\r\nConnection: "))
-        len += av_strlcpy(headers + len, "Connection: close\r\n",
+        len += av_strlcpy(headers + len, post ? "Connection: close\r\n" :
+                                                "Connection: keep-alive\r\n",
                           sizeof(headers)-len);
     if (!has_header(s->headers, "\r\nHost: "))
         len += av_strlcatf(headers + len, sizeof(headers) - len,
@@ -342,6 +394,7 @@ static int http_connect(URLContext *h, const char *path, const char *hoststr,
     s->off = 0;
     s->filesize = -1;
     s->willclose = 0;
+    s->end_chunked_reached = 0;
     if (post) {
         /* Pretend that it did work. We didn't read any header yet, since
          * we've still to send the POST data, but the code calling this
@@ -375,7 +428,12 @@ static int http_read(URLContext *h, uint8_t *buf, int size)
     HTTPContext *s = h->priv_data;
     int len;
 
+    if (!s->hd)
+        return AVERROR(EIO);
+
     if (s->chunksize >= 0) {
+        if (s->end_chunked_reached)
+            return 0;
         if (!s->chunksize) {
             char line[32];
 
@@ -389,8 +447,16 @@ static int http_read(URLContext *h, uint8_t *buf, int size)
 
                 av_dlog(NULL, "Chunked encoding data size: %"PRId64"'\n", s->chunksize);
 
-                if (!s->chunksize)
+                if (!s->chunksize) {
+                    /* skip the trailer, up to the empty line ending the
+                     * response, so that the connection can be reused */
+                    do {
+                        if (http_get_line(s, line, sizeof(line)) < 0)
+                            return AVERROR(EIO);
+                    } while (*line);
+                    s->end_chunked_reached = 1;
                     return 0;
+                }
                 break;
             }
         }
@@ -473,14 +539,41 @@ static int64_t http_seek(URLContext *h, int64_t off, int whence)
     else if ((s->filesize == -1 && whence == SEEK_END) || h->is_streamed)
         return -1;
 
-    /* we save the old context in case the seek fails */
-    old_buf_size = s->buf_end - s->buf_ptr;
-    memcpy(old_buf, s->buf_ptr, old_buf_size);
-    s->hd = NULL;
     if (whence == SEEK_CUR)
         off += s->off;
     else if (whence == SEEK_END)
         off += s->filesize;
+
+    /* a short forward seek is cheaper done by reading than by a new request */
+    if (off > s->off && off - s->off <= SHORT_SEEK_SIZE && s->hd &&
+        (s->filesize < 0 || off <= s->filesize)) {
+        uint8_t buf[BUFFER_SIZE];
+        while (s->off < off) {
+            int len = http_read(h, buf, FFMIN(off - s->off, sizeof(buf)));
+            if (len <= 0)
+                break;
+        }
+        if (s->off == off)
+            return off;
+        /* the data is gone, the position can only be set by a new request */
+        old_off = s->off;
+    }
+
+    /* If the previous response has been read completely, the request can
+     * go over the same connection. The server may have closed it in the
+     * meantime, the request is then sent over a new one below. */
+    if (http_body_done(s)) {
+        s->off = off;
+        if (http_open_cnx(h) >= 0)
+            return off;
+        s->off = old_off;
+        old_hd = NULL;
+    }
+
+    /* we save the old context in case the seek fails */
+    old_buf_size = s->buf_end - s->buf_ptr;
+    memcpy(old_buf, s->buf_ptr, old_buf_size);
+    s->hd = NULL;
     s->off = off;
 
     /* if it fails, continue on old connection */
@@ -500,6 +593,8 @@ static int
 http_get_file_handle(URLContext *h)
 {
     HTTPContext *s = h->priv_data;
+    if (!s->hd)
+        return -1;
     return url_get_file_handle(s->hd);
 }
 
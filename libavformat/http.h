@@ -61,4 +61,17 @@ void ff_http_set_chunked_transfer_encoding(URLContext *h, int is_chunked);
  */
 void ff_http_init_auth_state(URLContext *dest, const URLContext *src);
 
+/**
+ * Send a new request for uri over the connection of h.
+ * The previous response must have been read completely, and uri must
+ * point at the same server as the previous request.
+ *
+ * @param h URL context for this HTTP connection
+ * @param uri the resource to request
+ * @return 0 on success, AVERROR(EINVAL) if the connection cannot carry
+ *         the request (h is left untouched), another negative AVERROR code
+ *         if the request failed
+ */
+int ff_http_do_new_request(URLContext *h, const char *uri);
+
 #endif /* AVFORMAT_HTTP_H */
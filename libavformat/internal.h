@@ -65,11 +65,31 @@ int ff_hex_to_data(uint8_t *data, const char *p);
 void ff_program_add_stream_index(AVFormatContext *ac, int progid, unsigned int idx);
 
 /**
- * Add packet to AVFormatContext->packet_buffer list, determining its
+ * Add packet to the interleaving queue of s, determining its
  * interleaved position using compare() function argument.
+ * compare(s, next, pkt) must return nonzero if pkt is to be output
+ * before next, packets that compare equal are output in the order they
+ * were added.
+ * @return 0 if OK, AVERROR_xxx otherwise
  */
-void ff_interleave_add_packet(AVFormatContext *s, AVPacket *pkt,
-                              int (*compare)(AVFormatContext *, AVPacket *, AVPacket *));
+int ff_interleave_add_packet(AVFormatContext *s, AVPacket *pkt,
+                             int (*compare)(AVFormatContext *, AVPacket *, AVPacket *));
+
+/**
+ * @return the number of streams with packets in the interleaving queue
+ */
+int ff_interleave_queued_streams(AVFormatContext *s);
+
+/**
+ * Take the first packet out of the interleaving queue.
+ * @return 1 if a packet was output, 0 if the queue is empty
+ */
+int ff_interleave_get_packet(AVFormatContext *s, AVPacket *out);
+
+/**
+ * Free the interleaving queue and the packets left in it.
+ */
+void ff_interleave_free(AVFormatContext *s);
 
 void ff_read_frame_flush(AVFormatContext *s);
 
@@ -32,6 +32,7 @@
 #include "libavcodec/put_bits.h"
 #include "internal.h"
 #include "libavutil/avstring.h"
+#include "libavutil/opt.h"
 
 #undef NDEBUG
 #include <assert.h>
@@ -89,7 +90,7 @@ static int mov_write_stsz_tag(AVIOContext *pb, MOVTrack *track)
         oldtst = tst;
         entries += track->cluster[i].entries;
     }
-    if (equalChunks) {
+    if (equalChunks && track->entry) {
         int sSize = track->cluster[0].size/track->cluster[0].entries;
         avio_wb32(pb, sSize); // sample size
         avio_wb32(pb, entries); // sample count
@@ -1382,7 +1383,7 @@ static int mov_write_mvhd_tag(AVIOContext *pb, MOVMuxContext *mov)
     int version;
 
     for (i=0; i<mov->nb_streams; i++) {
-        if(mov->tracks[i].entry > 0) {
+        if(mov->tracks[i].entry > 0 || mov->flags & FF_MOV_FLAG_FRAGMENT) {
             maxTrackLenTemp = av_rescale_rnd(mov->tracks[i].trackDuration,
                                              MOV_TIMESCALE,
                                              mov->tracks[i].timescale,
@@ -1752,6 +1753,30 @@ static int mov_write_uuidusmt_tag(AVIOContext *pb, AVFormatContext *s)
     return 0;
 }
 
+static int mov_write_trex_tag(AVIOContext *pb, MOVTrack *track)
+{
+    avio_wb32(pb, 0x20); /* size */
+    ffio_wfourcc(pb, "trex");
+    avio_wb32(pb, 0); /* version & flags */
+    avio_wb32(pb, track->trackID);
+    avio_wb32(pb, 1); /* default sample description index */
+    avio_wb32(pb, 0); /* default sample duration */
+    avio_wb32(pb, 0); /* default sample size */
+    avio_wb32(pb, 0); /* default sample flags */
+    return 0x20;
+}
+
+static int mov_write_mvex_tag(AVIOContext *pb, MOVMuxContext *mov)
+{
+    int64_t pos = url_ftell(pb);
+    int i;
+    avio_wb32(pb, 0); /* size */
+    ffio_wfourcc(pb, "mvex");
+    for (i = 0; i < mov->nb_streams; i++)
+        mov_write_trex_tag(pb, &mov->tracks[i]);
+    return updateSize(pb, pos);
+}
+
 static int mov_write_moov_tag(AVIOContext *pb, MOVMuxContext *mov,
                               AVFormatContext *s)
 {
@@ -1761,7 +1786,7 @@ static int mov_write_moov_tag(AVIOContext *pb, MOVMuxContext *mov,
     ffio_wfourcc(pb, "moov");
 
     for (i=0; i<mov->nb_streams; i++) {
-        if(mov->tracks[i].entry <= 0) continue;
+        if(mov->tracks[i].entry <= 0 && !(mov->flags & FF_MOV_FLAG_FRAGMENT)) continue;
 
         mov->tracks[i].time = mov->time;
         mov->tracks[i].trackID = i+1;
@@ -1783,10 +1808,12 @@ static int mov_write_moov_tag(AVIOContext *pb, MOVMuxContext *mov,
     mov_write_mvhd_tag(pb, mov);
     //mov_write_iods_tag(pb, mov);
     for (i=0; i<mov->nb_streams; i++) {
-        if(mov->tracks[i].entry > 0) {
+        if(mov->tracks[i].entry > 0 || mov->flags & FF_MOV_FLAG_FRAGMENT) {
             mov_write_trak_tag(pb, &(mov->tracks[i]), i < s->nb_streams ? s->streams[i] : NULL);
         }
     }
+    if (mov->flags & FF_MOV_FLAG_FRAGMENT)
+        mov_write_mvex_tag(pb, mov);
 
     if (mov->mode == MODE_PSP)
         mov_write_uuidusmt_tag(pb, s);
@@ -1807,6 +1834,184 @@ static int mov_write_mdat_tag(AVIOContext *pb, MOVMuxContext *mov)
     return 0;
 }
 
+static int mov_write_mfhd_tag(AVIOContext *pb, MOVMuxContext *mov)
+{
+    avio_wb32(pb, 0x10); /* size */
+    ffio_wfourcc(pb, "mfhd");
+    avio_wb32(pb, 0); /* version & flags */
+    avio_wb32(pb, mov->fragments + 1); /* sequence number */
+    return 0x10;
+}
+
+static int mov_write_tfhd_tag(AVIOContext *pb, MOVTrack *track, int64_t moof_pos)
+{
+    avio_wb32(pb, 0x18); /* size */
+    ffio_wfourcc(pb, "tfhd");
+    avio_w8(pb, 0); /* version */
+    avio_wb24(pb, MOV_TFHD_BASE_DATA_OFFSET); /* flags */
+    avio_wb32(pb, track->trackID);
+    avio_wb64(pb, moof_pos);
+    return 0x18;
+}
+
+static int mov_write_trun_tag(AVIOContext *pb, MOVTrack *track, int64_t data_offset)
+{
+    int64_t pos = url_ftell(pb);
+    int flags = MOV_TRUN_DATA_OFFSET | MOV_TRUN_SAMPLE_DURATION |
+                MOV_TRUN_SAMPLE_SIZE | MOV_TRUN_SAMPLE_FLAGS;
+    int i;
+
+    /* Readers expect composition offsets for all the samples of a track or
+     * for none of them, and video needs them as soon as one frame is
+     * reordered. */
+    if (track->enc->codec_type == AVMEDIA_TYPE_VIDEO)
+        flags |= MOV_TRUN_SAMPLE_CTS;
+
+    avio_wb32(pb, 0); /* size */
+    ffio_wfourcc(pb, "trun");
+    avio_w8(pb, 0); /* version */
+    avio_wb24(pb, flags);
+    avio_wb32(pb, track->entry); /* sample count */
+    avio_wb32(pb, data_offset);
+    for (i = 0; i < track->entry; i++) {
+        int64_t duration = i + 1 == track->entry ?
+            track->frag_dts - track->cluster[i].dts :
+            track->cluster[i+1].dts - track->cluster[i].dts;
+        avio_wb32(pb, duration);
+        avio_wb32(pb, track->cluster[i].size);
+        if (track->enc->codec_type != AVMEDIA_TYPE_VIDEO ||
+            track->cluster[i].flags & MOV_SYNC_SAMPLE)
+            avio_wb32(pb, MOV_FRAG_SAMPLE_FLAG_DEPENDS_NO);
+        else
+            avio_wb32(pb, MOV_FRAG_SAMPLE_FLAG_DEPENDS_YES |
+                          MOV_FRAG_SAMPLE_FLAG_IS_NON_SYNC);
+        if (flags & MOV_TRUN_SAMPLE_CTS)
+            avio_wb32(pb, track->cluster[i].cts);
+    }
+    return updateSize(pb, pos);
+}
+
+static int mov_write_traf_tag(AVIOContext *pb, MOVTrack *track,
+                              int64_t moof_pos, int64_t data_offset)
+{
+    int64_t pos = url_ftell(pb);
+    avio_wb32(pb, 0); /* size */
+    ffio_wfourcc(pb, "traf");
+    mov_write_tfhd_tag(pb, track, moof_pos);
+    mov_write_trun_tag(pb, track, data_offset);
+    return updateSize(pb, pos);
+}
+
+/* data_offset is the offset of the first sample from the start of the moof */
+static int mov_write_moof_tag(AVIOContext *pb, MOVMuxContext *mov,
+                              int64_t moof_pos, int64_t data_offset)
+{
+    int64_t pos = url_ftell(pb);
+    int i;
+    avio_wb32(pb, 0); /* size */
+    ffio_wfourcc(pb, "moof");
+    mov_write_mfhd_tag(pb, mov);
+    for (i = 0; i < mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        if (!track->entry)
+            continue;
+        mov_write_traf_tag(pb, track, moof_pos, data_offset);
+        data_offset += url_ftell(track->mdat_buf);
+    }
+    return updateSize(pb, pos);
+}
+
+/* Copy the contents of a dynamic buffer to pb and free it. */
+static void mov_write_dyn_buf(AVIOContext *pb, AVIOContext *dyn_buf)
+{
+    uint8_t *buf;
+    int size = url_close_dyn_buf(dyn_buf, &buf);
+    avio_write(pb, buf, size);
+    av_free(buf);
+}
+
+/**
+ * Write the samples buffered since the previous fragment as a moof/mdat pair.
+ *
+ * @param next the packet that is about to start the next fragment, NULL if
+ *             there is none
+ */
+static int mov_flush_fragment(AVFormatContext *s, AVPacket *next)
+{
+    MOVMuxContext *mov = s->priv_data;
+    AVIOContext *pb = s->pb;
+    AVIOContext *moof_buf;
+    uint8_t *buf;
+    int64_t moof_pos = url_ftell(pb);
+    int64_t mdat_size = 0;
+    int i, ret, moof_size, mdat_header_size;
+
+    for (i = 0; i < mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        int64_t end_dts, dts;
+        int j;
+
+        if (!track->entry)
+            continue;
+        end_dts = next && next->stream_index == i ? next->dts :
+                  track->cluster[0].dts + track->trackDuration;
+
+        /* Fragments do not store the dts of their first sample, readers
+         * derive it from the durations of all the samples before it, and the
+         * duration of the last sample of the previous fragment may only have
+         * been a guess. Rebase the dts onto what a reader will see, and move
+         * the difference into the composition offset so that the video pts
+         * stay exact. Readers need strictly increasing dts. */
+        dts = track->frag_dts;
+        for (j = 0; j < track->entry; j++) {
+            if (j)
+                dts = FFMAX(track->cluster[j].dts, dts + 1);
+            track->cluster[j].cts += track->cluster[j].dts - dts;
+            track->cluster[j].dts  = dts;
+        }
+        track->frag_dts = FFMAX(end_dts, dts + 1);
+
+        mdat_size += url_ftell(track->mdat_buf);
+    }
+    if (!mdat_size)
+        return 0;
+    mdat_header_size = mdat_size + 8 <= UINT32_MAX ? 8 : 16;
+
+    /* the moof size is needed for the data offsets it contains */
+    if ((ret = url_open_dyn_buf(&moof_buf)) < 0)
+        return ret;
+    mov_write_moof_tag(moof_buf, mov, moof_pos, 0);
+    moof_size = url_close_dyn_buf(moof_buf, &buf);
+    av_free(buf);
+
+    if ((ret = url_open_dyn_buf(&moof_buf)) < 0)
+        return ret;
+    mov_write_moof_tag(moof_buf, mov, moof_pos, moof_size + mdat_header_size);
+    mov_write_dyn_buf(pb, moof_buf);
+
+    if (mdat_header_size == 8) {
+        avio_wb32(pb, mdat_size + 8);
+        ffio_wfourcc(pb, "mdat");
+    } else {
+        avio_wb32(pb, 1); /* size is stored in the 64 bit field below */
+        ffio_wfourcc(pb, "mdat");
+        avio_wb64(pb, mdat_size + 16);
+    }
+    for (i = 0; i < mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        if (!track->entry)
+            continue;
+        mov_write_dyn_buf(pb, track->mdat_buf);
+        track->mdat_buf = NULL;
+        track->entry = 0;
+    }
+
+    mov->fragments++;
+    mov->mdat_size = 0;
+    put_flush_packet(pb);
+    return 0;
+}
+
 /* TODO: This needs to be more general */
 static int mov_write_ftyp_tag(AVIOContext *pb, AVFormatContext *s)
 {
@@ -1954,10 +2159,31 @@ int ff_mov_write_packet(AVFormatContext *s, AVPacket *pkt)
     AVCodecContext *enc = trk->enc;
     unsigned int samplesInChunk = 0;
     int size= pkt->size;
+    int ret;
 
-    if (url_is_streamed(s->pb)) return 0; /* Can't handle that */
+    if (url_is_streamed(s->pb) && !(mov->flags & FF_MOV_FLAG_FRAGMENT))
+        return 0; /* Can't handle that */
     if (!size) return 0; /* Discard 0 sized packets */
 
+    if (mov->flags & FF_MOV_FLAG_FRAGMENT) {
+        if ((mov->max_fragment_duration && trk->entry &&
+             av_rescale(pkt->dts - trk->cluster[0].dts, AV_TIME_BASE,
+                        trk->timescale) >= mov->max_fragment_duration) ||
+            (mov->max_fragment_size &&
+             mov->mdat_size + size >= mov->max_fragment_size) ||
+            (mov->flags & FF_MOV_FLAG_FRAG_KEYFRAME &&
+             enc->codec_type == AVMEDIA_TYPE_VIDEO &&
+             trk->entry && pkt->flags & AV_PKT_FLAG_KEY)) {
+            if ((ret = mov_flush_fragment(s, pkt)) < 0)
+                return ret;
+        }
+        if (!trk->mdat_buf && (ret = url_open_dyn_buf(&trk->mdat_buf)) < 0)
+            return ret;
+        if (!trk->sampleCount)
+            trk->frag_dts = pkt->dts;
+        pb = trk->mdat_buf;
+    }
+
     if (enc->codec_id == CODEC_ID_AMR_NB) {
         /* We must find out how many AMR blocks there are in one packet */
         static uint16_t packed_size[16] =
@@ -2090,11 +2316,23 @@ static int mov_write_header(AVFormatContext *s)
     MOVMuxContext *mov = s->priv_data;
     int i, hint_track = 0;
 
-    if (url_is_streamed(s->pb)) {
+    if (mov->max_fragment_duration || mov->max_fragment_size ||
+        mov->flags & FF_MOV_FLAG_FRAG_KEYFRAME)
+        mov->flags |= FF_MOV_FLAG_FRAGMENT;
+
+    /* Fragments are written in one go, only the plain layout needs to go
+     * back and fill in the mdat size. */
+    if (url_is_streamed(s->pb) && !(mov->flags & FF_MOV_FLAG_FRAGMENT)) {
         av_log(s, AV_LOG_ERROR, "muxer does not support non seekable output\n");
         return -1;
     }
 
+    if (mov->flags & FF_MOV_FLAG_FRAGMENT &&
+        s->flags & AVFMT_FLAG_RTP_HINT) {
+        av_log(s, AV_LOG_ERROR, "RTP hinting is not supported in fragmented mode\n");
+        return -1;
+    }
+
     /* Default mode == MP4 */
     mov->mode = MODE_MP4;
 
@@ -2116,7 +2354,8 @@ static int mov_write_header(AVFormatContext *s)
     }
 
     mov->nb_streams = s->nb_streams;
-    if (mov->mode & (MODE_MOV|MODE_IPOD) && s->nb_chapters)
+    if (mov->mode & (MODE_MOV|MODE_IPOD) && s->nb_chapters &&
+        !(mov->flags & FF_MOV_FLAG_FRAGMENT))
         mov->chapter_track = mov->nb_streams++;
 
     if (s->flags & AVFMT_FLAG_RTP_HINT) {
@@ -2206,11 +2445,43 @@ static int mov_write_header(AVFormatContext *s)
         if (!track->height)
             track->height = st->codec->height;
 
+        if (mov->flags & FF_MOV_FLAG_FRAGMENT) {
+            /* The sample descriptions go into the moov written below, so
+             * they cannot be taken from the first packet. */
+            if (st->codec->codec_id == CODEC_ID_DNXHD ||
+                st->codec->codec_id == CODEC_ID_AC3) {
+                av_log(s, AV_LOG_ERROR, "track %d: codec not supported in "
+                       "fragmented mode\n", i);
+                goto error;
+            }
+            if (st->codec->codec_id == CODEC_ID_H264 &&
+                !st->codec->extradata_size) {
+                av_log(s, AV_LOG_ERROR, "track %d: fragmented mode needs "
+                       "the codec global header\n", i);
+                goto error;
+            }
+            if (st->codec->extradata_size) {
+                track->vosLen  = st->codec->extradata_size;
+                track->vosData = av_malloc(track->vosLen);
+                if (!track->vosData)
+                    goto error;
+                memcpy(track->vosData, st->codec->extradata, track->vosLen);
+            }
+        }
+
         av_set_pts_info(st, 64, 1, track->timescale);
     }
 
-    mov_write_mdat_tag(pb, mov);
     mov->time = s->timestamp + 0x7C25B080; //1970 based -> 1904 based
+    if (mov->flags & FF_MOV_FLAG_FRAGMENT) {
+        /* an empty moov, all the samples go into fragments */
+        AVIOContext *moov_buf;
+        if (url_open_dyn_buf(&moov_buf) < 0)
+            goto error;
+        mov_write_moov_tag(moov_buf, mov, s);
+        mov_write_dyn_buf(pb, moov_buf);
+    } else
+        mov_write_mdat_tag(pb, mov);
 
     if (mov->chapter_track)
         mov_create_chapter_track(s, mov->chapter_track);
@@ -2231,6 +2502,8 @@ static int mov_write_header(AVFormatContext *s)
 
     return 0;
  error:
+    for (i = 0; i < s->nb_streams; i++)
+        av_freep(&mov->tracks[i].vosData);
     av_freep(&mov->tracks);
     return -1;
 }
@@ -2244,20 +2517,24 @@ static int mov_write_trailer(AVFormatContext *s)
 
     int64_t moov_pos = url_ftell(pb);
 
-    /* Write size of mdat tag */
-    if (mov->mdat_size+8 <= UINT32_MAX) {
-        avio_seek(pb, mov->mdat_pos, SEEK_SET);
-        avio_wb32(pb, mov->mdat_size+8);
+    if (mov->flags & FF_MOV_FLAG_FRAGMENT) {
+        res = mov_flush_fragment(s, NULL);
     } else {
-        /* overwrite 'wide' placeholder atom */
-        avio_seek(pb, mov->mdat_pos - 8, SEEK_SET);
-        avio_wb32(pb, 1); /* special value: real atom size will be 64 bit value after tag field */
-        ffio_wfourcc(pb, "mdat");
-        avio_wb64(pb, mov->mdat_size+16);
-    }
-    avio_seek(pb, moov_pos, SEEK_SET);
+        /* Write size of mdat tag */
+        if (mov->mdat_size+8 <= UINT32_MAX) {
+            avio_seek(pb, mov->mdat_pos, SEEK_SET);
+            avio_wb32(pb, mov->mdat_size+8);
+        } else {
+            /* overwrite 'wide' placeholder atom */
+            avio_seek(pb, mov->mdat_pos - 8, SEEK_SET);
+            avio_wb32(pb, 1); /* special value: real atom size will be 64 bit value after tag field */
+            ffio_wfourcc(pb, "mdat");
+            avio_wb64(pb, mov->mdat_size+16);
+        }
+        avio_seek(pb, moov_pos, SEEK_SET);
 
-    mov_write_moov_tag(pb, mov, s);
+        mov_write_moov_tag(pb, mov, s);
+    }
 
     if (mov->chapter_track)
         av_freep(&mov->tracks[mov->chapter_track].enc);
@@ -2269,6 +2546,12 @@ static int mov_write_trailer(AVFormatContext *s)
 
         if(mov->tracks[i].vosLen) av_free(mov->tracks[i].vosData);
 
+        if (mov->tracks[i].mdat_buf) {
+            uint8_t *buf;
+            url_close_dyn_buf(mov->tracks[i].mdat_buf, &buf);
+            av_free(buf);
+        }
+
     }
 
     put_flush_packet(pb);
@@ -2278,6 +2561,21 @@ static int mov_write_trailer(AVFormatContext *s)
     return res;
 }
 
+static const AVOption options[] = {
+    { "movflags", "MOV muxer flags", offsetof(MOVMuxContext, flags), FF_OPT_TYPE_FLAGS, 0, INT_MIN, INT_MAX, AV_OPT_FLAG_ENCODING_PARAM, "movflags" },
+    { "frag_keyframe", "Fragment at video keyframes", 0, FF_OPT_TYPE_CONST, FF_MOV_FLAG_FRAG_KEYFRAME, INT_MIN, INT_MAX, AV_OPT_FLAG_ENCODING_PARAM, "movflags" },
+    { "frag_duration", "Maximum fragment duration in microseconds", offsetof(MOVMuxContext, max_fragment_duration), FF_OPT_TYPE_INT, 0, 0, INT_MAX, AV_OPT_FLAG_ENCODING_PARAM },
+    { "frag_size", "Maximum fragment size in bytes", offsetof(MOVMuxContext, max_fragment_size), FF_OPT_TYPE_INT, 0, 0, INT_MAX, AV_OPT_FLAG_ENCODING_PARAM },
+    { NULL },
+};
+
+static const AVClass mov_muxer_class = {
+    "MOV/3GP/MP4/3G2 muxer",
+    av_default_item_name,
+    options,
+    LIBAVUTIL_VERSION_INT,
+};
+
 #if CONFIG_MOV_MUXER
 AVOutputFormat ff_mov_muxer = {
     "mov",
@@ -2291,6 +2589,7 @@ AVOutputFormat ff_mov_muxer = {
     ff_mov_write_packet,
     mov_write_trailer,
     .flags = AVFMT_GLOBALHEADER,
+    .priv_class = &mov_muxer_class,
     .codec_tag = (const AVCodecTag* const []){codec_movvideo_tags, codec_movaudio_tags, 0},
 };
 #endif
@@ -2307,6 +2606,7 @@ AVOutputFormat ff_tgp_muxer = {
     ff_mov_write_packet,
     mov_write_trailer,
     .flags = AVFMT_GLOBALHEADER,
+    .priv_class = &mov_muxer_class,
     .codec_tag = (const AVCodecTag* const []){codec_3gp_tags, 0},
 };
 #endif
@@ -2323,6 +2623,7 @@ AVOutputFormat ff_mp4_muxer = {
     ff_mov_write_packet,
     mov_write_trailer,
     .flags = AVFMT_GLOBALHEADER,
+    .priv_class = &mov_muxer_class,
     .codec_tag = (const AVCodecTag* const []){ff_mp4_obj_type, 0},
 };
 #endif
@@ -2339,6 +2640,7 @@ AVOutputFormat ff_psp_muxer = {
     ff_mov_write_packet,
     mov_write_trailer,
     .flags = AVFMT_GLOBALHEADER,
+    .priv_class = &mov_muxer_class,
     .codec_tag = (const AVCodecTag* const []){ff_mp4_obj_type, 0},
 };
 #endif
@@ -2355,6 +2657,7 @@ AVOutputFormat ff_tg2_muxer = {
     ff_mov_write_packet,
     mov_write_trailer,
     .flags = AVFMT_GLOBALHEADER,
+    .priv_class = &mov_muxer_class,
     .codec_tag = (const AVCodecTag* const []){codec_3gp_tags, 0},
 };
 #endif
@@ -2371,6 +2674,7 @@ AVOutputFormat ff_ipod_muxer = {
     ff_mov_write_packet,
     mov_write_trailer,
     .flags = AVFMT_GLOBALHEADER,
+    .priv_class = &mov_muxer_class,
     .codec_tag = (const AVCodecTag* const []){codec_ipod_tags, 0},
 };
 #endif
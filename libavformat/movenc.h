@@ -51,6 +51,18 @@ typedef struct MOVIentry {
     uint32_t     flags;
 } MOVIentry;
 
+#define MOV_TFHD_BASE_DATA_OFFSET 0x01
+
+#define MOV_TRUN_DATA_OFFSET      0x001
+#define MOV_TRUN_SAMPLE_DURATION  0x100
+#define MOV_TRUN_SAMPLE_SIZE      0x200
+#define MOV_TRUN_SAMPLE_FLAGS     0x400
+#define MOV_TRUN_SAMPLE_CTS       0x800
+
+#define MOV_FRAG_SAMPLE_FLAG_DEPENDS_NO     0x02000000
+#define MOV_FRAG_SAMPLE_FLAG_DEPENDS_YES    0x01000000
+#define MOV_FRAG_SAMPLE_FLAG_IS_NON_SYNC    0x00010000
+
 typedef struct HintSample {
     uint8_t *data;
     int size;
@@ -98,9 +110,13 @@ typedef struct MOVIndex {
     uint32_t    max_packet_size;
 
     HintSampleQueue sample_queue;
+
+    AVIOContext *mdat_buf;    ///< sample data of the current fragment
+    int64_t     frag_dts;     ///< dts a reader derives for the next sample written in a fragment
 } MOVTrack;
 
 typedef struct MOVMuxContext {
+    const AVClass *av_class;
     int     mode;
     int64_t time;
     int     nb_streams;
@@ -108,8 +124,16 @@ typedef struct MOVMuxContext {
     int64_t mdat_pos;
     uint64_t mdat_size;
     MOVTrack *tracks;
+
+    int flags;
+    int fragments;             ///< number of fragments written so far
+    int max_fragment_duration; ///< in AV_TIME_BASE units, 0 for no limit
+    int max_fragment_size;     ///< in bytes, 0 for no limit
 } MOVMuxContext;
 
+#define FF_MOV_FLAG_FRAG_KEYFRAME 0x0001
+#define FF_MOV_FLAG_FRAGMENT      0x0002 ///< set by the muxer when any fragmentation option is in use
+
 int ff_mov_write_packet(AVFormatContext *s, AVPacket *pkt);
 
 int ff_mov_init_hinting(AVFormatContext *s, int index, int src_index);
@@ -85,6 +85,16 @@ struct Program {
     unsigned int pids[MAX_PIDS_PER_PROGRAM];
 };
 
+typedef struct PIDStats {
+    AVMpegTSPIDStats pub;
+    int last_cc;                /**< last continuity counter, -1 if none */
+    int cc_duplicates;          /**< number of times last_cc was repeated */
+    int64_t pcr_ref;            /**< first PCR since the last discontinuity */
+    int64_t pcr_ref_index;      /**< packet_count at pcr_ref, -1 if none */
+    int64_t pcr_last;
+    int64_t pcr_last_index;
+} PIDStats;
+
 struct MpegTSContext {
     /* user data */
     AVFormatContext *stream;
@@ -120,6 +130,19 @@ struct MpegTSContext {
 
     /** filters for various streams specified by PMT + for the PAT and PMT */
     MpegTSFilter *pids[NB_PID_MAX];
+
+    /** pids only found in discarded programs, one bit per pid */
+    uint8_t discard_pids[NB_PID_MAX / 8];
+    /** set if the programs changed since discard_pids was computed */
+    int discard_pids_dirty;
+    /** discard value of each program when discard_pids was computed */
+    enum AVDiscard *programs_discard;
+    int nb_programs_discard;
+
+    /** number of TS packets handled, clock of the PCR jitter measures */
+    int64_t packet_count;
+    /** statistics of each pid, allocated with its first packet */
+    PIDStats *pid_stats[NB_PID_MAX];
 };
 
 /* TS stream handling */
@@ -155,9 +178,12 @@ typedef struct PESContext {
     int64_t ts_packet_pos; /**< position of first TS packet of this PES packet */
     uint8_t header[MAX_PES_HEADER_SIZE];
     uint8_t *buffer;
+    int buffer_size;            /**< allocated size of buffer, padding excluded */
+    int max_unbounded_size;     /**< largest payload of the PES packets with no size */
 } PESContext;
 
 extern AVInputFormat ff_mpegts_demuxer;
+extern AVInputFormat ff_mpegtsraw_demuxer;
 
 static void clear_program(MpegTSContext *ts, unsigned int programid)
 {
@@ -166,12 +192,14 @@ static void clear_program(MpegTSContext *ts, unsigned int programid)
     for(i=0; i<ts->nb_prg; i++)
         if(ts->prg[i].id == programid)
             ts->prg[i].nb_pids = 0;
+    ts->discard_pids_dirty = 1;
 }
 
 static void clear_programs(MpegTSContext *ts)
 {
     av_freep(&ts->prg);
     ts->nb_prg=0;
+    ts->discard_pids_dirty = 1;
 }
 
 static void add_pat_entry(MpegTSContext *ts, unsigned int programid)
@@ -185,6 +213,7 @@ static void add_pat_entry(MpegTSContext *ts, unsigned int programid)
     p->id = programid;
     p->nb_pids = 0;
     ts->nb_prg++;
+    ts->discard_pids_dirty = 1;
 }
 
 static void add_pid_to_pmt(MpegTSContext *ts, unsigned int programid, unsigned int pid)
@@ -203,39 +232,60 @@ static void add_pid_to_pmt(MpegTSContext *ts, unsigned int programid, unsigned i
     if(p->nb_pids >= MAX_PIDS_PER_PROGRAM)
         return;
     p->pids[p->nb_pids++] = pid;
+    ts->discard_pids_dirty = 1;
 }
 
 /**
- * \brief discard_pid() decides if the pid is to be discarded according
- *                      to caller's programs selection
- * \param ts    : - TS context
- * \param pid   : - pid
- * \return 1 if the pid is only comprised in programs that have .discard=AVDISCARD_ALL
- *         0 otherwise
+ * Compute the pids to discard according to the caller's programs
+ * selection: the pids only comprised in programs that have
+ * .discard=AVDISCARD_ALL.
  */
-static int discard_pid(MpegTSContext *ts, unsigned int pid)
+static void update_discard_pids(MpegTSContext *ts)
 {
+    AVFormatContext *s = ts->stream;
+    uint8_t used[NB_PID_MAX / 8] = { 0 };
+    enum AVDiscard *programs_discard;
     int i, j, k;
-    int used = 0, discarded = 0;
-    struct Program *p;
+
+    memset(ts->discard_pids, 0, sizeof(ts->discard_pids));
     for(i=0; i<ts->nb_prg; i++) {
-        p = &ts->prg[i];
-        for(j=0; j<p->nb_pids; j++) {
-            if(p->pids[j] != pid)
+        struct Program *p = &ts->prg[i];
+        for(k=0; k<s->nb_programs; k++) {
+            uint8_t *map;
+            if(s->programs[k]->id != p->id)
                 continue;
-            //is program with id p->id set to be discarded?
-            for(k=0; k<ts->stream->nb_programs; k++) {
-                if(ts->stream->programs[k]->id == p->id) {
-                    if(ts->stream->programs[k]->discard == AVDISCARD_ALL)
-                        discarded++;
-                    else
-                        used++;
-                }
-            }
+            map = s->programs[k]->discard == AVDISCARD_ALL ? ts->discard_pids : used;
+            for(j=0; j<p->nb_pids; j++)
+                map[p->pids[j] >> 3] |= 1 << (p->pids[j] & 7);
         }
     }
+    for(i=0; i<sizeof(used); i++)
+        ts->discard_pids[i] &= ~used[i];
 
-    return !used && discarded;
+    programs_discard = av_realloc(ts->programs_discard,
+                                  s->nb_programs * sizeof(*programs_discard));
+    if(!programs_discard && s->nb_programs)
+        return;
+    ts->programs_discard = programs_discard;
+    ts->nb_programs_discard = s->nb_programs;
+    for(k=0; k<s->nb_programs; k++)
+        programs_discard[k] = s->programs[k]->discard;
+    ts->discard_pids_dirty = 0;
+}
+
+/* the caller may change the programs selection between two reads */
+static void check_programs_discard(MpegTSContext *ts)
+{
+    AVFormatContext *s = ts->stream;
+    int k;
+
+    if(s->nb_programs != ts->nb_programs_discard) {
+        ts->discard_pids_dirty = 1;
+        return;
+    }
+    for(k=0; k<s->nb_programs; k++)
+        if(s->programs[k]->discard != ts->programs_discard[k])
+            ts->discard_pids_dirty = 1;
 }
 
 /**
@@ -600,10 +650,34 @@ static int mpegts_set_stream_info(AVStream *st, PESContext *pes,
     return 0;
 }
 
+/* allocate a payload buffer of size bytes or enlarge the current one */
+static int alloc_pes_buffer(PESContext *pes, int size)
+{
+    uint8_t *buf = av_realloc(pes->buffer, size + FF_INPUT_BUFFER_PADDING_SIZE);
+
+    if (!buf)
+        return AVERROR(ENOMEM);
+    pes->buffer      = buf;
+    pes->buffer_size = size;
+    return 0;
+}
+
+/* allocate the payload buffer of a new PES packet, packets with no size
+   get room for the largest one received so far and grow if needed */
+static int new_pes_buffer(PESContext *pes)
+{
+    if (pes->total_size == MAX_PES_PAYLOAD)
+        return alloc_pes_buffer(pes, FFMAX(pes->max_unbounded_size, 4096));
+    return alloc_pes_buffer(pes, pes->total_size);
+}
+
 static void new_pes_packet(PESContext *pes, AVPacket *pkt)
 {
     av_init_packet(pkt);
 
+    if (pes->total_size == MAX_PES_PAYLOAD)
+        pes->max_unbounded_size = FFMAX(pes->max_unbounded_size, pes->data_index);
+
     pkt->destruct = av_destruct_packet;
     pkt->data = pes->buffer;
     pkt->size = pes->data_index;
@@ -623,6 +697,7 @@ static void new_pes_packet(PESContext *pes, AVPacket *pkt)
     pes->pts = AV_NOPTS_VALUE;
     pes->dts = AV_NOPTS_VALUE;
     pes->buffer = NULL;
+    pes->buffer_size = 0;
     pes->data_index = 0;
 }
 
@@ -695,8 +770,7 @@ static int mpegts_push_data(MpegTSFilter *filter,
                         pes->total_size = MAX_PES_PAYLOAD;
 
                     /* allocate pes buffer */
-                    pes->buffer = av_malloc(pes->total_size+FF_INPUT_BUFFER_PADDING_SIZE);
-                    if (!pes->buffer)
+                    if (new_pes_buffer(pes) < 0)
                         return AVERROR(ENOMEM);
 
                     if (code != 0x1bc && code != 0x1bf && /* program_stream_map, private_stream_2 */
@@ -791,8 +865,7 @@ static int mpegts_push_data(MpegTSFilter *filter,
                 if (pes->data_index > 0 && pes->data_index+buf_size > pes->total_size) {
                     new_pes_packet(pes, ts->pkt);
                     pes->total_size = MAX_PES_PAYLOAD;
-                    pes->buffer = av_malloc(pes->total_size+FF_INPUT_BUFFER_PADDING_SIZE);
-                    if (!pes->buffer)
+                    if (new_pes_buffer(pes) < 0)
                         return AVERROR(ENOMEM);
                     ts->stop_parse = 1;
                 } else if (pes->data_index == 0 && buf_size > pes->total_size) {
@@ -800,6 +873,11 @@ static int mpegts_push_data(MpegTSFilter *filter,
                     // not sure if this is legal in ts but see issue #2392
                     buf_size = pes->total_size;
                 }
+                if (pes->data_index + buf_size > pes->buffer_size &&
+                    alloc_pes_buffer(pes, FFMIN(FFMAX(2 * pes->buffer_size,
+                                                      pes->data_index + buf_size),
+                                                pes->total_size)) < 0)
+                    return AVERROR(ENOMEM);
                 memcpy(pes->buffer+pes->data_index, p, buf_size);
                 pes->data_index += buf_size;
             }
@@ -1223,7 +1301,89 @@ static void sdt_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
     }
 }
 
-/* handle one TS packet */
+static int parse_pcr(int64_t *ppcr_high, int *ppcr_low,
+                     const uint8_t *packet)
+{
+    int afc, len, flags;
+    const uint8_t *p;
+    unsigned int v;
+
+    afc = (packet[3] >> 4) & 3;
+    if (afc <= 1)
+        return -1;
+    p = packet + 4;
+    len = p[0];
+    p++;
+    if (len == 0)
+        return -1;
+    flags = *p++;
+    len--;
+    if (!(flags & 0x10))
+        return -1;
+    if (len < 6)
+        return -1;
+    v = AV_RB32(p);
+    *ppcr_high = ((int64_t)v << 1) | (p[4] >> 7);
+    *ppcr_low = ((p[4] & 1) << 8) | p[5];
+    return 0;
+}
+
+/* PCRs further apart than that are taken as a discontinuity */
+#define PCR_MAX_GAP (27000000LL)
+
+static void update_pid_stats(MpegTSContext *ts, int pid, const uint8_t *packet)
+{
+    PIDStats *st = ts->pid_stats[pid];
+    int cc = packet[3] & 0xf, afc = (packet[3] >> 4) & 3;
+    int discontinuity = (afc & 2) && packet[4] && (packet[5] & 0x80);
+    int64_t pcr_h, pcr;
+    int pcr_l;
+
+    if (!st) {
+        st = ts->pid_stats[pid] = av_mallocz(sizeof(*st));
+        if (!st)
+            return;
+        st->last_cc       = -1;
+        st->pcr_ref_index = -1;
+    }
+    st->pub.packets++;
+
+    /* the counter is only incremented by packets with a payload, which
+       may be sent twice; it is meaningless for null packets */
+    if (pid != 0x1fff && st->last_cc >= 0 && !discontinuity) {
+        if ((afc & 1) && cc == st->last_cc) {
+            if (st->cc_duplicates++)
+                st->pub.cc_errors++;
+        } else {
+            st->cc_duplicates = 0;
+            if (cc != ((afc & 1) ? (st->last_cc + 1) & 0xf : st->last_cc))
+                st->pub.cc_errors++;
+        }
+    }
+    st->last_cc = cc;
+
+    if (parse_pcr(&pcr_h, &pcr_l, packet) < 0)
+        return;
+    pcr = pcr_h * 300 + pcr_l;
+    st->pub.pcrs++;
+    if (discontinuity || st->pcr_ref_index < 0 ||
+        pcr < st->pcr_last || pcr - st->pcr_last > PCR_MAX_GAP) {
+        st->pcr_ref       = pcr;
+        st->pcr_ref_index = ts->packet_count;
+    } else if (st->pcr_last_index > st->pcr_ref_index) {
+        /* compare to the PCR expected at the average rate of the pid */
+        int64_t expected = st->pcr_last +
+            av_rescale(ts->packet_count      - st->pcr_last_index,
+                       st->pcr_last          - st->pcr_ref,
+                       st->pcr_last_index    - st->pcr_ref_index);
+        st->pub.pcr_jitter = pcr - expected;
+        st->pub.pcr_jitter_max = FFMAX(st->pub.pcr_jitter_max,
+                                       FFABS(st->pub.pcr_jitter));
+    }
+    st->pcr_last       = pcr;
+    st->pcr_last_index = ts->packet_count;
+}
+
 static int handle_packet(MpegTSContext *ts, const uint8_t *packet)
 {
     AVFormatContext *s = ts->stream;
@@ -1233,7 +1393,11 @@ static int handle_packet(MpegTSContext *ts, const uint8_t *packet)
     int64_t pos;
 
     pid = AV_RB16(packet + 1) & 0x1fff;
-    if(pid && discard_pid(ts, pid))
+    ts->packet_count++;
+    update_pid_stats(ts, pid, packet);
+    if (ts->discard_pids_dirty)
+        update_discard_pids(ts);
+    if (pid && (ts->discard_pids[pid >> 3] & (1 << (pid & 7))))
         return 0;
     is_start = packet[1] & 0x40;
     tss = ts->pids[pid];
@@ -1325,18 +1489,21 @@ static int mpegts_resync(AVFormatContext *s)
     return -1;
 }
 
-/* return -1 if error or EOF. Return 0 if OK. */
-static int read_packet(AVFormatContext *s, uint8_t *buf, int raw_packet_size)
+/* return -1 if error or EOF. Return 0 if OK. The packet is read in place
+   from the I/O buffer when possible, *data is set to its address. Packets
+   followed by extra bytes (M2TS, FEC) are always copied to buf. */
+static int read_packet(AVFormatContext *s, uint8_t *buf, int raw_packet_size,
+                       const uint8_t **data)
 {
     AVIOContext *pb = s->pb;
     int skip, len;
 
     for(;;) {
-        len = avio_read(pb, buf, TS_PACKET_SIZE);
+        len = ffio_read_indirect(pb, buf, TS_PACKET_SIZE, data);
         if (len != TS_PACKET_SIZE)
             return AVERROR(EIO);
         /* check paquet sync byte */
-        if (buf[0] != 0x47) {
+        if ((*data)[0] != 0x47) {
             /* find a new packet start */
             avio_seek(pb, -TS_PACKET_SIZE, SEEK_CUR);
             if (mpegts_resync(s) < 0)
@@ -1345,8 +1512,14 @@ static int read_packet(AVFormatContext *s, uint8_t *buf, int raw_packet_size)
                 continue;
         } else {
             skip = raw_packet_size - TS_PACKET_SIZE;
-            if (skip > 0)
+            if (skip > 0) {
+                /* skipping may refill the I/O buffer *data points to */
+                if (*data != buf) {
+                    memcpy(buf, *data, TS_PACKET_SIZE);
+                    *data = buf;
+                }
                 avio_seek(pb, skip, SEEK_CUR);
+            }
             break;
         }
     }
@@ -1357,6 +1530,7 @@ static int handle_packets(MpegTSContext *ts, int nb_packets)
 {
     AVFormatContext *s = ts->stream;
     uint8_t packet[TS_PACKET_SIZE];
+    const uint8_t *data;
     int packet_num, ret;
 
     ts->stop_parse = 0;
@@ -1367,10 +1541,10 @@ static int handle_packets(MpegTSContext *ts, int nb_packets)
         packet_num++;
         if (nb_packets != 0 && packet_num >= nb_packets)
             break;
-        ret = read_packet(s, packet, ts->raw_packet_size);
+        ret = read_packet(s, packet, ts->raw_packet_size, &data);
         if (ret != 0)
             return ret;
-        ret = handle_packet(ts, packet);
+        ret = handle_packet(ts, data);
         if (ret != 0)
             return ret;
     }
@@ -1409,33 +1583,6 @@ static int mpegts_probe(AVProbeData *p)
 
 /* return the 90kHz PCR and the extension for the 27MHz PCR. return
    (-1) if not available */
-static int parse_pcr(int64_t *ppcr_high, int *ppcr_low,
-                     const uint8_t *packet)
-{
-    int afc, len, flags;
-    const uint8_t *p;
-    unsigned int v;
-
-    afc = (packet[3] >> 4) & 3;
-    if (afc <= 1)
-        return -1;
-    p = packet + 4;
-    len = p[0];
-    p++;
-    if (len == 0)
-        return -1;
-    flags = *p++;
-    len--;
-    if (!(flags & 0x10))
-        return -1;
-    if (len < 6)
-        return -1;
-    v = AV_RB32(p);
-    *ppcr_high = ((int64_t)v << 1) | (p[4] >> 7);
-    *ppcr_low = ((p[4] & 1) << 8) | p[5];
-    return 0;
-}
-
 static int mpegts_read_header(AVFormatContext *s,
                               AVFormatParameters *ap)
 {
@@ -1489,6 +1636,7 @@ static int mpegts_read_header(AVFormatContext *s,
         int64_t pcrs[2], pcr_h;
         int packet_count[2];
         uint8_t packet[TS_PACKET_SIZE];
+        const uint8_t *data;
 
         /* only read packets */
 
@@ -1504,12 +1652,12 @@ static int mpegts_read_header(AVFormatContext *s,
         nb_pcrs = 0;
         nb_packets = 0;
         for(;;) {
-            ret = read_packet(s, packet, ts->raw_packet_size);
+            ret = read_packet(s, packet, ts->raw_packet_size, &data);
             if (ret < 0)
                 return -1;
-            pid = AV_RB16(packet + 1) & 0x1fff;
+            pid = AV_RB16(data + 1) & 0x1fff;
             if ((pcr_pid == -1 || pcr_pid == pid) &&
-                parse_pcr(&pcr_h, &pcr_l, packet) == 0) {
+                parse_pcr(&pcr_h, &pcr_l, data) == 0) {
                 pcr_pid = pid;
                 packet_count[nb_pcrs] = nb_packets;
                 pcrs[nb_pcrs] = pcr_h * 300 + pcr_l;
@@ -1549,15 +1697,20 @@ static int mpegts_raw_read_packet(AVFormatContext *s,
     int64_t pcr_h, next_pcr_h, pos;
     int pcr_l, next_pcr_l;
     uint8_t pcr_buf[12];
+    const uint8_t *data;
 
     if (av_new_packet(pkt, TS_PACKET_SIZE) < 0)
         return AVERROR(ENOMEM);
     pkt->pos= url_ftell(s->pb);
-    ret = read_packet(s, pkt->data, ts->raw_packet_size);
+    ret = read_packet(s, pkt->data, ts->raw_packet_size, &data);
     if (ret < 0) {
         av_free_packet(pkt);
         return ret;
     }
+    if (data != pkt->data)
+        memcpy(pkt->data, data, TS_PACKET_SIZE);
+    ts->packet_count++;
+    update_pid_stats(ts, AV_RB16(pkt->data + 1) & 0x1fff, pkt->data);
     if (ts->mpeg2ts_compute_pcr) {
         /* compute exact PCR for each packet */
         if (parse_pcr(&pcr_h, &pcr_l, pkt->data) == 0) {
@@ -1597,12 +1750,18 @@ static int mpegts_read_packet(AVFormatContext *s,
             if (ts->pids[i] && ts->pids[i]->type == MPEGTS_PES) {
                 PESContext *pes = ts->pids[i]->u.pes_filter.opaque;
                 av_freep(&pes->buffer);
+                pes->buffer_size = 0;
                 pes->data_index = 0;
                 pes->state = MPEGTS_SKIP; /* skip until pes header */
             }
+            if (ts->pid_stats[i]) {
+                ts->pid_stats[i]->last_cc       = -1;
+                ts->pid_stats[i]->pcr_ref_index = -1;
+            }
         }
     }
 
+    check_programs_discard(ts);
     ts->pkt = pkt;
     ret = handle_packets(ts, 0);
     if (ret < 0) {
@@ -1632,12 +1791,29 @@ static int mpegts_read_close(AVFormatContext *s)
 
     clear_programs(ts);
 
-    for(i=0;i<NB_PID_MAX;i++)
+    for(i=0;i<NB_PID_MAX;i++) {
         if (ts->pids[i]) mpegts_close_filter(ts, ts->pids[i]);
+        av_freep(&ts->pid_stats[i]);
+    }
+    av_freep(&ts->programs_discard);
 
     return 0;
 }
 
+int av_mpegts_get_pid_stats(AVFormatContext *s, int pid,
+                            const AVMpegTSPIDStats **stats)
+{
+    MpegTSContext *ts = s->priv_data;
+
+    if ((s->iformat != &ff_mpegts_demuxer &&
+         s->iformat != &ff_mpegtsraw_demuxer) || pid < 0 || pid >= NB_PID_MAX)
+        return AVERROR(EINVAL);
+    if (!ts->pid_stats[pid])
+        return AVERROR(ENOENT);
+    *stats = &ts->pid_stats[pid]->pub;
+    return 0;
+}
+
 static int64_t mpegts_get_pcr(AVFormatContext *s, int stream_index,
                               int64_t *ppos, int64_t pos_limit)
 {
@@ -1813,6 +1989,7 @@ int ff_mpegts_parse_packet(MpegTSContext *ts, AVPacket *pkt,
     int len1;
 
     len1 = len;
+    check_programs_discard(ts);
     ts->pkt = pkt;
     ts->stop_parse = 0;
     for(;;) {
@@ -1836,8 +2013,11 @@ void ff_mpegts_parse_close(MpegTSContext *ts)
 {
     int i;
 
-    for(i=0;i<NB_PID_MAX;i++)
+    for(i=0;i<NB_PID_MAX;i++) {
         av_free(ts->pids[i]);
+        av_free(ts->pid_stats[i]);
+    }
+    av_free(ts->programs_discard);
     av_free(ts);
 }
 
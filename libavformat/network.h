@@ -32,6 +32,10 @@
 #define ECONNREFUSED    WSAECONNREFUSED
 #define EINPROGRESS     WSAEINPROGRESS
 
+#ifndef SHUT_RDWR
+#define SHUT_RDWR SD_BOTH
+#endif
+
 static inline int ff_neterrno() {
     int err = WSAGetLastError();
     switch (err) {
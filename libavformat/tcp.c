@@ -21,6 +21,7 @@
 #include "avformat.h"
 #include <unistd.h>
 #include "internal.h"
+#include "avio_internal.h"
 #include "network.h"
 #include "os_support.h"
 #if HAVE_POLL_H
@@ -73,7 +74,7 @@ static int tcp_open(URLContext *h, const char *uri, int flags)
     if (ret < 0) {
         struct pollfd p = {fd, POLLOUT, 0};
         if (ff_neterrno() == AVERROR(EINTR)) {
-            if (url_interrupt_cb())
+            if (ff_check_interrupt())
                 goto fail1;
             goto redo;
         }
@@ -83,7 +84,7 @@ static int tcp_open(URLContext *h, const char *uri, int flags)
 
         /* wait until we are connected or until abort */
         for(;;) {
-            if (url_interrupt_cb()) {
+            if (ff_check_interrupt()) {
                 ret = AVERROR(EINTR);
                 goto fail1;
             }
@@ -28,6 +28,8 @@
 #define _DARWIN_C_SOURCE /* Needed for using IP_MULTICAST_TTL on OS X */
 #include "avformat.h"
 #include "libavutil/parseutils.h"
+#include "libavutil/fifo.h"
+#include "libavutil/intreadwrite.h"
 #include <unistd.h>
 #include "internal.h"
 #include "network.h"
@@ -35,6 +37,9 @@
 #if HAVE_POLL_H
 #include <poll.h>
 #endif
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include <sys/time.h>
 
 #ifndef IPV6_ADD_MEMBERSHIP
@@ -52,6 +57,21 @@ typedef struct {
     struct sockaddr_storage dest_addr;
     int dest_addr_len;
     int is_connected;
+
+    /* receive thread and circular buffer, used when fifo_size is set */
+    int circular_buffer_size;
+    AVFifoBuffer *fifo;
+    int circular_buffer_error;
+    int overrun_nonfatal;
+    int overrun_count;          ///< number of datagrams dropped because the fifo was full
+    int64_t overrun_bytes;      ///< payload bytes dropped because the fifo was full
+#if HAVE_PTHREADS
+    pthread_t circular_buffer_thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int thread_started;
+    int close_req;
+#endif
 } UDPContext;
 
 #define UDP_TX_BUF_SIZE 32768
@@ -288,6 +308,22 @@ int udp_get_local_port(URLContext *h)
     return s->local_port;
 }
 
+void udp_get_overrun(URLContext *h, int *count, int64_t *bytes)
+{
+    UDPContext *s = h->priv_data;
+
+#if HAVE_PTHREADS
+    if (s->thread_started)
+        pthread_mutex_lock(&s->mutex);
+#endif
+    *count = s->overrun_count;
+    *bytes = s->overrun_bytes;
+#if HAVE_PTHREADS
+    if (s->thread_started)
+        pthread_mutex_unlock(&s->mutex);
+#endif
+}
+
 /**
  * Return the udp file handle for select() usage to wait for several RTP
  * streams at the same time.
@@ -302,6 +338,75 @@ int udp_get_file_handle(URLContext *h)
     return s->udp_fd;
 }
 
+#if HAVE_PTHREADS
+/**
+ * Receive thread: drain the socket into the circular buffer, so that
+ * datagrams are not lost when the reader is late.
+ * Each datagram is stored with its size in front of it, as a 32-bit
+ * little-endian value.
+ */
+static void *circular_buffer_task(void *arg)
+{
+    URLContext *h = arg;
+    UDPContext *s = h->priv_data;
+    struct pollfd p = {s->udp_fd, POLLIN, 0};
+    uint8_t *tmp = av_malloc(UDP_MAX_PKT_SIZE + 4);
+    int ret, len;
+
+    pthread_mutex_lock(&s->mutex);
+    if (!tmp) {
+        s->circular_buffer_error = AVERROR(ENOMEM);
+        goto end;
+    }
+    while (!s->close_req) {
+        pthread_mutex_unlock(&s->mutex);
+        ret = poll(&p, 1, 100);
+        if (ret < 0 && ff_neterrno() != AVERROR(EINTR)) {
+            pthread_mutex_lock(&s->mutex);
+            s->circular_buffer_error = AVERROR(EIO);
+            goto end;
+        }
+        len = -1;
+        if (ret == 1 && p.revents & POLLIN) {
+            len = recv(s->udp_fd, tmp + 4, UDP_MAX_PKT_SIZE, 0);
+            if (len < 0 && ff_neterrno() != AVERROR(EAGAIN) &&
+                           ff_neterrno() != AVERROR(EINTR)) {
+                pthread_mutex_lock(&s->mutex);
+                s->circular_buffer_error = AVERROR(EIO);
+                goto end;
+            }
+        }
+        pthread_mutex_lock(&s->mutex);
+        if (len < 0)
+            continue;
+
+        if (av_fifo_space(s->fifo) < len + 4) {
+            /* the reader is too slow, drop the datagram */
+            if (!s->overrun_count++)
+                av_log(NULL, AV_LOG_WARNING, "Circular buffer overrun. "
+                       "To avoid, increase the fifo_size URL option.\n");
+            s->overrun_bytes += len;
+            if (!s->overrun_nonfatal) {
+                av_log(NULL, AV_LOG_ERROR, "To survive in such a case, "
+                       "use the overrun_nonfatal option.\n");
+                s->circular_buffer_error = AVERROR(EIO);
+                goto end;
+            }
+            continue;
+        }
+        AV_WL32(tmp, len);
+        av_fifo_generic_write(s->fifo, tmp, len + 4, NULL);
+        pthread_cond_signal(&s->cond);
+    }
+
+end:
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    av_free(tmp);
+    return NULL;
+}
+#endif
+
 /* put it in UDP context */
 /* return non zero if error */
 static int udp_open(URLContext *h, const char *uri, int flags)
@@ -354,6 +459,14 @@ static int udp_open(URLContext *h, const char *uri, int flags)
         if (av_find_info_tag(buf, sizeof(buf), "connect", p)) {
             s->is_connected = strtol(buf, NULL, 10);
         }
+        if (av_find_info_tag(buf, sizeof(buf), "fifo_size", p)) {
+            /* bounded so that the size in bytes fits an int */
+            long fifo_packets = strtol(buf, NULL, 10);
+            s->circular_buffer_size = FFMAX(FFMIN(fifo_packets, INT_MAX / 188), 0) * 188;
+        }
+        if (av_find_info_tag(buf, sizeof(buf), "overrun_nonfatal", p)) {
+            s->overrun_nonfatal = strtol(buf, NULL, 10);
+        }
     }
 
     /* fill the dest addr */
@@ -435,14 +548,77 @@ static int udp_open(URLContext *h, const char *uri, int flags)
     }
 
     s->udp_fd = udp_fd;
+
+    if (!is_output && s->circular_buffer_size > 0) {
+#if HAVE_PTHREADS
+        /* start the task going */
+        s->fifo = av_fifo_alloc(s->circular_buffer_size);
+        if (!s->fifo)
+            goto fail;
+        pthread_mutex_init(&s->mutex, NULL);
+        pthread_cond_init(&s->cond, NULL);
+        if (pthread_create(&s->circular_buffer_thread, NULL, circular_buffer_task, h)) {
+            av_log(NULL, AV_LOG_ERROR, "pthread_create failed\n");
+            pthread_mutex_destroy(&s->mutex);
+            pthread_cond_destroy(&s->cond);
+            goto fail;
+        }
+        s->thread_started = 1;
+#else
+        av_log(NULL, AV_LOG_WARNING, "fifo_size is not supported without pthreads, ignoring\n");
+#endif
+    }
+
     return 0;
  fail:
     if (udp_fd >= 0)
         closesocket(udp_fd);
+    av_fifo_free(s->fifo);
     av_free(s);
     return AVERROR(EIO);
 }
 
+#if HAVE_PTHREADS
+static int udp_read_fifo(URLContext *h, uint8_t *buf, int size)
+{
+    UDPContext *s = h->priv_data;
+    struct timeval tv;
+    struct timespec ts;
+    uint8_t tmp[4];
+    int avail, ret;
+
+    pthread_mutex_lock(&s->mutex);
+    for (;;) {
+        if (av_fifo_size(s->fifo)) {
+            av_fifo_generic_read(s->fifo, tmp, 4, NULL);
+            avail = ret = AV_RL32(tmp);
+            if (ret > size) {
+                av_log(NULL, AV_LOG_WARNING, "Part of datagram lost due to insufficient buffer size\n");
+                ret = size;
+            }
+            av_fifo_generic_read(s->fifo, buf, ret, NULL);
+            av_fifo_drain(s->fifo, avail - ret);
+            break;
+        }
+        if (s->circular_buffer_error) {
+            ret = s->circular_buffer_error;
+            break;
+        }
+        if (url_interrupt_cb()) {
+            ret = AVERROR(EINTR);
+            break;
+        }
+        /* wake up every 100 ms to check the interrupt callback */
+        gettimeofday(&tv, NULL);
+        ts.tv_sec  = tv.tv_sec + (tv.tv_usec + 100000) / 1000000;
+        ts.tv_nsec = (tv.tv_usec + 100000) % 1000000 * 1000;
+        pthread_cond_timedwait(&s->cond, &s->mutex, &ts);
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return ret;
+}
+#endif
+
 static int udp_read(URLContext *h, uint8_t *buf, int size)
 {
     UDPContext *s = h->priv_data;
@@ -450,6 +626,11 @@ static int udp_read(URLContext *h, uint8_t *buf, int size)
     int len;
     int ret;
 
+#if HAVE_PTHREADS
+    if (s->fifo)
+        return udp_read_fifo(h, buf, size);
+#endif
+
     for(;;) {
         if (url_interrupt_cb())
             return AVERROR(EINTR);
@@ -500,9 +681,25 @@ static int udp_close(URLContext *h)
 {
     UDPContext *s = h->priv_data;
 
+#if HAVE_PTHREADS
+    if (s->thread_started) {
+        pthread_mutex_lock(&s->mutex);
+        s->close_req = 1;
+        pthread_mutex_unlock(&s->mutex);
+        pthread_join(s->circular_buffer_thread, NULL);
+        pthread_mutex_destroy(&s->mutex);
+        pthread_cond_destroy(&s->cond);
+    }
+#endif
+    if (s->overrun_count)
+        av_log(NULL, AV_LOG_WARNING, "%d datagrams (%"PRId64" bytes) dropped "
+               "because the circular buffer was full\n",
+               s->overrun_count, s->overrun_bytes);
+
     if (s->is_multicast && !(h->flags & URL_WRONLY))
         udp_leave_multicast_group(s->udp_fd, (struct sockaddr *)&s->dest_addr);
     closesocket(s->udp_fd);
+    av_fifo_free(s->fifo);
     av_free(s);
     return 0;
 }
@@ -2207,17 +2207,40 @@ static int tb_unreliable(AVCodecContext *c){
     return 0;
 }
 
+/**
+ * Return the frame rate given by the codec time base if it looks like the
+ * one of a video stream, i.e. if it was set from the bitstream or the
+ * container rather than copied from a fine grained stream time base.
+ */
+static AVRational codec_frame_rate(AVCodecContext *c)
+{
+    AVRational rate = { 0, 0 };
+    int64_t num = (int64_t)c->time_base.num * FFMAX(c->ticks_per_frame, 1);
+
+    if (c->time_base.den >= 5*num && c->time_base.den < 101*num)
+        av_reduce(&rate.num, &rate.den, c->time_base.den, num, INT_MAX);
+    return rate;
+}
+
 int av_find_stream_info(AVFormatContext *ic)
 {
     int i, count, ret, read_size, j;
     AVStream *st;
     AVPacket pkt1, *pkt;
     int64_t old_offset = url_ftell(ic->pb);
+    int fast = ic->flags & AVFMT_FLAG_FASTPROBE;
+    int64_t start_time = av_gettime();
+    /* streams announced before any packet was read, e.g. from a PMT */
+    int nb_header_streams = ic->nb_streams;
 
     for(i=0;i<ic->nb_streams;i++) {
         AVCodec *codec;
+        /* complete audio parameters next to codec private data */
+        int trust_container;
         st = ic->streams[i];
-        if (st->codec->codec_id == CODEC_ID_AAC) {
+        trust_container = fast && st->codec->extradata_size &&
+                          st->codec->sample_rate && st->codec->channels;
+        if (st->codec->codec_id == CODEC_ID_AAC && !trust_container) {
             st->codec->sample_rate = 0;
             st->codec->frame_size = 0;
             st->codec->channels = 0;
@@ -2243,7 +2266,7 @@ int av_find_stream_info(AVFormatContext *ic)
          * this makes sure the codec initializes the channel configuration
          * and does not trust the values from the container.
          */
-        if (codec && codec->capabilities & CODEC_CAP_CHANNEL_CONF)
+        if (codec && codec->capabilities & CODEC_CAP_CHANNEL_CONF && !trust_container)
             st->codec->channels = 0;
 
         /* Ensure that subtitle_header is properly set. */
@@ -2278,7 +2301,9 @@ int av_find_stream_info(AVFormatContext *ic)
                 break;
             /* variable fps and no guess at the real fps */
             if(   tb_unreliable(st->codec) && !(st->r_frame_rate.num && st->avg_frame_rate.num)
-               && st->info->duration_count<20 && st->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+               && st->info->duration_count<20 && st->codec->codec_type == AVMEDIA_TYPE_VIDEO
+               && !(fast && (st->r_frame_rate.num || st->avg_frame_rate.num ||
+                             codec_frame_rate(st->codec).num)))
                 break;
             if(st->parser && st->parser->parser->split && !st->codec->extradata)
                 break;
@@ -2288,8 +2313,9 @@ int av_find_stream_info(AVFormatContext *ic)
         if (i == ic->nb_streams) {
             /* NOTE: if the format has no header, then we need to read
                some packets to get most of the streams, so we cannot
-               stop here */
-            if (!(ic->ctx_flags & AVFMTCTX_NOHEADER)) {
+               stop here, unless we trust the streams it announced */
+            if (!(ic->ctx_flags & AVFMTCTX_NOHEADER) ||
+                (fast && nb_header_streams && ic->nb_streams == nb_header_streams)) {
                 /* if we found the info for all the codecs, we can stop */
                 ret = count;
                 av_log(ic, AV_LOG_DEBUG, "All info found\n");
@@ -2302,6 +2328,18 @@ int av_find_stream_info(AVFormatContext *ic)
             av_log(ic, AV_LOG_DEBUG, "Probe buffer size limit %d reached\n", ic->probesize);
             break;
         }
+        /* the fast mode also counts the data the demuxer skipped */
+        if (fast && ic->pb && url_ftell(ic->pb) - old_offset >= ic->probesize) {
+            ret = count;
+            av_log(ic, AV_LOG_DEBUG, "Probe input size limit %d reached\n", ic->probesize);
+            break;
+        }
+        /* and the time spent waiting for a slow input */
+        if (fast && av_gettime() - start_time >= ic->max_analyze_duration) {
+            ret = count;
+            av_log(ic, AV_LOG_DEBUG, "Probe time limit reached\n");
+            break;
+        }
 
         /* NOTE: a new stream can be added there if no header in file
            (AVFMTCTX_NOHEADER) */
@@ -2339,6 +2377,12 @@ int av_find_stream_info(AVFormatContext *ic)
             }
             st->info->codec_info_duration += pkt->duration;
         }
+        if (fast && pkt->dts != AV_NOPTS_VALUE && st->first_dts != AV_NOPTS_VALUE &&
+            av_rescale_q(pkt->dts - st->first_dts, st->time_base, AV_TIME_BASE_Q) >= ic->max_analyze_duration) {
+            ret = count;
+            av_log(ic, AV_LOG_DEBUG, "max_analyze_duration reached\n");
+            break;
+        }
         {
             int64_t last = st->info->last_dts;
             int64_t duration= pkt->dts - last;
@@ -2404,6 +2448,12 @@ int av_find_stream_info(AVFormatContext *ic)
             // the check for tb_unreliable() is not completely correct, since this is not about handling
             // a unreliable/inexact time base, but a time base that is finer than necessary, as e.g.
             // ipmovie.c produces.
+            /* the fast mode stopped before the frame rate could be measured */
+            if (fast && tb_unreliable(st->codec) && st->info->duration_count < 20 && !st->r_frame_rate.num) {
+                st->r_frame_rate = codec_frame_rate(st->codec);
+                if (!st->r_frame_rate.num)
+                    st->r_frame_rate = st->avg_frame_rate;
+            }
             if (tb_unreliable(st->codec) && st->info->duration_count > 15 && st->info->duration_gcd > 1 && !st->r_frame_rate.num)
                 av_reduce(&st->r_frame_rate.num, &st->r_frame_rate.den, st->time_base.den, st->time_base.num * st->info->duration_gcd, INT_MAX);
             if (st->info->duration_count && !st->r_frame_rate.num
@@ -2605,6 +2655,7 @@ void avformat_free_context(AVFormatContext *s)
     }
     av_freep(&s->programs);
     av_freep(&s->priv_data);
+    ff_interleave_free(s);
     while(s->nb_chapters--) {
 #if FF_API_OLD_METADATA
         av_free(s->chapters[s->nb_chapters]->title);
@@ -2992,40 +3043,133 @@ int av_write_frame(AVFormatContext *s, AVPacket *pkt)
     return ret;
 }
 
-void ff_interleave_add_packet(AVFormatContext *s, AVPacket *pkt,
-                              int (*compare)(AVFormatContext *, AVPacket *, AVPacket *))
+typedef struct InterleaveEntry {
+    AVPacket pkt;
+    int64_t seq;                ///< insertion order, breaks ties between equal packets
+} InterleaveEntry;
+
+/**
+ * Packets waiting to be interleaved when muxing, kept in a binary heap
+ * with the packet to output first at the root.
+ */
+typedef struct InterleaveQueue {
+    InterleaveEntry *entries;
+    unsigned int entries_size;
+    int nb_entries;
+    int64_t seq;
+    int (*compare)(AVFormatContext *, AVPacket *, AVPacket *);
+    int *stream_packets;        ///< number of queued packets of each stream
+    int nb_streams;
+    int nb_streams_queued;      ///< number of streams with queued packets
+} InterleaveQueue;
+
+/**
+ * compare(s, next, pkt) is true if pkt must be output before next, and
+ * packets that compare equal are output in the order they were added,
+ * as with the sorted list the queue used to be.
+ */
+static int interleave_before(AVFormatContext *s, InterleaveEntry *a, InterleaveEntry *b)
 {
-    AVPacketList **next_point, *this_pktl;
+    InterleaveQueue *q = s->interleave_queue;
 
-    this_pktl = av_mallocz(sizeof(AVPacketList));
-    this_pktl->pkt= *pkt;
-    pkt->destruct= NULL;             // do not free original but only the copy
-    av_dup_packet(&this_pktl->pkt);  // duplicate the packet if it uses non-alloced memory
+    if (q->compare(s, &b->pkt, &a->pkt))
+        return 1;
+    if (q->compare(s, &a->pkt, &b->pkt))
+        return 0;
+    return a->seq < b->seq;
+}
 
-    if(s->streams[pkt->stream_index]->last_in_packet_buffer){
-        next_point = &(s->streams[pkt->stream_index]->last_in_packet_buffer->next);
-    }else
-        next_point = &s->packet_buffer;
+int ff_interleave_add_packet(AVFormatContext *s, AVPacket *pkt,
+                             int (*compare)(AVFormatContext *, AVPacket *, AVPacket *))
+{
+    InterleaveQueue *q = s->interleave_queue;
+    InterleaveEntry *entries, e;
+    int i;
 
-    if(*next_point){
-        if(compare(s, &s->packet_buffer_end->pkt, pkt)){
-            while(!compare(s, &(*next_point)->pkt, pkt)){
-                next_point= &(*next_point)->next;
-            }
-            goto next_non_null;
-        }else{
-            next_point = &(s->packet_buffer_end->next);
-        }
+    if (!q) {
+        q = s->interleave_queue = av_mallocz(sizeof(InterleaveQueue));
+        if (!q)
+            return AVERROR(ENOMEM);
     }
-    assert(!*next_point);
+    if (q->nb_streams < s->nb_streams) {
+        int *stream_packets = av_realloc(q->stream_packets,
+                                         s->nb_streams * sizeof(*q->stream_packets));
+        if (!stream_packets)
+            return AVERROR(ENOMEM);
+        memset(stream_packets + q->nb_streams, 0,
+               (s->nb_streams - q->nb_streams) * sizeof(*q->stream_packets));
+        q->stream_packets = stream_packets;
+        q->nb_streams     = s->nb_streams;
+    }
+    entries = av_fast_realloc(q->entries, &q->entries_size,
+                              (q->nb_entries + 1) * sizeof(InterleaveEntry));
+    if (!entries)
+        return AVERROR(ENOMEM);
+    q->entries = entries;
+    q->compare = compare;
+
+    e.pkt = *pkt;
+    e.seq = q->seq++;
+    pkt->destruct= NULL;             // do not free original but only the copy
+    av_dup_packet(&e.pkt);           // duplicate the packet if it uses non-alloced memory
 
-    s->packet_buffer_end= this_pktl;
-next_non_null:
+    /* sift up */
+    for (i = q->nb_entries++; i > 0; i = (i - 1) >> 1) {
+        if (!interleave_before(s, &e, &entries[(i - 1) >> 1]))
+            break;
+        entries[i] = entries[(i - 1) >> 1];
+    }
+    entries[i] = e;
 
-    this_pktl->next= *next_point;
+    if (!q->stream_packets[pkt->stream_index]++)
+        q->nb_streams_queued++;
+    return 0;
+}
 
-    s->streams[pkt->stream_index]->last_in_packet_buffer=
-    *next_point= this_pktl;
+int ff_interleave_queued_streams(AVFormatContext *s)
+{
+    return s->interleave_queue ? s->interleave_queue->nb_streams_queued : 0;
+}
+
+int ff_interleave_get_packet(AVFormatContext *s, AVPacket *out)
+{
+    InterleaveQueue *q = s->interleave_queue;
+    InterleaveEntry *entries, last;
+    int i, child;
+
+    if (!q || !q->nb_entries)
+        return 0;
+    entries = q->entries;
+    *out = entries[0].pkt;
+    if (!--q->stream_packets[out->stream_index])
+        q->nb_streams_queued--;
+
+    /* sift the last entry down from the root */
+    last = entries[--q->nb_entries];
+    for (i = 0; (child = 2 * i + 1) < q->nb_entries; i = child) {
+        if (child + 1 < q->nb_entries &&
+            interleave_before(s, &entries[child + 1], &entries[child]))
+            child++;
+        if (!interleave_before(s, &entries[child], &last))
+            break;
+        entries[i] = entries[child];
+    }
+    entries[i] = last;
+    return 1;
+}
+
+void ff_interleave_free(AVFormatContext *s)
+{
+    InterleaveQueue *q = s->interleave_queue;
+    int i;
+
+    if (!q)
+        return;
+    for (i = 0; i < q->nb_entries; i++)
+        av_free_packet(&q->entries[i].pkt);
+    av_free(q->entries);
+    av_free(q->stream_packets);
+    av_freep(&s->interleave_queue);
 }
 
 static int ff_interleave_compare_dts(AVFormatContext *s, AVPacket *next, AVPacket *pkt)
@@ -3038,29 +3182,18 @@ static int ff_interleave_compare_dts(AVFormatContext *s, AVPacket *next, AVPacke
 }
 
 int av_interleave_packet_per_dts(AVFormatContext *s, AVPacket *out, AVPacket *pkt, int flush){
-    AVPacketList *pktl;
-    int stream_count=0;
-    int i;
+    int stream_count;
 
     if(pkt){
-        ff_interleave_add_packet(s, pkt, ff_interleave_compare_dts);
+        int ret = ff_interleave_add_packet(s, pkt, ff_interleave_compare_dts);
+        if (ret < 0)
+            return ret;
     }
 
-    for(i=0; i < s->nb_streams; i++)
-        stream_count+= !!s->streams[i]->last_in_packet_buffer;
+    stream_count = ff_interleave_queued_streams(s);
 
     if(stream_count && (s->nb_streams == stream_count || flush)){
-        pktl= s->packet_buffer;
-        *out= pktl->pkt;
-
-        s->packet_buffer= pktl->next;
-        if(!s->packet_buffer)
-            s->packet_buffer_end= NULL;
-
-        if(s->streams[out->stream_index]->last_in_packet_buffer == pktl)
-            s->streams[out->stream_index]->last_in_packet_buffer= NULL;
-        av_freep(&pktl);
-        return 1;
+        return ff_interleave_get_packet(s, out);
     }else{
         av_init_packet(out);
         return 0;
@@ -3142,6 +3275,7 @@ int av_write_trailer(AVFormatContext *s)
 fail:
     if(ret == 0)
        ret=url_ferror(s->pb);
+    ff_interleave_free(s);
     for(i=0;i<s->nb_streams;i++) {
         av_freep(&s->streams[i]->priv_data);
         av_freep(&s->streams[i]->index_entries);
@@ -3815,3 +3949,11 @@ int ff_find_stream_index(AVFormatContext *s, int id)
     }
     return -1;
 }
+
+#if !CONFIG_MPEGTS_DEMUXER && !CONFIG_WTV_DEMUXER
+int av_mpegts_get_pid_stats(AVFormatContext *s, int pid,
+                            const AVMpegTSPIDStats **stats)
+{
+    return AVERROR(ENOSYS);
+}
+#endif
@@ -1,4 +1,4 @@
 LIBAVUTIL_$MAJOR {
-        global: av_*; ff_*; avutil_*;
+        global: av_*; avpriv_*; ff_*; avutil_*;
         local: *;
 };
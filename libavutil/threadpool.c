@@ -0,0 +1,168 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Slice thread pool, taken from the libavcodec one.
+ */
+
+#include <pthread.h>
+
+#include "internal.h"
+#include "mem.h"
+#include "threadpool.h"
+
+struct AVThreadPool {
+    pthread_t *workers;
+    int nb_threads;
+    int nb_workers;             ///< number of workers started
+
+    avpriv_thread_pool_func *func;
+    void *ctx;
+    void *arg;
+    int *rets;
+    int rets_count;
+
+    pthread_cond_t last_job_cond;
+    pthread_cond_t current_job_cond;
+    pthread_mutex_t current_job_lock;
+    int current_job;
+    int job_count;
+    int done;
+};
+
+static void* attribute_align_arg worker(void *v)
+{
+    AVThreadPool *c = v;
+    int our_job = c->job_count;
+    int thread_count = c->nb_threads;
+    int self_id;
+
+    pthread_mutex_lock(&c->current_job_lock);
+    self_id = c->current_job++;
+    for (;;) {
+        while (our_job >= c->job_count) {
+            if (c->current_job == thread_count + c->job_count)
+                pthread_cond_signal(&c->last_job_cond);
+
+            if (!c->done)
+                pthread_cond_wait(&c->current_job_cond, &c->current_job_lock);
+            our_job = self_id;
+
+            if (c->done) {
+                pthread_mutex_unlock(&c->current_job_lock);
+                return NULL;
+            }
+        }
+        pthread_mutex_unlock(&c->current_job_lock);
+
+        c->rets[our_job % c->rets_count] = c->func(c->ctx, c->arg, our_job, self_id);
+
+        pthread_mutex_lock(&c->current_job_lock);
+        our_job = c->current_job++;
+    }
+}
+
+static void park_workers(AVThreadPool *c)
+{
+    pthread_cond_wait(&c->last_job_cond, &c->current_job_lock);
+    pthread_mutex_unlock(&c->current_job_lock);
+}
+
+void avpriv_thread_pool_execute(AVThreadPool *c, avpriv_thread_pool_func *func,
+                                void *ctx, void *arg, int *ret, int nb_jobs)
+{
+    int dummy_ret;
+
+    if (nb_jobs <= 0)
+        return;
+
+    pthread_mutex_lock(&c->current_job_lock);
+
+    c->current_job = c->nb_threads;
+    c->job_count   = nb_jobs;
+    c->func        = func;
+    c->ctx         = ctx;
+    c->arg         = arg;
+    if (ret) {
+        c->rets       = ret;
+        c->rets_count = nb_jobs;
+    } else {
+        c->rets       = &dummy_ret;
+        c->rets_count = 1;
+    }
+    pthread_cond_broadcast(&c->current_job_cond);
+
+    park_workers(c);
+}
+
+void avpriv_thread_pool_free(AVThreadPool **pool)
+{
+    AVThreadPool *c = *pool;
+    int i;
+
+    if (!c)
+        return;
+
+    pthread_mutex_lock(&c->current_job_lock);
+    c->done = 1;
+    pthread_cond_broadcast(&c->current_job_cond);
+    pthread_mutex_unlock(&c->current_job_lock);
+
+    for (i = 0; i < c->nb_workers; i++)
+        pthread_join(c->workers[i], NULL);
+
+    pthread_mutex_destroy(&c->current_job_lock);
+    pthread_cond_destroy(&c->current_job_cond);
+    pthread_cond_destroy(&c->last_job_cond);
+    av_free(c->workers);
+    av_freep(pool);
+}
+
+AVThreadPool *avpriv_thread_pool_create(int nb_threads)
+{
+    AVThreadPool *c;
+    int i;
+
+    c = av_mallocz(sizeof(AVThreadPool));
+    if (!c)
+        return NULL;
+    c->workers = av_mallocz(sizeof(pthread_t) * nb_threads);
+    if (!c->workers) {
+        av_free(c);
+        return NULL;
+    }
+
+    c->nb_threads = nb_threads;
+    pthread_cond_init(&c->current_job_cond, NULL);
+    pthread_cond_init(&c->last_job_cond, NULL);
+    pthread_mutex_init(&c->current_job_lock, NULL);
+    pthread_mutex_lock(&c->current_job_lock);
+    for (i = 0; i < nb_threads; i++) {
+        if (pthread_create(&c->workers[i], NULL, worker, c)) {
+            pthread_mutex_unlock(&c->current_job_lock);
+            avpriv_thread_pool_free(&c);
+            return NULL;
+        }
+        c->nb_workers++;
+    }
+
+    park_workers(c);
+
+    return c;
+}
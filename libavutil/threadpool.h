@@ -0,0 +1,64 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Pool of worker threads for slice threading, shared by the libraries.
+ * Only available when HAVE_PTHREADS is set.
+ * The avpriv_ functions are exported for libavcodec, libavfilter and
+ * libswscale only; they are not part of the public API.
+ */
+
+#ifndef AVUTIL_THREADPOOL_H
+#define AVUTIL_THREADPOOL_H
+
+typedef struct AVThreadPool AVThreadPool;
+
+/**
+ * Job run by the workers of a pool.
+ *
+ * @param ctx      context given to avpriv_thread_pool_execute()
+ * @param arg      argument given to avpriv_thread_pool_execute()
+ * @param jobnr    index of the job
+ * @param threadnr index of the worker running the job
+ * @return the value stored in the ret array given to avpriv_thread_pool_execute()
+ */
+typedef int (avpriv_thread_pool_func)(void *ctx, void *arg, int jobnr, int threadnr);
+
+/**
+ * Start a pool of nb_threads workers.
+ *
+ * @return the pool, NULL on failure
+ */
+AVThreadPool *avpriv_thread_pool_create(int nb_threads);
+
+/**
+ * Run the jobs 0 to nb_jobs - 1 on the workers of the pool, and return
+ * once they are all done. Only one thread may call it at a time.
+ *
+ * @param ret if not NULL, the return value of job n is stored in ret[n]
+ */
+void avpriv_thread_pool_execute(AVThreadPool *pool, avpriv_thread_pool_func *func,
+                                void *ctx, void *arg, int *ret, int nb_jobs);
+
+/**
+ * Stop the workers, free the pool and set *pool to NULL.
+ */
+void avpriv_thread_pool_free(AVThreadPool **pool);
+
+#endif /* AVUTIL_THREADPOOL_H */
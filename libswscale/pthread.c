@@ -0,0 +1,179 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Slice threading support for the scaler.
+ *
+ * The destination picture is split into c->thread_count horizontal bands.
+ * Each band is scaled by its own SwsContext, which is set up like the
+ * user context but only outputs its own lines, so that the workers never
+ * share ring buffers, MMX filter arrays or dithering state.
+ * The SIMD vertical scalers may write past the end of a line, so the
+ * bands are only scaled in parallel when the destination lines are
+ * padded enough for this not to spill into the band below.
+ */
+
+#include <string.h>
+
+#include "libavutil/imgutils.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/threadpool.h"
+#include "swscale.h"
+#include "swscale_internal.h"
+
+typedef struct ThreadContext {
+    AVThreadPool *pool;
+
+    int min_stride[4];          ///< Smallest destination strides the bands can be scaled in parallel with.
+
+    const uint8_t **src;
+    int *srcStride;
+    uint8_t **dst;
+    int *dstStride;
+} ThreadContext;
+
+static int scale_band(void *parent, void *arg, int jobnr, int threadnr)
+{
+    ThreadContext *t = arg;
+    SwsContext *c = ((SwsContext *)parent)->slice_ctx[jobnr];
+    /* swScale() modifies the pointers and strides it is given */
+    const uint8_t *src[4]= {t->src[0], t->src[1], t->src[2], t->src[3]};
+    int srcStride[4]= {t->srcStride[0], t->srcStride[1], t->srcStride[2], t->srcStride[3]};
+    uint8_t *dst[4]= {t->dst[0], t->dst[1], t->dst[2], t->dst[3]};
+    int dstStride[4]= {t->dstStride[0], t->dstStride[1], t->dstStride[2], t->dstStride[3]};
+
+    c->swScale(c, src, srcStride, 0, c->srcH, dst, dstStride);
+    return 0;
+}
+
+int ff_sws_thread_scale(SwsContext *c, const uint8_t* src[], int srcStride[],
+                        uint8_t* dst[], int dstStride[])
+{
+    ThreadContext *t = c->thread_opaque;
+    int i;
+
+    for (i = 0; i < 4; i++)
+        if (FFABS(dstStride[i]) < t->min_stride[i])
+            return c->swScale(c, src, srcStride, 0, c->srcH, dst, dstStride);
+
+    if (usePal(c->srcFormat)) {
+        for (i = 0; i < c->thread_count; i++) {
+            memcpy(c->slice_ctx[i]->pal_yuv, c->pal_yuv, sizeof(c->pal_yuv));
+            memcpy(c->slice_ctx[i]->pal_rgb, c->pal_rgb, sizeof(c->pal_rgb));
+        }
+    }
+
+    t->src       = src;
+    t->srcStride = srcStride;
+    t->dst       = dst;
+    t->dstStride = dstStride;
+    avpriv_thread_pool_execute(t->pool, scale_band, c, t, NULL, c->thread_count);
+
+    return c->dstH;
+}
+
+void ff_sws_thread_free(SwsContext *c)
+{
+    ThreadContext *t = c->thread_opaque;
+    int i;
+
+    if (t) {
+        avpriv_thread_pool_free(&t->pool);
+        av_freep(&c->thread_opaque);
+    }
+
+    if (c->slice_ctx) {
+        for (i = 0; i < c->thread_count; i++)
+            sws_freeContext(c->slice_ctx[i]);
+        av_freep(&c->slice_ctx);
+    }
+}
+
+static SwsContext *alloc_slice_context(SwsContext *c, SwsFilter *srcFilter,
+                                       SwsFilter *dstFilter, int dstY, int dstH)
+{
+    SwsContext *s = sws_alloc_context();
+
+    if (!s)
+        return NULL;
+
+    s->flags     = c->flags & ~SWS_PRINT_INFO;
+    s->srcW      = c->srcW;
+    s->srcH      = c->srcH;
+    s->dstW      = c->dstW;
+    s->dstH      = c->dstH;
+    s->srcFormat = c->srcFormat;
+    s->dstFormat = c->dstFormat;
+    s->param[0]  = c->param[0];
+    s->param[1]  = c->param[1];
+    sws_setColorspaceDetails(s, c->srcColorspaceTable, c->srcRange,
+                             c->dstColorspaceTable, c->dstRange,
+                             c->brightness, c->contrast, c->saturation);
+
+    if (sws_init_context(s, srcFilter, dstFilter) < 0) {
+        sws_freeContext(s);
+        return NULL;
+    }
+    s->dstSliceY = dstY;
+    s->dstSliceH = dstH;
+
+    return s;
+}
+
+int ff_sws_thread_init(SwsContext *c, SwsFilter *srcFilter, SwsFilter *dstFilter)
+{
+    ThreadContext *t;
+    /* bands start on a chroma line so that no chroma line is output twice */
+    int align = 1 << c->chrDstVSubSample;
+    int i;
+
+    c->thread_count = FFMIN(c->thread_count, c->dstH / (8 * align));
+    if (c->thread_count <= 1) {
+        c->thread_count = 1;
+        return 0;
+    }
+
+    c->slice_ctx = av_mallocz(c->thread_count * sizeof(*c->slice_ctx));
+    if (!c->slice_ctx)
+        return AVERROR(ENOMEM);
+
+    for (i = 0; i < c->thread_count; i++) {
+        int start =  c->dstH *  i      / c->thread_count & ~(align - 1);
+        int end   = (c->dstH * (i + 1) / c->thread_count & ~(align - 1));
+
+        if (i == c->thread_count - 1)
+            end = c->dstH;
+        if (!(c->slice_ctx[i] = alloc_slice_context(c, srcFilter, dstFilter, start, end - start)))
+            goto fail;
+    }
+
+    t = av_mallocz(sizeof(ThreadContext));
+    if (!t)
+        goto fail;
+    c->thread_opaque = t;
+    av_image_fill_linesizes(t->min_stride, c->dstFormat, FFALIGN(c->dstW, 16));
+    if (!(t->pool = avpriv_thread_pool_create(c->thread_count)))
+        goto fail;
+
+    return 0;
+fail:
+    ff_sws_thread_free(c);
+    c->thread_count = 1;
+    return AVERROR(ENOMEM);
+}
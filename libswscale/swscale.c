@@ -1996,6 +1996,12 @@ int sws_scale(SwsContext *c, const uint8_t* const src[], const int srcStride[],
         if (srcSliceY + srcSliceH == c->srcH)
             c->sliceDir = 0;
 
+#if HAVE_PTHREADS
+        /* whole pictures are scaled in bands, one per thread */
+        if (c->thread_opaque && srcSliceY == 0 && srcSliceH == c->srcH)
+            return ff_sws_thread_scale(c, src2, srcStride2, dst2, dstStride2);
+#endif
+
         return c->swScale(c, src2, srcStride2, srcSliceY, srcSliceH, dst2, dstStride2);
     } else {
         // slices go from bottom to top => we flip the image internally
@@ -314,6 +314,20 @@ typedef struct SwsContext {
 
     int needs_hcscale; ///< Set if there are chroma planes to be converted.
 
+    /**
+     * @name Slice threading.
+     * The destination picture is split into horizontal bands, each scaled
+     * by its own context, and thus with its own ring buffers of scaled
+     * horizontal lines, on a separate thread.
+     */
+    //@{
+    int thread_count;             ///< Number of threads (and bands) used to scale a picture.
+    struct SwsContext **slice_ctx; ///< Contexts scaling each band of the destination picture.
+    void *thread_opaque;          ///< Used internally by the thread pool (libswscale/pthread.c).
+    int dstSliceY;                ///< First destination line output by this context.
+    int dstSliceH;                ///< Number of destination lines output by this context.
+    //@}
+
 } SwsContext;
 //FIXME check init (where 0)
 
@@ -468,4 +482,24 @@ int ff_hardcodedcpuflags(void);
  */
 SwsFunc ff_getSwsFunc(SwsContext *c);
 
+/**
+ * Create the band contexts and worker threads used to scale
+ * a picture with c->thread_count threads.
+ * @return 0 on success, a negative value on error
+ */
+int ff_sws_thread_init(SwsContext *c, SwsFilter *srcFilter, SwsFilter *dstFilter);
+
+/**
+ * Stop the worker threads and free the band contexts.
+ */
+void ff_sws_thread_free(SwsContext *c);
+
+/**
+ * Scale a whole picture, each band of the destination being scaled
+ * on its own thread.
+ * @return the height of the output picture
+ */
+int ff_sws_thread_scale(SwsContext *c, const uint8_t* src[], int srcStride[],
+                        uint8_t* dst[], int dstStride[]);
+
 #endif /* SWSCALE_SWSCALE_INTERNAL_H */
@@ -2389,6 +2389,9 @@ static inline void RENAME(hyscale)(SwsContext *c, uint16_t *dst, long dstWidth,
 
     if (toYV12) {
         toYV12(formatConvBuffer, src, srcW, pal);
+        /* the fast bilinear scaler reads one sample past the end of the line,
+           which may otherwise be left over from converting a chroma line */
+        formatConvBuffer[srcW]= formatConvBuffer[srcW-1];
         src= formatConvBuffer;
     }
 
@@ -2536,6 +2539,9 @@ inline static void RENAME(hcscale)(SwsContext *c, uint16_t *dst, long dstWidth,
 
     if (c->chrToYV12) {
         c->chrToYV12(formatConvBuffer, formatConvBuffer+VOFW, src1, src2, srcW, pal);
+        /* the fast bilinear scaler reads one sample past the end of the line,
+           which may otherwise be left over from converting a luma line */
+        formatConvBuffer[srcW]= formatConvBuffer[srcW-1];
         src1= formatConvBuffer;
         src2= formatConvBuffer+VOFW;
     }
@@ -2590,6 +2596,7 @@ static int RENAME(swScale)(SwsContext *c, const uint8_t* src[], int srcStride[],
     uint8_t *formatConvBuffer= c->formatConvBuffer;
     const int chrSrcSliceY= srcSliceY >> c->chrSrcVSubSample;
     const int chrSrcSliceH= -((-srcSliceH) >> c->chrSrcVSubSample);
+    const int dstSliceEnd= c->dstSliceY + c->dstSliceH;
     int lastDstY;
     uint32_t *pal=c->pal_yuv;
 
@@ -2636,14 +2643,14 @@ static int RENAME(swScale)(SwsContext *c, const uint8_t* src[], int srcStride[],
     if (srcSliceY ==0) {
         lumBufIndex=-1;
         chrBufIndex=-1;
-        dstY=0;
+        dstY= c->dstSliceY;
         lastInLumBuf= -1;
         lastInChrBuf= -1;
     }
 
     lastDstY= dstY;
 
-    for (;dstY < dstH; dstY++) {
+    for (;dstY < dstSliceEnd; dstY++) {
         unsigned char *dest =dst[0]+dstStride[0]*dstY;
         const int chrDstY= dstY>>c->chrDstVSubSample;
         unsigned char *uDest=dst[1]+dstStride[1]*chrDstY;
@@ -686,6 +686,11 @@ int sws_setColorspaceDetails(SwsContext *c, const int inv_table[4], int srcRange
     c->saturation= saturation;
     c->srcRange  = srcRange;
     c->dstRange  = dstRange;
+    if (c->slice_ctx) {
+        int i;
+        for (i=0; i<c->thread_count; i++)
+            sws_setColorspaceDetails(c->slice_ctx[i], inv_table, srcRange, table, dstRange, brightness, contrast, saturation);
+    }
     if (isYUV(c->dstFormat) || isGray(c->dstFormat)) return -1;
 
     c->dstFormatBpp = av_get_bits_per_pixel(&av_pix_fmt_descriptors[c->dstFormat]);
@@ -818,6 +823,8 @@ int sws_init_context(SwsContext *c, SwsFilter *srcFilter, SwsFilter *dstFilter)
     c->dstFormatBpp = av_get_bits_per_pixel(&av_pix_fmt_descriptors[dstFormat]);
     c->srcFormatBpp = av_get_bits_per_pixel(&av_pix_fmt_descriptors[srcFormat]);
     c->vRounder= 4* 0x0001000100010001ULL;
+    c->dstSliceY= 0;
+    c->dstSliceH= dstH;
 
     usesVFilter = (srcFilter->lumV && srcFilter->lumV->length>1) ||
                   (srcFilter->chrV && srcFilter->chrV->length>1) ||
@@ -1127,6 +1134,11 @@ int sws_init_context(SwsContext *c, SwsFilter *srcFilter, SwsFilter *dstFilter)
                c->chrSrcW, c->chrSrcH, c->chrDstW, c->chrDstH, c->chrXInc, c->chrYInc);
     }
 
+#if HAVE_PTHREADS
+    if (c->thread_count > 1 && ff_sws_thread_init(c, srcFilter, dstFilter) < 0)
+        goto fail;
+#endif
+
     c->swScale= ff_getSwsFunc(c);
     return 0;
 fail: //FIXME replace things by appropriate error codes
@@ -1471,6 +1483,10 @@ void sws_freeContext(SwsContext *c)
     int i;
     if (!c) return;
 
+#if HAVE_PTHREADS
+    ff_sws_thread_free(c);
+#endif
+
     if (c->lumPixBuf) {
         for (i=0; i<c->vLumBufSize; i++)
             av_freep(&c->lumPixBuf[i]);
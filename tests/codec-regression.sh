@@ -65,6 +65,16 @@ do_ffmpeg $file -sameq -me_threshold 256 -mb_threshold 1024 -i ${target_path}/${
 do_video_decoding
 fi
 
+if [ -n "$do_mpeg2_b_strategy" ] ; then
+# mpeg2 encoding with the rate-distortion B-frame count decision
+do_video_encoding mpeg2-b-strategy.mpg "-qscale 10" "-vcodec mpeg2video -f mpeg1video -bf 3 -b_strategy 2"
+do_video_decoding
+
+# same, with the candidate counts estimated concurrently
+do_video_encoding mpeg2thread-b-strategy.mpg "-qscale 10" "-vcodec mpeg2video -f mpeg1video -bf 3 -b_strategy 2 -threads 2"
+do_video_decoding
+fi
+
 if [ -n "$do_msmpeg4v2" ] ; then
 do_video_encoding msmpeg4v2.avi "-qscale 10" "-an -vcodec msmpeg4v2"
 do_video_decoding
@@ -95,6 +105,11 @@ do_video_encoding h263.avi "-qscale 10" "-s 352x288 -an -vcodec h263"
 do_video_decoding
 fi
 
+if [ -n "$do_h263_frame_threads" ] ; then
+do_video_encoding h263-frame-threads.avi "-qscale 10" "-s 352x288 -an -vcodec h263"
+do_video_decoding "-threads 4"
+fi
+
 if [ -n "$do_h263p" ] ; then
 do_video_encoding h263p.avi "-qscale 2 -flags +umv+aiv+aic" "-s 352x288 -an -vcodec h263p -ps 300"
 do_video_decoding
@@ -110,6 +125,11 @@ do_video_encoding huffyuv.avi "" "-an -vcodec huffyuv -pix_fmt yuv422p -sws_flag
 do_video_decoding "" "-strict -2 -pix_fmt yuv420p -sws_flags neighbor+bitexact"
 fi
 
+if [ -n "$do_huffyuv_frame_threads" ] ; then
+do_video_encoding huffyuv-frame-threads.avi "" "-an -vcodec huffyuv -pix_fmt yuv422p -sws_flags neighbor+bitexact -threads 4"
+do_video_decoding "" "-strict -2 -pix_fmt yuv420p -sws_flags neighbor+bitexact"
+fi
+
 if [ -n "$do_rc" ] ; then
 do_video_encoding mpeg4-rc.avi "-b 400k -bf 2" "-an -vcodec mpeg4"
 do_video_decoding
@@ -134,6 +154,11 @@ do_video_encoding mpeg4-thread.avi "-b 500k -flags +mv4+part+aic -trellis 1 -mbd
 do_video_decoding
 fi
 
+if [ -n "$do_mpeg4_frame_threads" ] ; then
+do_video_encoding mpeg4-frame-threads.avi "-b 550k -bf 2 -flags +mv4+mv0 -trellis 1 -cmp 1 -subcmp 2 -mbd rd -scplx_mask 0.3" "-an -vcodec mpeg4"
+do_video_decoding "-threads 4"
+fi
+
 if [ -n "$do_error" ] ; then
 do_video_encoding error-mpeg4-adv.avi "-qscale 7 -flags +mv4+part+aic -mbd rd -ps 250 -error 10" "-an -vcodec mpeg4"
 do_video_decoding
@@ -154,6 +179,11 @@ do_video_encoding mjpeg.avi "-qscale 9" "-an -vcodec mjpeg -pix_fmt yuvj420p"
 do_video_decoding "" "-pix_fmt yuv420p"
 fi
 
+if [ -n "$do_mjpeg_frame_threads" ] ; then
+do_video_encoding mjpeg-frame-threads.avi "-qscale 9" "-an -vcodec mjpeg -pix_fmt yuvj420p"
+do_video_decoding "-threads 4" "-pix_fmt yuv420p"
+fi
+
 if [ -n "$do_ljpeg" ] ; then
 do_video_encoding ljpeg.avi "" "-an -vcodec ljpeg -strict -1"
 do_video_decoding
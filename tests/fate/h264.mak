@@ -169,6 +169,22 @@ FATE_H264  := $(FATE_H264:%=fate-h264-conformance-%)                    \
               fate-h264-lossless                                        \
               fate-h264-extreme-plane-pred                              \
 
+# decoding with frame threads must give the output of the tests without
+define FATE_H264_THREADS
+FATE_H264 += fate-h264-threads-$(1)
+fate-h264-threads-$(1): CMD = framecrc -threads 4 $(2)
+fate-h264-threads-$(1): REF = $(SRC_PATH_BARE)/tests/ref/fate/h264-conformance-$(1)
+endef
+
+$(eval $(call FATE_H264_THREADS,caba3_toshiba_e,-i $(SAMPLES)/h264-conformance/CABA3_TOSHIBA_E.264))
+$(eval $(call FATE_H264_THREADS,cabac_mot_fld0_full,-vsync 0 -strict 1 -i $(SAMPLES)/h264-conformance/camp_mot_fld0_full.26l))
+$(eval $(call FATE_H264_THREADS,cabac_mot_mbaff0_full,-vsync 0 -strict 1 -i $(SAMPLES)/h264-conformance/camp_mot_mbaff0_full.26l))
+$(eval $(call FATE_H264_THREADS,cama1_vtc_c,-vsync 0 -strict 1 -i $(SAMPLES)/h264-conformance/cama1_vtc_c.avc))
+$(eval $(call FATE_H264_THREADS,cvmp_mot_frm_l31_b,-vsync 0 -strict 1 -i $(SAMPLES)/h264-conformance/CVMP_MOT_FRM_L31_B.26l))
+$(eval $(call FATE_H264_THREADS,frext-hpcv_brcm_a,-i $(SAMPLES)/h264-conformance/FRext/HPCV_BRCM_A.264))
+$(eval $(call FATE_H264_THREADS,mr9_bt_b,-vsync 0 -strict 1 -i $(SAMPLES)/h264-conformance/MR9_BT_B.h264))
+$(eval $(call FATE_H264_THREADS,sharp_mp_paff_1r2,-vsync 0 -strict 1 -i $(SAMPLES)/h264-conformance/Sharp_MP_PAFF_1r2.jvt))
+
 FATE_TESTS += $(FATE_H264)
 fate-h264: $(FATE_H264)
 
@@ -16,5 +16,6 @@ endef
 
 $(eval $(call FATE_VP8_FULL))
 $(eval $(call FATE_VP8_FULL,-emu-edge,-flags emu_edge))
+$(eval $(call FATE_VP8_FULL,-threads,-threads 4))
 FATE_TESTS += $(FATE_VP8)
 fate-vp8: $(FATE_VP8)
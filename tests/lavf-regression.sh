@@ -51,6 +51,13 @@ if [ -n "$do_avi" ] ; then
 do_lavf avi
 fi
 
+if [ -n "$do_async" ] ; then
+file=${outfile}async.avi
+do_ffmpeg $file -t 1 -qscale 10 -f image2 -vcodec pgmyuv -i $raw_src -f s16le -i $pcm_src
+do_ffmpeg_crc $file -i async:$target_path/$file
+do_ffmpeg_crc $file -i async:buffer_size=65536:$target_path/$file
+fi
+
 if [ -n "$do_asf" ] ; then
 do_lavf asf "-acodec mp2" "-r 25"
 fi
@@ -91,6 +98,12 @@ if [ -n "$do_mov" ] ; then
 do_lavf mov "-acodec pcm_alaw"
 fi
 
+if [ -n "$do_mov_frag" ] ; then
+file=${outfile}lavf_frag.mov
+do_ffmpeg $file -t 1 -qscale 10 -f image2 -vcodec pgmyuv -i $raw_src -f s16le -i $pcm_src -acodec pcm_alaw -movflags frag_keyframe
+do_ffmpeg_crc $file -i $target_path/$file
+fi
+
 if [ -n "$do_dv_fmt" ] ; then
 do_lavf dv "-ar 48000 -r 25 -s pal -ac 2"
 fi
@@ -27,7 +27,7 @@ do_lavfi() {
     vfilters="slicify=random,$2"
 
     if [ $test = $1 ] ; then
-        do_video_filter $test "$vfilters"
+        do_video_filter $test "$vfilters" $3
     fi
 }
 
@@ -38,6 +38,7 @@ do_lavfi "crop_vflip"         "crop=iw-100:ih-100:100:100,vflip"
 do_lavfi "null"               "null"
 do_lavfi "scale200"           "scale=200:200"
 do_lavfi "scale500"           "scale=500:500"
+do_lavfi "scale500_threads"   "scale=500:500"         "-threads 4"
 do_lavfi "vflip"              "vflip"
 do_lavfi "vflip_crop"         "vflip,crop=iw-100:ih-100:100:100"
 do_lavfi "vflip_vflip"        "vflip,vflip"